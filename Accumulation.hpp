@@ -0,0 +1,132 @@
+#ifndef ACCUMULATION_HPP
+#define ACCUMULATION_HPP
+
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "thread_pool.hpp"
+#include "Image.h"
+#include "Utils.hpp"
+
+using namespace std;
+
+/**
+ Floating point buffer accumulating the samples of the pixels of an image, rendered progressively. Each pixel keeps
+ the running mean of its samples and the sum of their squared deviations (Welford's method, which does not lose
+ the variance to cancellation after many samples), from which the noise left in its mean is estimated.
+ */
+class AccumulationBuffer {
+public:
+	const int width, height;
+
+	AccumulationBuffer(int width, int height): width(width), height(height),
+		means(width * height, glm::vec3(0.0)), deviations(width * height, glm::vec3(0.0)), counts(width * height, 0) {
+	}
+
+	/** Adds a sample to the pixel of index y * width + x. */
+	void add(int pixel, const glm::vec3 &sample) {
+		uint32_t n = ++counts[pixel];
+		glm::vec3 delta = sample - means[pixel];
+		means[pixel] += delta / (float)n;
+		deviations[pixel] += delta * (sample - means[pixel]);
+	}
+
+	/** Mean of the samples of a pixel. */
+	[[nodiscard]] glm::vec3 mean(int pixel) const {
+		return means[pixel];
+	}
+
+	/** Number of samples of a pixel. */
+	[[nodiscard]] uint32_t samples(int pixel) const {
+		return counts[pixel];
+	}
+
+	/**
+	 Estimate of the noise left in the mean of a pixel, in 8-bit levels of the tone mapped image: the change of the
+	 tone mapped color, in its most changed channel, when the mean moves by its standard error. Following the tone
+	 mapping, the same variance is more visible in the dark pixels than in the bright ones.
+	 */
+	[[nodiscard]] float noise(int pixel) const {
+		uint32_t n = counts[pixel];
+		if (n < 2) return INFINITY;
+		glm::vec3 error = glm::sqrt(deviations[pixel] / ((float)(n - 1) * (float)n));
+		glm::vec3 d = glm::abs(toneMapping(means[pixel] + error) - toneMapping(means[pixel]));
+		return 255.0f * max(d.x, max(d.y, d.z));
+	}
+
+	/** Writes the tone mapped means to an image of the same size. */
+	void write(Image &image) const {
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) image.setPixel(x, y, toneMapping(means[y * width + x]));
+		}
+	}
+
+private:
+	vector<glm::vec3> means;
+	vector<glm::vec3> deviations;
+	vector<uint32_t> counts;
+};
+
+/** Stopping rule of render_progressive. */
+struct ProgressiveSettings {
+	float noise = 4; ///< A block stops being sampled when its noise is below, in 8-bit levels
+	uint32_t minSamples = 16; ///< Samples of a pixel before its noise is trusted
+	uint32_t maxSamples = 1024; ///< Largest number of samples of a pixel
+	int block = 8; ///< Side of the square blocks of pixels which stop together
+};
+
+/**
+ Renders an image progressively into an accumulation buffer: each pass adds one sample to every pixel of the blocks
+ whose noise is still above the threshold of the settings, so that the time spent on a region follows its
+ difficulty, until every block has converged or has maxSamples samples per pixel. The noise of a block is the root
+ mean square of the noise of its pixels (AccumulationBuffer::noise): the rare paths which carry much more light
+ than the others, through a small bright area, are missed by the first samples of most pixels, whose own estimate
+ is then far too low, but are found by some pixels of the block. The blocks are sampled in parallel, by rows.
+ @param sample function of the pixel coordinates (x, y) and of the pass, giving a sample of the color of the pixel
+ @param frame function called after each pass with the number of passes done and the number of pixels still
+ sampled, such as to write an intermediate image
+ @return the number of passes
+ */
+template<typename Sample, typename Frame>
+uint32_t render_progressive(AccumulationBuffer &buffer, const ProgressiveSettings &settings, thread_pool &pool, Sample sample, Frame frame) {
+	int width = buffer.width, height = buffer.height, side = settings.block;
+	int columns = (width + side - 1) / side, rows = (height + side - 1) / side;
+	vector<uint8_t> converged(columns * rows, 0);
+	uint32_t pass = 0;
+	long active = (long)width * height;
+	while (active > 0 && pass < settings.maxSamples) {
+		atomic<long> remaining(0);
+		pool.parallelize_loop(0, rows, [&](int first, int last) {
+			long count = 0;
+			for (int by = first; by < last; by++) {
+				for (int bx = 0; bx < columns; bx++) {
+					if (converged[by * columns + bx]) continue;
+					int x_max = min(width, (bx + 1) * side), y_max = min(height, (by + 1) * side);
+					double squared = 0;
+					for (int y = by * side; y < y_max; y++) {
+						for (int x = bx * side; x < x_max; x++) {
+							int pixel = y * width + x;
+							buffer.add(pixel, sample(x, y, pass));
+							float noise = buffer.noise(pixel);
+							squared += noise * noise;
+						}
+					}
+					int pixels = (x_max - bx * side) * (y_max - by * side);
+					if (pass + 1 >= settings.minSamples && squared < settings.noise * settings.noise * pixels) converged[by * columns + bx] = 1;
+					else count += pixels;
+				}
+			}
+			remaining += count;
+		}, (uint32_t)rows);
+		active = remaining;
+		pass++;
+		frame(pass, active);
+	}
+	return pass;
+}
+
+#endif
@@ -8,7 +8,9 @@
 #include <limits>
 
 #include "glm/glm.hpp"
+#include "CPU.hpp"
 #include "Triangle.hpp"
+#include "TrianglePacket.hpp"
 #include "Ray.hpp"
 #include "Hit.hpp"
 #include "OBJ.hpp"
@@ -18,70 +20,94 @@
 using namespace std;
 using namespace OBJ;
 
+/**
+ Layout of the triangles stored in the leaves, chosen when the hierarchy is built.
+ */
+enum class TriangleStorage {
+	VERTICES, ///< Only the indices of the triangles, whose vertices are read from the model and tested with intersectTriangle
+	TRANSFORM, ///< Additional precomputed affine transform per triangle, tested with TriangleTransform::intersect
+	PACKET ///< Leaves of up to TrianglePacket::width triangles, tested all at once with TrianglePacket::intersect
+};
+
 struct BoundingBox {
 	glm::vec3 min, max;
-	vector<Triangle> triangles;
+	vector<uint32_t> triangles; ///< Indices in the model of the triangles of a leaf
+	vector<TriangleTransform> transforms; ///< Transforms of the triangles, only filled with TriangleStorage::TRANSFORM
+	vector<TrianglePacket> packets; ///< Packets of the triangles, only filled with TriangleStorage::PACKET
 	int maxSize = 1;
 	BoundingBox *left = nullptr, *right = nullptr;
 	Model *model = nullptr;
+	TriangleStorage storage = TriangleStorage::VERTICES;
 	int level;
 
 	BoundingBox() {};
 
     /**
      * Recursive bounding box constructor. Creates an axis aligned bounding box hierarchy.
-     * @param T vector of triangles to store.
+     * @param first,last range of the indices of the triangles to store, reordered in place.
+     * @param centroids centroids of all the triangles of the model.
      * @param axis the axis (x,y,z) currently considered.
      * @param m pointer to the model.
      * @param l the level of the tree.
+     * @param s the layout of the triangles in the leaves.
+     */
+	BoundingBox(uint32_t *first, uint32_t *last, const vector<glm::vec3> &centroids, int axis, Model *m, int l, TriangleStorage s) {
+		build(first, last, centroids, axis, m, l, s);
+	}
+
+    /**
+     * Creates an axis aligned bounding box hierarchy for the given Model.
+     * @param M the Model, which must outlive the hierarchy.
+     * @param s the layout of the triangles in the leaves.
      */
-	BoundingBox(vector<Triangle> &T, int axis, Model *m, int l) {
+	explicit BoundingBox(Model &M, TriangleStorage s = TriangleStorage::PACKET) {
+		vector<uint32_t> order(M.size());
+		vector<glm::vec3> centroids(M.size());
+		for (size_t i = 0; i < M.size(); i++) {
+			order[i] = (uint32_t)i;
+			centroids[i] = (M.vertex(i, 0) + M.vertex(i, 1) + M.vertex(i, 2)) / 3.0f;
+		}
+		build(order.data(), order.data() + order.size(), centroids, 0, &M, 0, s);
+	};
+
+	// Builds the node for the given range of triangles, see the recursive constructor.
+	void build(uint32_t *first, uint32_t *last, const vector<glm::vec3> &centroids, int axis, Model *m, int l, TriangleStorage s) {
 		level = l;
 		model = m;
-		if (T.size() == 0) {
+		storage = s;
+		if (storage == TriangleStorage::PACKET) maxSize = TrianglePacket::width;
+		if (first == last) {
 			cout << "Empty Bounding Box" << endl;
 			throw "Empty triangle vector";
 		}
 		// if there is space, add the triangles
-		if (T.size() <= maxSize) {
+		if (last - first <= maxSize) {
 			min = FLOAT_INFINITY * glm::vec3(1, 1, 1);
 			max = -FLOAT_INFINITY * glm::vec3(1, 1, 1);
-			for (auto &t : T) {
-                for (int d = 0; d < 3; d++) {
-					min[d] = std::min(min[d], t.min[d]);
-					max[d] = std::max(max[d], t.max[d]);
-				}
-				if (model) {
-					t.setTransformation(glm::mat4(1.0f));
-					t.setMaterial(model->material);
+			for (uint32_t *i = first; i != last; i++) {
+				const glm::vec3 &a = model->vertex(*i, 0), &b = model->vertex(*i, 1), &c = model->vertex(*i, 2);
+				min = glm::min(min, glm::min(a, glm::min(b, c)));
+				max = glm::max(max, glm::max(a, glm::max(b, c)));
+				triangles.push_back(*i);
+				if (storage == TriangleStorage::TRANSFORM) transforms.emplace_back(a, b, c);
+				if (storage == TriangleStorage::PACKET) {
+					if (packets.empty() || packets.back().count == TrianglePacket::width) packets.emplace_back();
+					packets.back().add(a, b, c);
 				}
-				triangles.push_back(t);
 			}
 			return;
-		} else { // otherwise split them along the axis and set the left and right pointers
-			sort(T.begin(), T.end(), [axis](Triangle a, Triangle b) {
-				return a.o[axis] < b.o[axis];
+		} else { // otherwise split them at the median along the axis and set the left and right pointers
+			uint32_t *mid = first + (last - first) / 2;
+			nth_element(first, mid, last, [&centroids, axis](uint32_t a, uint32_t b) {
+				return centroids[a][axis] < centroids[b][axis];
 			});
 
-			int mid = T.size() / 2;
-			vector<Triangle> leftT(T.begin(), T.begin() + mid);
-			vector<Triangle> rightT(T.begin() + mid, T.end());
-
-			left = new BoundingBox(leftT, (axis + 1) % 3, model, l + 1);
-			right = new BoundingBox(rightT, (axis + 1) % 3, model, l + 1);
-			for (int d = 0; d < 3; d++) {
-				min[d] = std::min(left->min[d], right->min[d]);
-				max[d] = std::max(left->max[d], right->max[d]);
-			}
+			left = new BoundingBox(first, mid, centroids, (axis + 1) % 3, model, l + 1, storage);
+			right = new BoundingBox(mid, last, centroids, (axis + 1) % 3, model, l + 1, storage);
+			min = glm::min(left->min, right->min);
+			max = glm::max(left->max, right->max);
 		}
 	}
-	explicit BoundingBox(vector<Triangle> &T) : BoundingBox(T, 0, nullptr, 0) {};
-
-    /**
-     * Creates an axis aligned bounding box hierarchy for the given Model.
-     * @param M the Model.
-     */
-	explicit BoundingBox(Model &M) : BoundingBox(M.triangles, 0, &M, 0) {};
 
 	~BoundingBox() {
 		delete left;
@@ -112,42 +138,191 @@ struct BoundingBox {
 		return ((tmin < t1) && (tmax > t0));
 	}
 
-    // Recursive ray intersection function.
+    // Ray intersection function, the ray is transformed into the coordinate system of the model only once.
 	[[nodiscard]] Hit trace_ray(const Ray &ray) const {
-		Ray R = ray;
-		if (model) {
-			glm::vec3 local_o = model->inverseTransformationMatrix * glm::vec4(ray.origin, 1.0);
-			glm::vec3 local_d = model->inverseTransformationMatrix * glm::vec4(ray.direction, 0.0);
-			local_d = glm::normalize(local_d);
-			R = Ray(local_o, local_d);
+		if (!model) return {}; // empty hierarchy
+		glm::vec3 local_o = model->inverseTransformationMatrix * glm::vec4(ray.origin, 1.0);
+		glm::vec3 local_d = model->inverseTransformationMatrix * glm::vec4(ray.direction, 0.0);
+		Ray R(local_o, glm::normalize(local_d));
+		Hit bestHit;
+		float bestT = FLOAT_INFINITY;
+		if (intersect(R)) trace_ray(R, ray, bestHit, bestT);
+		return bestHit;
+	}
+
+    /**
+     * Recursive ray intersection function. The children are visited front to back, and skipped
+     * when they are farther than the closest hit found so far.
+     * @param R the ray in the coordinate system of the model.
+     * @param ray the ray in the global coordinate system.
+     * @param bestHit the closest hit so far.
+     * @param bestT the distance along R of bestHit.
+     */
+	void trace_ray(const Ray &R, const Ray &ray, Hit &bestHit, float &bestT) const {
+		if (!left) {
+			intersectLeaf(R, ray, bestHit, bestT);
+			return;
 		}
-		Hit bestHit, tmpHit;
-		if (intersect(R)) {
-			if (left) tmpHit = left->trace_ray(ray);
-			if (tmpHit.distance < bestHit.distance) bestHit = tmpHit;
-			if (right) tmpHit = right->trace_ray(ray);
-			if (tmpHit.distance < bestHit.distance) bestHit = tmpHit;
-			if (!triangles.empty()) {
-				for (Triangle t : triangles) {
-					tmpHit = t.intersect(R);
-					if (tmpHit.hit) {
-						if (model) {
-							tmpHit.intersection = model->transformationMatrix * glm::vec4(tmpHit.intersection, 1.0);
-							tmpHit.normal = model->normalMatrix * glm::vec4(tmpHit.normal, 0.0);
-							tmpHit.distance = glm::length(tmpHit.intersection - ray.origin);
-							tmpHit.debug = true;
-						}
-                        if (tmpHit.distance < bestHit.distance) {
-                            bestHit = tmpHit;
-                            bestHit.normal = glm::normalize(bestHit.normal);
-                        }
-					}
+		float t[2];
+		int mask = boxesKernel(*left, *right, R, bestT, t);
+		if (mask == 3) {
+			bool swap = t[1] < t[0];
+			(swap ? right : left)->trace_ray(R, ray, bestHit, bestT);
+			if ((swap ? t[0] : t[1]) <= bestT) (swap ? left : right)->trace_ray(R, ray, bestHit, bestT);
+		} else if (mask == 1) {
+			left->trace_ray(R, ray, bestHit, bestT);
+		} else if (mask == 2) {
+			right->trace_ray(R, ray, bestHit, bestT);
+		}
+	}
+
+	// Intersects the ray with the triangles of a leaf, see trace_ray.
+	void intersectLeaf(const Ray &R, const Ray &ray, Hit &bestHit, float &bestT) const {
+		if (storage == TriangleStorage::PACKET) {
+			for (size_t p = 0; p < packets.size(); p++) {
+				float t, u, v;
+				int lane = packets[p].intersect(R, t, u, v);
+				if (lane >= 0) keepClosest(R, ray, triangles[p * TrianglePacket::width + lane], t, u, v, bestHit, bestT);
+			}
+		} else if (storage == TriangleStorage::TRANSFORM) {
+			for (size_t i = 0; i < transforms.size(); i++) {
+				float t, u, v;
+				if (transforms[i].intersect(R, t, u, v)) keepClosest(R, ray, triangles[i], t, u, v, bestHit, bestT);
+			}
+		} else {
+			for (uint32_t i : triangles) {
+				float t, u, v;
+				if (intersectTriangle(model->vertex(i, 0), model->vertex(i, 1), model->vertex(i, 2), R, t, u, v)) {
+					keepClosest(R, ray, i, t, u, v, bestHit, bestT);
 				}
 			}
 		}
-		return bestHit;
 	}
 
+    /**
+     * Replaces bestHit with the hit of R with the triangle, if it is closer.
+     * @param R the ray in the coordinate system of the model.
+     * @param ray the ray in the global coordinate system.
+     * @param index the index in the model of the triangle which was hit.
+     * @param t the distance of the hit along R.
+     * @param u,v the barycentric coordinates of the hit, used to interpolate the normals and texture coordinates of the vertices.
+     * @param bestHit the closest hit so far.
+     * @param bestT the distance along R of bestHit.
+     */
+	void keepClosest(const Ray &R, const Ray &ray, uint32_t index, float t, float u, float v, Hit &bestHit, float &bestT) const {
+		if (t >= bestT) return;
+		bestT = t;
+		glm::vec3 intersection = model->transformationMatrix * glm::vec4(R.origin + t * R.direction, 1.0);
+		glm::vec3 normal = model->normalMatrix * glm::vec4(model->normal(index, u, v), 0.0);
+		bestHit.hit = true;
+		bestHit.intersection = intersection;
+		bestHit.normal = glm::normalize(normal);
+		bestHit.uv = model->texcoord(index, u, v);
+		bestHit.uvDensity = model->texcoordDensity(index);
+		bestHit.materialId = model->triangleMaterial(index);
+		bestHit.distance = glm::length(intersection - ray.origin);
+		bestHit.object = model;
+	}
+
+	/**
+	 Selects the kernel used to intersect the children of the nodes for the given instruction set. AVX-512 processors
+	 use the AVX2 kernel, the two boxes filling eight lanes.
+	 */
+	static void selectKernel(CPU::ISA isa) {
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512:
+			case CPU::ISA::AVX2: boxesKernel = &intersectBoxesAVX2; break;
+			case CPU::ISA::SSE42: boxesKernel = &intersectBoxesSSE42; break;
+#endif
+			default: boxesKernel = &intersectBoxesScalar;
+		}
+	}
+
+    /**
+     * Reference kernel intersecting a ray with two boxes at once (slab test).
+     * @param a,b the boxes.
+     * @param ray the ray.
+     * @param tmax the distance beyond which the boxes are not considered hit.
+     * @param t the distances at which the ray enters the boxes, written for the boxes which are hit.
+     * @return a bit mask of the boxes which are hit, 1 for a and 2 for b.
+     */
+	static int intersectBoxesScalar(const BoundingBox &a, const BoundingBox &b, const Ray &ray, float tmax, float t[2]) {
+		int mask = 0;
+		const BoundingBox *boxes[] = {&a, &b};
+		for (int i = 0; i < 2; i++) {
+			float tnear = 0, tfar = tmax;
+			for (int d = 0; d < 3; d++) {
+				float t0 = (boxes[i]->min[d] - ray.origin[d]) * ray.inv_direction[d];
+				float t1 = (boxes[i]->max[d] - ray.origin[d]) * ray.inv_direction[d];
+				tnear = std::max(tnear, std::min(t0, t1));
+				tfar = std::min(tfar, std::max(t0, t1));
+			}
+			if (tnear <= tfar) {
+				t[i] = tnear;
+				mask |= 1 << i;
+			}
+		}
+		return mask;
+	}
+
+#ifdef CPU_X86
+	/** SSE4.2 kernel, one box per register with the x, y, z slabs in the first three lanes. */
+	TARGET_SSE42 static int intersectBoxesSSE42(const BoundingBox &a, const BoundingBox &b, const Ray &ray, float tmax, float t[2]) {
+		const __m128 o = _mm_setr_ps(ray.origin.x, ray.origin.y, ray.origin.z, 0);
+		const __m128 inv = _mm_setr_ps(ray.inv_direction.x, ray.inv_direction.y, ray.inv_direction.z, 1);
+		const float inf = FLOAT_INFINITY;
+		int mask = 0;
+		const BoundingBox *boxes[] = {&a, &b};
+		for (int i = 0; i < 2; i++) {
+			// the unused lane spans the whole line so that it never limits the interval
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(boxes[i]->min.x, boxes[i]->min.y, boxes[i]->min.z, -inf), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_setr_ps(boxes[i]->max.x, boxes[i]->max.y, boxes[i]->max.z, inf), o), inv);
+			__m128 tnear = _mm_min_ps(t0, t1), tfar = _mm_max_ps(t0, t1);
+			tnear = _mm_max_ps(tnear, _mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(2, 3, 0, 1)));
+			tnear = _mm_max_ps(tnear, _mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(1, 0, 3, 2)));
+			tfar = _mm_min_ps(tfar, _mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(2, 3, 0, 1)));
+			tfar = _mm_min_ps(tfar, _mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(1, 0, 3, 2)));
+			float n = std::max(_mm_cvtss_f32(tnear), 0.0f), f = std::min(_mm_cvtss_f32(tfar), tmax);
+			if (n <= f) {
+				t[i] = n;
+				mask |= 1 << i;
+			}
+		}
+		return mask;
+	}
+
+	/** AVX2 kernel, both boxes in one register: x, y, z of a in the lower half and of b in the upper half. */
+	TARGET_AVX2 static int intersectBoxesAVX2(const BoundingBox &a, const BoundingBox &b, const Ray &ray, float tmax, float t[2]) {
+		const __m128 o4 = _mm_setr_ps(ray.origin.x, ray.origin.y, ray.origin.z, 0);
+		const __m128 inv4 = _mm_setr_ps(ray.inv_direction.x, ray.inv_direction.y, ray.inv_direction.z, 1);
+		const __m256 o = _mm256_set_m128(o4, o4), inv = _mm256_set_m128(inv4, inv4);
+		const float inf = FLOAT_INFINITY;
+		__m256 lo = _mm256_setr_ps(a.min.x, a.min.y, a.min.z, -inf, b.min.x, b.min.y, b.min.z, -inf);
+		__m256 hi = _mm256_setr_ps(a.max.x, a.max.y, a.max.z, inf, b.max.x, b.max.y, b.max.z, inf);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(hi, o), inv);
+		__m256 tnear = _mm256_min_ps(t0, t1), tfar = _mm256_max_ps(t0, t1);
+		// reductions within each 128-bit half, i.e. within each box
+		tnear = _mm256_max_ps(tnear, _mm256_shuffle_ps(tnear, tnear, _MM_SHUFFLE(2, 3, 0, 1)));
+		tnear = _mm256_max_ps(tnear, _mm256_shuffle_ps(tnear, tnear, _MM_SHUFFLE(1, 0, 3, 2)));
+		tfar = _mm256_min_ps(tfar, _mm256_shuffle_ps(tfar, tfar, _MM_SHUFFLE(2, 3, 0, 1)));
+		tfar = _mm256_min_ps(tfar, _mm256_shuffle_ps(tfar, tfar, _MM_SHUFFLE(1, 0, 3, 2)));
+		tnear = _mm256_max_ps(tnear, _mm256_setzero_ps());
+		tfar = _mm256_min_ps(tfar, _mm256_set1_ps(tmax));
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+		alignas(32) float n[8];
+		_mm256_store_ps(n, tnear);
+		t[0] = n[0];
+		t[1] = n[4];
+		return (mask & 1) | ((mask >> 3) & 2);
+	}
+#endif
+
+	/** Signature of the kernels, see intersectBoxesScalar */
+	typedef int (*BoxesKernel)(const BoundingBox &a, const BoundingBox &b, const Ray &ray, float tmax, float t[2]);
+	static inline BoxesKernel boxesKernel = &intersectBoxesScalar; ///< Kernel used by trace_ray, see selectKernel
+
 	int boxes() const {
 		return 1 + (left ? left->boxes() : 0) + (right ? right->boxes() : 0);
 	}
@@ -160,6 +335,12 @@ struct BoundingBox {
 	int depth() const {
 		return 1 + std::max((left ? left->depth() : 0), (right ? right->depth() : 0));
 	}
+	/** Number of bytes used by the hierarchy, including the triangles stored in the leaves but not the model. */
+	size_t memory() const {
+		return sizeof(BoundingBox) + triangles.capacity() * sizeof(uint32_t) + transforms.capacity() * sizeof(TriangleTransform)
+			+ packets.capacity() * sizeof(TrianglePacket)
+			+ (left ? left->memory() : 0) + (right ? right->memory() : 0);
+	}
 
 };
 
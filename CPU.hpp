@@ -0,0 +1,73 @@
+#ifndef CPU_HPP
+#define CPU_HPP
+
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86
+#include <immintrin.h>
+/// Compiles a function for a given instruction set, independently of the flags passed to the compiler
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+#endif
+
+using namespace std;
+
+/**
+ Detection of the instruction sets supported by the CPU. The hot kernels (boxes, triangles, spheres,
+ shading) come in one variant per instruction set, and the best one supported by the host is selected
+ once at startup with selectKernels, so that the build does not depend on -march.
+ */
+namespace CPU {
+
+/** Instruction sets for which kernels are compiled, from the least to the most capable */
+enum class ISA {
+	SCALAR, ///< Plain C++, used on every other architecture
+	SSE42, ///< 4-wide SSE up to SSE4.2
+	AVX2, ///< 8-wide AVX2 with FMA
+	AVX512 ///< AVX-512 (F and VL) with mask registers
+};
+
+const char *name(ISA isa) {
+	switch (isa) {
+		case ISA::SSE42: return "sse4.2";
+		case ISA::AVX2: return "avx2";
+		case ISA::AVX512: return "avx512";
+		default: return "scalar";
+	}
+}
+
+/**
+ Parses the name of an instruction set, as returned by name.
+ @return whether the name is valid
+ */
+bool parse(const string &s, ISA &isa) {
+	for (ISA i : {ISA::SCALAR, ISA::SSE42, ISA::AVX2, ISA::AVX512}) {
+		if (s == name(i)) {
+			isa = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Queries cpuid for the most capable instruction set supported by the CPU and the operating system. */
+ISA detect() {
+#ifdef CPU_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) return ISA::AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return ISA::AVX2;
+	if (__builtin_cpu_supports("sse4.2")) return ISA::SSE42;
+#endif
+	return ISA::SCALAR;
+}
+
+/** Whether the kernels of the instruction set can run on this CPU. */
+bool supported(ISA isa) {
+	return isa <= detect();
+}
+
+} // namespace CPU
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef CLUSTEREDMESH_HPP
+#define CLUSTEREDMESH_HPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+#include "glm/glm.hpp"
+#include "Object.hpp"
+#include "Hit.hpp"
+#include "Ray.hpp"
+#include "OBJ.hpp"
+#include "BoundingBox.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+using namespace OBJ;
+
+/**
+ Out-of-core triangle mesh. The mesh is split once into spatially coherent clusters which are written to a
+ file (see write). The file is then memory mapped, and a cluster is only paged in, copied into a Model and
+ given its own hierarchy of bounding boxes when a ray reaches its bounds. The resident clusters are kept
+ under a memory budget by evicting the least recently used ones, so that meshes larger than the memory can
+ be rendered. The mesh is safe to intersect from several threads.
+
+ File layout (native endianness): a Header, clusterCount Entry, then for each cluster its vertices,
+ normals, vertex indices and normal indices, at the offset given by its entry. Texture coordinates, groups
+ and per-triangle materials are not kept.
+ */
+class ClusteredMesh : public Object {
+public:
+	struct Header {
+		char magic[8]; ///< "CGCMESH" followed by a null byte
+		uint32_t version;
+		uint32_t clusterCount;
+	};
+
+	struct Entry {
+		glm::vec3 min, max; ///< Bounds of the cluster, in the coordinate system of the mesh
+		uint64_t offset; ///< Position of the data of the cluster from the beginning of the file
+		uint32_t vertexCount, normalCount, triangleCount;
+		uint32_t padding;
+	};
+
+	static const uint32_t version = 1;
+
+	bool good = false;
+
+	/** Path of the clusters file of a mesh file, next to it like its cache (see MeshCache::path). */
+	static string path(const string &mesh) {
+		return mesh + ".clusters";
+	}
+
+	/**
+	 Maps a file written by write.
+	 @param path the clusters file
+	 @param budget number of bytes the resident clusters may use; the last cluster used is always kept
+	 */
+	ClusteredMesh(const string &path, size_t budget) : file(path), budget(budget) {
+		setTransformation(glm::mat4(1.0f));
+		if (!file.good) return;
+		Header header{};
+		if (file.size >= sizeof(Header)) memcpy(&header, file.data, sizeof(Header));
+		if (memcmp(header.magic, "CGCMESH", sizeof(header.magic)) != 0 || header.version != version
+			|| sizeof(Header) + header.clusterCount * sizeof(Entry) > file.size) {
+			cerr << "Invalid clusters file " << path << endl;
+			return;
+		}
+		entries.resize(header.clusterCount);
+		memcpy(entries.data(), file.data + sizeof(Header), entries.size() * sizeof(Entry));
+		for (auto &e : entries) {
+			if (e.offset + dataSize(e) > file.size) {
+				cerr << "Truncated clusters file " << path << endl;
+				return;
+			}
+		}
+		resident.resize(entries.size());
+		lruPosition.resize(entries.size());
+		vector<uint32_t> order(entries.size());
+		for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+		if (!order.empty()) build(order, 0, order.size(), 0);
+		good = true;
+	}
+
+	ClusteredMesh(const ClusteredMesh &) = delete;
+	ClusteredMesh &operator=(const ClusteredMesh &) = delete;
+
+	/**
+	 Splits the model into clusters of at most maxTriangles spatially close triangles (median splits of the
+	 centroids, like the hierarchy of bounding boxes) and writes them to a file. Each cluster gets its own
+	 copy of the vertices and normals it uses.
+	 @return whether the file could be written
+	 */
+	static bool write(const Model &model, const string &path, uint32_t maxTriangles = 4096) {
+		vector<uint32_t> order(model.size());
+		vector<glm::vec3> centroids(model.size());
+		for (size_t i = 0; i < model.size(); i++) {
+			order[i] = (uint32_t)i;
+			centroids[i] = (model.vertex(i, 0) + model.vertex(i, 1) + model.vertex(i, 2)) / 3.0f;
+		}
+		vector<pair<size_t, size_t>> ranges;
+		split(order, centroids, 0, order.size(), 0, std::max(maxTriangles, 1u), ranges);
+
+		ofstream file(path, ios::binary | ios::trunc);
+		if (!file.is_open()) {
+			cerr << "Could not write file " << path << endl;
+			return false;
+		}
+		Header header{};
+		strcpy(header.magic, "CGCMESH");
+		header.version = version;
+		header.clusterCount = (uint32_t)ranges.size();
+		vector<Entry> entries(ranges.size());
+		file.write((const char *)&header, sizeof(Header));
+		file.write((const char *)entries.data(), entries.size() * sizeof(Entry));
+
+		// local index of each vertex and normal of the model in the current cluster, or -1
+		vector<int64_t> vertexMap(model.compressed ? model.quantizedVertices.size() : model.vertices.size(), -1);
+		vector<int64_t> normalMap(model.compressed ? model.octahedralNormals.size() : model.normals.size(), -1);
+		uint64_t offset = sizeof(Header) + entries.size() * sizeof(Entry);
+		for (size_t c = 0; c < ranges.size(); c++) {
+			vector<glm::vec3> vertices, normals;
+			vector<glm::uvec3> vertexIndices, normalIndices;
+			Entry &e = entries[c];
+			e.min = glm::vec3(FLOAT_INFINITY);
+			e.max = glm::vec3(-FLOAT_INFINITY);
+			for (size_t k = ranges[c].first; k < ranges[c].second; k++) {
+				uint32_t i = order[k];
+				glm::uvec3 v, n;
+				for (int j = 0; j < 3; j++) {
+					int64_t &lv = vertexMap[model.vertexIndices[i][j]];
+					if (lv < 0) {
+						lv = (int64_t)vertices.size();
+						vertices.push_back(model.vertex(i, j));
+						e.min = glm::min(e.min, vertices.back());
+						e.max = glm::max(e.max, vertices.back());
+					}
+					int64_t &ln = normalMap[model.normalIndices[i][j]];
+					if (ln < 0) {
+						ln = (int64_t)normals.size();
+						normals.push_back(model.normal(i, j));
+					}
+					v[j] = (unsigned int)lv;
+					n[j] = (unsigned int)ln;
+				}
+				vertexIndices.push_back(v);
+				normalIndices.push_back(n);
+			}
+			// reset the maps for the next cluster, only where they were used
+			for (size_t k = ranges[c].first; k < ranges[c].second; k++) {
+				for (int j = 0; j < 3; j++) {
+					vertexMap[model.vertexIndices[order[k]][j]] = -1;
+					normalMap[model.normalIndices[order[k]][j]] = -1;
+				}
+			}
+			e.offset = offset;
+			e.vertexCount = (uint32_t)vertices.size();
+			e.normalCount = (uint32_t)normals.size();
+			e.triangleCount = (uint32_t)vertexIndices.size();
+			file.write((const char *)vertices.data(), vertices.size() * sizeof(glm::vec3));
+			file.write((const char *)normals.data(), normals.size() * sizeof(glm::vec3));
+			file.write((const char *)vertexIndices.data(), vertexIndices.size() * sizeof(glm::uvec3));
+			file.write((const char *)normalIndices.data(), normalIndices.size() * sizeof(glm::uvec3));
+			offset += dataSize(e);
+		}
+		file.seekp(sizeof(Header));
+		file.write((const char *)entries.data(), entries.size() * sizeof(Entry));
+		return file.good();
+	}
+
+	/**
+	 Intersects the ray with the clusters whose bounds it crosses, nearest first, paging them in as needed. The
+	 clusters are found through a hierarchy of their bounds, without allocating. The hits refer to this object,
+	 whose material applies to the whole mesh.
+	 */
+	Hit intersect(const Ray &ray) override {
+		glm::vec3 local_o = inverseTransformationMatrix * glm::vec4(ray.origin, 1.0);
+		glm::vec3 local_d = inverseTransformationMatrix * glm::vec4(ray.direction, 0.0);
+		Ray R(local_o, glm::normalize(local_d));
+
+		// the clusters are traced in the coordinate system of the mesh, their models have no transformation
+		Hit hit;
+		float bestT = FLOAT_INFINITY, t;
+		if (tree.empty() || !enter(tree[0], R, bestT, t)) return hit;
+		// nodes of the tree whose bounds the ray crosses, with the distance at which it enters them, the nearest
+		// child of a node being visited first
+		pair<uint32_t, float> stack[64];
+		int size = 0;
+		stack[size++] = {0, t};
+		while (size > 0) {
+			auto [n, tnear] = stack[--size];
+			if (tnear > bestT) continue;
+			const Node &node = tree[n];
+			if (node.cluster >= 0) {
+				shared_ptr<const Cluster> cluster = acquire((uint32_t)node.cluster);
+				if (cluster->bvh.intersect(R, 0, bestT)) cluster->bvh.trace_ray(R, R, hit, bestT);
+				continue;
+			}
+			float tl, tr;
+			bool left = enter(tree[node.left], R, bestT, tl), right = enter(tree[node.right], R, bestT, tr);
+			if (left && right) {
+				bool leftFirst = tl <= tr;
+				stack[size++] = leftFirst ? pair<uint32_t, float>(node.right, tr) : pair<uint32_t, float>(node.left, tl);
+				stack[size++] = leftFirst ? pair<uint32_t, float>(node.left, tl) : pair<uint32_t, float>(node.right, tr);
+			} else if (left) {
+				stack[size++] = {node.left, tl};
+			} else if (right) {
+				stack[size++] = {node.right, tr};
+			}
+		}
+		if (!hit.hit) return hit;
+		hit.intersection = transformationMatrix * glm::vec4(hit.intersection, 1.0);
+		hit.normal = glm::normalize(glm::vec3(normalMatrix * glm::vec4(hit.normal, 0.0)));
+		hit.distance = glm::length(hit.intersection - ray.origin);
+		hit.object = this;
+		return hit;
+	}
+
+	/** Number of clusters of the mesh. */
+	[[nodiscard]] size_t clusters() const {
+		return entries.size();
+	}
+
+	/** Number of triangles of the mesh. */
+	[[nodiscard]] size_t triangles() const {
+		size_t n = 0;
+		for (auto &e : entries) n += e.triangleCount;
+		return n;
+	}
+
+	/** Statistics of the residency of the clusters since the mesh was opened. */
+	struct Statistics {
+		size_t loads = 0; ///< Number of clusters paged in
+		size_t evictions = 0; ///< Number of clusters evicted to stay under the budget
+		size_t residentBytes = 0; ///< Memory used by the resident clusters
+		size_t peakBytes = 0; ///< Largest value of residentBytes
+	};
+
+	[[nodiscard]] Statistics statistics() const {
+		lock_guard<mutex> lock(residency);
+		return stats;
+	}
+
+	[[nodiscard]] string toString() const {
+		stringstream ss;
+		ss << "ClusteredMesh: " << triangles() << " triangles in " << clusters() << " clusters, "
+		   << budget / 1024 << " KB budget";
+		return ss.str();
+	}
+
+	friend ostream& operator<<(ostream& os, const ClusteredMesh& mesh) {
+		os << mesh.toString();
+		return os;
+	}
+
+private:
+	/** A resident cluster: its triangles and their hierarchy of bounding boxes. */
+	struct Cluster {
+		Model model;
+		BoundingBox bvh;
+		size_t bytes;
+
+		Cluster(Model &&m) : model(std::move(m)), bvh(model, TriangleStorage::PACKET) {
+			bytes = sizeof(Cluster) + model.memory() + bvh.memory();
+		}
+	};
+
+	/** Node of the hierarchy of the bounds of the clusters. */
+	struct Node {
+		glm::vec3 min, max;
+		uint32_t left = 0, right = 0; ///< Indices of the children in tree, for the inner nodes
+		int64_t cluster = -1; ///< Cluster of a leaf, -1 for the inner nodes
+	};
+
+	MappedFile file;
+	vector<Entry> entries;
+	vector<Node> tree; ///< Hierarchy of the bounds of the clusters, one cluster per leaf, the root first
+	size_t budget;
+
+	mutable mutex residency; ///< Protects the members below
+	vector<shared_ptr<const Cluster>> resident; ///< Resident cluster of each entry, or null
+	list<uint32_t> lru; ///< Resident clusters, from the most to the least recently used
+	vector<list<uint32_t>::iterator> lruPosition; ///< Position of each resident cluster in lru
+	Statistics stats;
+
+	static size_t dataSize(const Entry &e) {
+		return (size_t)(e.vertexCount + e.normalCount) * sizeof(glm::vec3) + (size_t)e.triangleCount * 2 * sizeof(glm::uvec3);
+	}
+
+	static void split(vector<uint32_t> &order, const vector<glm::vec3> &centroids, size_t first, size_t last, int axis,
+					  uint32_t maxTriangles, vector<pair<size_t, size_t>> &ranges) {
+		if (last - first <= maxTriangles) {
+			if (last > first) ranges.emplace_back(first, last);
+			return;
+		}
+		size_t mid = first + (last - first) / 2;
+		nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&centroids, axis](uint32_t a, uint32_t b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		split(order, centroids, first, mid, (axis + 1) % 3, maxTriangles, ranges);
+		split(order, centroids, mid, last, (axis + 1) % 3, maxTriangles, ranges);
+	}
+
+	/**
+	 Builds the node of the tree over the clusters order[first, last), splitting them at the median of their
+	 centers along the axes in turn, like split.
+	 @return the index of the node in tree
+	 */
+	uint32_t build(vector<uint32_t> &order, size_t first, size_t last, int axis) {
+		uint32_t index = (uint32_t)tree.size();
+		tree.emplace_back();
+		Node node;
+		node.min = glm::vec3(FLOAT_INFINITY);
+		node.max = glm::vec3(-FLOAT_INFINITY);
+		for (size_t k = first; k < last; k++) {
+			node.min = glm::min(node.min, entries[order[k]].min);
+			node.max = glm::max(node.max, entries[order[k]].max);
+		}
+		if (last - first == 1) {
+			node.cluster = order[first];
+		} else {
+			size_t mid = first + (last - first) / 2;
+			nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [this, axis](uint32_t a, uint32_t b) {
+				return entries[a].min[axis] + entries[a].max[axis] < entries[b].min[axis] + entries[b].max[axis];
+			});
+			node.left = build(order, first, mid, (axis + 1) % 3);
+			node.right = build(order, mid, last, (axis + 1) % 3);
+		}
+		tree[index] = node;
+		return index;
+	}
+
+	/** Whether the ray enters the bounds of the node before tmax, and the distance t at which it does (slab test). */
+	static bool enter(const Node &node, const Ray &ray, float tmax, float &t) {
+		float tnear = 0, tfar = tmax;
+		for (int d = 0; d < 3; d++) {
+			float t0 = (node.min[d] - ray.origin[d]) * ray.inv_direction[d];
+			float t1 = (node.max[d] - ray.origin[d]) * ray.inv_direction[d];
+			tnear = std::max(tnear, std::min(t0, t1));
+			tfar = std::min(tfar, std::max(t0, t1));
+		}
+		t = tnear;
+		return tnear <= tfar;
+	}
+
+	/**
+	 Returns the cluster i, paging it in if needed, and marks it as the most recently used. The cluster is
+	 built without holding the lock, so two threads may build the same cluster, in which case one copy is dropped.
+	 The returned pointer keeps the cluster alive even if it is evicted meanwhile.
+	 */
+	shared_ptr<const Cluster> acquire(uint32_t i) {
+		{
+			lock_guard<mutex> lock(residency);
+			if (resident[i]) {
+				lru.splice(lru.begin(), lru, lruPosition[i]);
+				return resident[i];
+			}
+		}
+		auto cluster = make_shared<const Cluster>(load(i));
+		lock_guard<mutex> lock(residency);
+		if (resident[i]) return resident[i];
+		resident[i] = cluster;
+		lru.push_front(i);
+		lruPosition[i] = lru.begin();
+		stats.loads++;
+		stats.residentBytes += cluster->bytes;
+		while (stats.residentBytes > budget && lru.size() > 1) {
+			uint32_t victim = lru.back();
+			lru.pop_back();
+			stats.residentBytes -= resident[victim]->bytes;
+			resident[victim].reset();
+			stats.evictions++;
+		}
+		stats.peakBytes = std::max(stats.peakBytes, stats.residentBytes);
+		return cluster;
+	}
+
+	// Copies the triangles of cluster i out of the mapped file, and lets the system drop the mapped pages.
+	Model load(uint32_t i) const {
+		const Entry &e = entries[i];
+		const char *p = file.data + e.offset;
+		Model model("cluster " + to_string(i));
+		model.vertices.resize(e.vertexCount);
+		model.normals.resize(e.normalCount);
+		model.vertexIndices.resize(e.triangleCount);
+		model.normalIndices.resize(e.triangleCount);
+		for (auto &[dst, bytes] : {pair<void *, size_t>{model.vertices.data(), e.vertexCount * sizeof(glm::vec3)},
+								   {model.normals.data(), e.normalCount * sizeof(glm::vec3)},
+								   {model.vertexIndices.data(), e.triangleCount * sizeof(glm::uvec3)},
+								   {model.normalIndices.data(), e.triangleCount * sizeof(glm::uvec3)}}) {
+			memcpy(dst, p, bytes);
+			p += bytes;
+		}
+		file.release(e.offset, dataSize(e));
+		return model;
+	}
+};
+
+#endif
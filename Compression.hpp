@@ -0,0 +1,85 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "glm/glm.hpp"
+
+using namespace std;
+
+/**
+ Compact encodings of the geometry of meshes, used by the compressed mode of OBJ::Model.
+ Positions are quantized to 16 bits per coordinate relative to the bounds of the mesh, and unit normals are
+ mapped onto an octahedron and stored as two 16-bit signed values (Cigolle et al., "A Survey of Efficient
+ Representations for Independent Unit Vectors", JCGT 2014).
+ */
+namespace Compression {
+
+/** Quantization of positions to a regular grid of 2^16 steps spanning the bounds of a mesh. */
+struct Quantization {
+	glm::vec3 origin{0}; ///< Position of the quantized value 0
+	glm::vec3 step{0}; ///< Size of a quantization step along each axis
+
+	Quantization() = default;
+
+	/** Quantization of the box min, max. Flat dimensions get a null step and decode to min. */
+	Quantization(const glm::vec3 &min, const glm::vec3 &max) : origin(min), step((max - min) / 65535.0f) {}
+
+	[[nodiscard]] glm::u16vec3 encode(const glm::vec3 &p) const {
+		glm::u16vec3 q;
+		for (int d = 0; d < 3; d++) {
+			float x = step[d] > 0 ? (p[d] - origin[d]) / step[d] : 0.0f;
+			q[d] = (uint16_t)std::clamp(std::lround(x), 0L, 65535L);
+		}
+		return q;
+	}
+
+	[[nodiscard]] glm::vec3 decode(const glm::u16vec3 &q) const {
+		return origin + glm::vec3(q) * step;
+	}
+
+	/** Largest distance between a position inside the bounds and its decoded value. */
+	[[nodiscard]] float maxError() const {
+		return glm::length(step) / 2;
+	}
+};
+
+/** Converts a value in [-1, 1] to a 16-bit signed normalized value. */
+int16_t toSnorm16(float x) {
+	return (int16_t)std::lround(std::clamp(x, -1.0f, 1.0f) * 32767.0f);
+}
+
+/**
+ Encodes a direction as two 16-bit coordinates on the unfolded octahedron, packed in 32 bits.
+ @param n direction, which does not need to be normalized
+ */
+uint32_t encodeOctahedral(const glm::vec3 &n) {
+	float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 == 0) return 0;
+	float x = n.x / l1, y = n.y / l1;
+	if (n.z < 0) { // fold the lower hemisphere onto the corners
+		float fx = (1 - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float fy = (1 - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	return (uint16_t)toSnorm16(x) | ((uint32_t)(uint16_t)toSnorm16(y) << 16);
+}
+
+/** Decodes a direction encoded by encodeOctahedral. @return the unit direction */
+glm::vec3 decodeOctahedral(uint32_t e) {
+	float x = (float)(int16_t)(e & 0xffff) / 32767.0f;
+	float y = (float)(int16_t)(e >> 16) / 32767.0f;
+	glm::vec3 n(x, y, 1 - fabs(x) - fabs(y));
+	if (n.z < 0) {
+		n.x = (1 - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		n.y = (1 - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+	}
+	return glm::normalize(n);
+}
+
+} // namespace Compression
+
+#endif
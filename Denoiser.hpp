@@ -0,0 +1,341 @@
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "CPU.hpp"
+#include "Shading.hpp"
+#include "ToneMapping.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+/**
+ Surface seen first along a ray, which guides the denoiser (see Denoiser): it has the same edges as the image,
+ without its noise. The rays which miss every object keep the default features, far away.
+ */
+struct Features {
+	glm::vec3 albedo = glm::vec3(0.0); ///< Diffuse color of the material
+	glm::vec3 normal = glm::vec3(0.0); ///< Normal of the surface
+	float depth = 1e30f; ///< Distance along the ray
+};
+
+/** Strength of the filter of Denoiser, see Denoiser::filter. */
+struct DenoiseSettings {
+	int iterations = 3; ///< Passes of the filter, whose footprint doubles at each one: 3 passes span 29 pixels
+	float color = 1024; ///< Difference of tone mapped luminance halving the weight of a pixel at the first pass, in 8-bit levels; it is halved at each pass
+	float normal = 64; ///< Halvings of the weight of a pixel per unit of 1 - cosine between the normals
+	float depth = 4; ///< Slope of the surfaces, relative to the view, at which a depth difference halves the weight of a pixel
+	float albedo = 0.05f; ///< Difference of albedo halving the weight of a pixel
+	float pixelSpread = 0.001f; ///< Angle between neighbouring pixels, which converts the slope into depth differences
+	int tile = 64; ///< Side of the square tiles of pixels filtered in parallel
+};
+
+/**
+ Planes of floats of the pixels of an image, one per quantity, in a single block. The rows are padded and the planes
+ shifted by a cache line from each other, so that the taps of the filter of Denoiser, which read the same pixel in
+ many planes and the same columns in several rows, do not map to the same sets of the caches when the rows or the
+ planes are a multiple of the page size, such as for 1024 pixels wide images.
+ */
+class Planes {
+public:
+	const int stride; ///< Floats from a row to the next one
+
+	/**
+	 @param skew cache lines by which all the planes are shifted, to be apart from those of other planes
+	 */
+	Planes(int width, int height, int count, int skew = 0): stride((width + 15) / 16 * 16 + 16),
+		size(((size_t)stride * height + 1023) / 1024 * 1024 + 16), first(16 * skew), data(size * count + first, 0.0f) {
+	}
+
+	/** First float of a plane, the pixel (x, y) at y * stride + x. */
+	float *operator[](int plane) {
+		return data.data() + first + plane * size;
+	}
+
+	const float *operator[](int plane) const {
+		return data.data() + first + plane * size;
+	}
+
+private:
+	size_t size; ///< Floats from a plane to the next one
+	size_t first; ///< Floats before the first plane
+	vector<float> data;
+};
+
+/**
+ Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), which removes the noise of an image rendered with few
+ samples per pixel while keeping its edges. Each pass blurs the image with a 5x5 B3-spline kernel whose taps are
+ spread 2^i pixels apart at the i-th pass, so that a few passes cover a large footprint at the cost of 25 taps per
+ pixel; the weight of each tap is lowered by the differences between the two pixels of the features of their
+ surfaces (albedo, normal and depth, see Features), which are free of noise, and of the luminance of their colors,
+ whose tolerance shrinks at each pass as the noise goes away. The features are gathered during the rendering with
+ add. The pixels are filtered by tiles in parallel, and along the rows by a kernel selected at startup according to
+ the CPU, as wide as its registers.
+ */
+class Denoiser {
+public:
+	const int width, height;
+
+	Denoiser(int width, int height): width(width), height(height), guides(width, height, 7), counts(width * height, 0) {
+		float *depth = guides[DEPTH];
+		fill(depth, depth + guides.stride * height, Features().depth);
+	}
+
+	/** Adds the features of a sample to the pixel of index y * width + x, whose features are their mean. */
+	void add(int pixel, const Features &features) {
+		float n = (float)++counts[pixel];
+		int k = pixel / width * guides.stride + pixel % width;
+		float values[7] = {features.albedo.x, features.albedo.y, features.albedo.z,
+						   features.normal.x, features.normal.y, features.normal.z, features.depth};
+		for (int plane = 0; plane < 7; plane++) guides[plane][k] += (values[plane] - guides[plane][k]) / n;
+	}
+
+	/**
+	 Filters the colors of the pixels of an image, in place.
+	 @param colors colors of the pixels, the pixel (x, y) at y * width + x
+	 */
+	void filter(vector<glm::vec3> &colors, const DenoiseSettings &settings, thread_pool &pool) const {
+		// the red, green, blue and luminance planes read by a pass, then those it writes, apart from the guides
+		Planes planes(width, height, 8, 7);
+		int stride = planes.stride, in = 0, out = 4;
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				const glm::vec3 &c = colors[y * width + x];
+				int k = y * stride + x;
+				planes[0][k] = c.x; planes[1][k] = c.y; planes[2][k] = c.z;
+				planes[3][k] = level(c);
+			}
+		}
+		int side = settings.tile, columns = (width + side - 1) / side, rows = (height + side - 1) / side;
+		for (int i = 0; i < settings.iterations; i++) {
+			Pass pass;
+			pass.width = width; pass.height = height; pass.stride = stride;
+			pass.r = planes[in]; pass.g = planes[in + 1]; pass.b = planes[in + 2]; pass.luminance = planes[in + 3];
+			pass.outR = planes[out]; pass.outG = planes[out + 1]; pass.outB = planes[out + 2];
+			pass.ar = guides[AR]; pass.ag = guides[AG]; pass.ab = guides[AB];
+			pass.nx = guides[NX]; pass.ny = guides[NY]; pass.nz = guides[NZ];
+			pass.depth = guides[DEPTH];
+			pass.step = 1 << i;
+			float sigma = settings.color / (float)(1 << i);
+			pass.color = 1 / (sigma * sigma);
+			pass.normal = settings.normal;
+			pass.albedo = 1 / (settings.albedo * settings.albedo);
+			for (int v = 0; v < 5; v++) {
+				for (int u = 0; u < 5; u++) {
+					float distance = (float)pass.step * sqrt((float)((u - 2) * (u - 2) + (v - 2) * (v - 2)));
+					pass.slope[v * 5 + u] = distance > 0 ? 1 / (settings.depth * settings.pixelSpread * distance) : 0;
+				}
+			}
+			float *outLuminance = planes[out + 3];
+			pool.parallelize_loop(0, columns * rows, [&](int first, int last) {
+				for (int t = first; t < last; t++) {
+					int x_min = (t % columns) * side, y_min = (t / columns) * side;
+					int x_max = min(width, x_min + side), y_max = min(height, y_min + side);
+					for (int y = y_min; y < y_max; y++) {
+						kernel(pass, y, x_min, x_max);
+						for (int x = x_min; x < x_max; x++) {
+							int k = y * stride + x;
+							outLuminance[k] = level(glm::vec3(pass.outR[k], pass.outG[k], pass.outB[k]));
+						}
+					}
+				}
+			}, (uint32_t)(columns * rows));
+			swap(in, out);
+		}
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				int k = y * stride + x;
+				colors[y * width + x] = glm::vec3(planes[in][k], planes[in + 1][k], planes[in + 2][k]);
+			}
+		}
+	}
+
+	/**
+	 Selects the kernel of the passes for the given instruction set. AVX-512 processors use the AVX2 kernel, the
+	 exponentials of ShadingBatch being 8 wide.
+	 */
+	static void selectKernel(CPU::ISA isa) {
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512:
+			case CPU::ISA::AVX2: kernel = &filterAVX2; break;
+			case CPU::ISA::SSE42: kernel = &filterSSE42; break;
+#endif
+			default: kernel = &filterScalar;
+		}
+	}
+
+	/** One pass of the filter: the planes it reads and writes, and the scales of the differences of the features. */
+	struct Pass {
+		int width, height, stride; ///< Of the image and of the rows of the planes, see Planes
+		const float *r, *g, *b, *luminance; ///< Colors of the pixels, and their luminance, see level
+		float *outR, *outG, *outB; ///< Filtered colors
+		const float *ar, *ag, *ab, *nx, *ny, *nz, *depth; ///< Features of the pixels
+		int step; ///< Pixels between the taps
+		float color, normal, albedo; ///< Scales of the squared luminance, cosine and squared albedo differences
+		float slope[25]; ///< Scale of the relative depth difference at every tap, by rows
+	};
+
+	/** Smallest depth dividing the differences of depth, for the hits right in front of the camera */
+	static constexpr float minimumDepth = 1e-3f;
+
+	/**
+	 Largest number of halvings of the weight of a tap: the weights and their products with the colors stay normal
+	 numbers, as the arithmetic on denormals is many times slower.
+	 */
+	static constexpr float largest = 100;
+
+	/** Weights of the taps of the B3-spline kernel along each axis */
+	static constexpr float spline[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+	/** Filters the pixels of the row y from x_min to x_max excluded, one at a time. */
+	static void filterScalar(const Pass &p, int y, int x_min, int x_max) {
+		for (int x = x_min; x < x_max; x++) filterPixel(p, y, x);
+	}
+
+	/** Filters one pixel, also at the borders of the image where some taps are outside and skipped. */
+	static void filterPixel(const Pass &p, int y, int x) {
+		int k = y * p.stride + x;
+		float r = 0, g = 0, b = 0, total = 0;
+		float inverse = 1 / max(p.depth[k], minimumDepth);
+		for (int v = 0; v < 5; v++) {
+			int yq = y + (v - 2) * p.step;
+			if (yq < 0 || yq >= p.height) continue;
+			for (int u = 0; u < 5; u++) {
+				int xq = x + (u - 2) * p.step;
+				if (xq < 0 || xq >= p.width) continue;
+				int q = yq * p.stride + xq;
+				float dl = p.luminance[q] - p.luminance[k];
+				float dr = p.ar[q] - p.ar[k], dg = p.ag[q] - p.ag[k], db = p.ab[q] - p.ab[k];
+				float cosine = p.nx[q] * p.nx[k] + p.ny[q] * p.ny[k] + p.nz[q] * p.nz[k];
+				float e = dl * dl * p.color + (1 - cosine) * p.normal + (dr * dr + dg * dg + db * db) * p.albedo
+						  + abs(p.depth[q] - p.depth[k]) * inverse * p.slope[v * 5 + u];
+				float weight = exp2(-min(max(e, 0.0f), largest)) * spline[u] * spline[v];
+				r += weight * p.r[q]; g += weight * p.g[q]; b += weight * p.b[q];
+				total += weight;
+			}
+		}
+		p.outR[k] = r / total; p.outG[k] = g / total; p.outB[k] = b / total;
+	}
+
+#ifdef CPU_X86
+	/** SSE4.2 kernel, four pixels at a time away from the left and right borders. */
+	TARGET_SSE42 static void filterSSE42(const Pass &p, int y, int x_min, int x_max) {
+		int reach = 2 * p.step;
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), sign = _mm_set1_ps(-0.0f), most = _mm_set1_ps(largest);
+		const __m128 color = _mm_set1_ps(p.color), normal = _mm_set1_ps(p.normal), albedo = _mm_set1_ps(p.albedo);
+		int x = x_min;
+		while (x < x_max) {
+			if (x < reach || x + 4 > x_max || x + 3 + reach >= p.width) {
+				filterPixel(p, y, x++);
+				continue;
+			}
+			int k = y * p.stride + x;
+			__m128 L = _mm_loadu_ps(p.luminance + k), D = _mm_loadu_ps(p.depth + k);
+			__m128 Ar = _mm_loadu_ps(p.ar + k), Ag = _mm_loadu_ps(p.ag + k), Ab = _mm_loadu_ps(p.ab + k);
+			__m128 Nx = _mm_loadu_ps(p.nx + k), Ny = _mm_loadu_ps(p.ny + k), Nz = _mm_loadu_ps(p.nz + k);
+			__m128 inverse = _mm_div_ps(one, _mm_max_ps(D, _mm_set1_ps(minimumDepth)));
+			__m128 r = zero, g = zero, b = zero, total = zero;
+			for (int v = 0; v < 5; v++) {
+				int yq = y + (v - 2) * p.step;
+				if (yq < 0 || yq >= p.height) continue;
+				for (int u = 0; u < 5; u++) {
+					int q = yq * p.stride + x + (u - 2) * p.step;
+					__m128 dl = _mm_sub_ps(_mm_loadu_ps(p.luminance + q), L);
+					__m128 dr = _mm_sub_ps(_mm_loadu_ps(p.ar + q), Ar);
+					__m128 dg = _mm_sub_ps(_mm_loadu_ps(p.ag + q), Ag);
+					__m128 db = _mm_sub_ps(_mm_loadu_ps(p.ab + q), Ab);
+					__m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p.nx + q), Nx), _mm_mul_ps(_mm_loadu_ps(p.ny + q), Ny)),
+											   _mm_mul_ps(_mm_loadu_ps(p.nz + q), Nz));
+					__m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(p.depth + q), D));
+					__m128 e = _mm_mul_ps(_mm_mul_ps(dl, dl), color);
+					e = _mm_add_ps(e, _mm_mul_ps(_mm_sub_ps(one, cosine), normal));
+					e = _mm_add_ps(e, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db)), albedo));
+					e = _mm_add_ps(e, _mm_mul_ps(_mm_mul_ps(dz, inverse), _mm_set1_ps(p.slope[v * 5 + u])));
+					e = _mm_min_ps(_mm_max_ps(e, zero), most);
+					__m128 weight = _mm_mul_ps(ShadingBatch::exp2SSE42(_mm_sub_ps(zero, e)), _mm_set1_ps(spline[u] * spline[v]));
+					r = _mm_add_ps(r, _mm_mul_ps(weight, _mm_loadu_ps(p.r + q)));
+					g = _mm_add_ps(g, _mm_mul_ps(weight, _mm_loadu_ps(p.g + q)));
+					b = _mm_add_ps(b, _mm_mul_ps(weight, _mm_loadu_ps(p.b + q)));
+					total = _mm_add_ps(total, weight);
+				}
+			}
+			__m128 scale = _mm_div_ps(one, total);
+			_mm_storeu_ps(p.outR + k, _mm_mul_ps(r, scale));
+			_mm_storeu_ps(p.outG + k, _mm_mul_ps(g, scale));
+			_mm_storeu_ps(p.outB + k, _mm_mul_ps(b, scale));
+			x += 4;
+		}
+	}
+
+	/** AVX2 kernel, eight pixels at a time away from the left and right borders. */
+	TARGET_AVX2 static void filterAVX2(const Pass &p, int y, int x_min, int x_max) {
+		int reach = 2 * p.step;
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), sign = _mm256_set1_ps(-0.0f), most = _mm256_set1_ps(largest);
+		const __m256 color = _mm256_set1_ps(p.color), normal = _mm256_set1_ps(p.normal), albedo = _mm256_set1_ps(p.albedo);
+		int x = x_min;
+		while (x < x_max) {
+			if (x < reach || x + 8 > x_max || x + 7 + reach >= p.width) {
+				filterPixel(p, y, x++);
+				continue;
+			}
+			int k = y * p.stride + x;
+			__m256 L = _mm256_loadu_ps(p.luminance + k), D = _mm256_loadu_ps(p.depth + k);
+			__m256 Ar = _mm256_loadu_ps(p.ar + k), Ag = _mm256_loadu_ps(p.ag + k), Ab = _mm256_loadu_ps(p.ab + k);
+			__m256 Nx = _mm256_loadu_ps(p.nx + k), Ny = _mm256_loadu_ps(p.ny + k), Nz = _mm256_loadu_ps(p.nz + k);
+			__m256 inverse = _mm256_div_ps(one, _mm256_max_ps(D, _mm256_set1_ps(minimumDepth)));
+			__m256 r = zero, g = zero, b = zero, total = zero;
+			for (int v = 0; v < 5; v++) {
+				int yq = y + (v - 2) * p.step;
+				if (yq < 0 || yq >= p.height) continue;
+				for (int u = 0; u < 5; u++) {
+					int q = yq * p.stride + x + (u - 2) * p.step;
+					__m256 dl = _mm256_sub_ps(_mm256_loadu_ps(p.luminance + q), L);
+					__m256 dr = _mm256_sub_ps(_mm256_loadu_ps(p.ar + q), Ar);
+					__m256 dg = _mm256_sub_ps(_mm256_loadu_ps(p.ag + q), Ag);
+					__m256 db = _mm256_sub_ps(_mm256_loadu_ps(p.ab + q), Ab);
+					__m256 cosine = _mm256_fmadd_ps(_mm256_loadu_ps(p.nx + q), Nx,
+													_mm256_fmadd_ps(_mm256_loadu_ps(p.ny + q), Ny, _mm256_mul_ps(_mm256_loadu_ps(p.nz + q), Nz)));
+					__m256 dz = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(p.depth + q), D));
+					__m256 e = _mm256_mul_ps(_mm256_mul_ps(dl, dl), color);
+					e = _mm256_fmadd_ps(_mm256_sub_ps(one, cosine), normal, e);
+					e = _mm256_fmadd_ps(_mm256_fmadd_ps(dr, dr, _mm256_fmadd_ps(dg, dg, _mm256_mul_ps(db, db))), albedo, e);
+					e = _mm256_fmadd_ps(_mm256_mul_ps(dz, inverse), _mm256_set1_ps(p.slope[v * 5 + u]), e);
+					e = _mm256_min_ps(_mm256_max_ps(e, zero), most);
+					__m256 weight = _mm256_mul_ps(ShadingBatch::exp2AVX2(_mm256_sub_ps(zero, e)), _mm256_set1_ps(spline[u] * spline[v]));
+					r = _mm256_fmadd_ps(weight, _mm256_loadu_ps(p.r + q), r);
+					g = _mm256_fmadd_ps(weight, _mm256_loadu_ps(p.g + q), g);
+					b = _mm256_fmadd_ps(weight, _mm256_loadu_ps(p.b + q), b);
+					total = _mm256_add_ps(total, weight);
+				}
+			}
+			__m256 scale = _mm256_div_ps(one, total);
+			_mm256_storeu_ps(p.outR + k, _mm256_mul_ps(r, scale));
+			_mm256_storeu_ps(p.outG + k, _mm256_mul_ps(g, scale));
+			_mm256_storeu_ps(p.outB + k, _mm256_mul_ps(b, scale));
+			x += 8;
+		}
+	}
+#endif
+
+	/** Signature of the kernels, filtering the pixels of a row from x_min to x_max excluded */
+	typedef void (*Kernel)(const Pass &pass, int y, int x_min, int x_max);
+	static inline Kernel kernel = &filterScalar; ///< Kernel of the passes, see selectKernel
+
+private:
+	enum {AR, AG, AB, NX, NY, NZ, DEPTH}; ///< Planes of the features
+	Planes guides; ///< Mean features of the pixels
+	vector<uint32_t> counts; ///< Samples of the features of the pixels
+
+	/** Luminance of a color after the tone mapping, without its clamping, in 8-bit levels, see toneCurve. */
+	static float level(const glm::vec3 &color) {
+		float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		return 255 * toneCurve(glm::vec3(max(luminance, 0.0f))).x;
+	}
+};
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef FILM_HPP
+#define FILM_HPP
+
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "thread_pool.hpp"
+#include "Image.h"
+#include "Ray.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+/**
+ Image of the samples of the pixels, each sample being splatted onto the pixels around it with the weights of a
+ reconstruction filter, so that the image is filtered as the samples are traced, at its own resolution. A pixel is
+ the weighted mean of the samples around it. The filters cover at most 4x4 pixels, so that samples farther apart
+ than 4 rows can be splatted from different threads.
+ */
+class Film {
+public:
+	/** Reconstruction filters, separable */
+	enum class Filter {
+		BOX, ///< Mean of the samples within the pixel, which keeps the most aliasing
+		TENT, ///< Weights falling linearly to 0 at 1 pixel, which blurs
+		MITCHELL ///< Mitchell-Netravali filter (B = C = 1/3) of radius 2, sharper than the tent with little ringing
+	};
+
+	const int width, height;
+	const Filter filter;
+	const float radius; ///< Radius of the filter, in pixels
+
+	Film(int width, int height, Filter filter = Filter::MITCHELL): width(width), height(height), filter(filter),
+		radius(filter == Filter::BOX ? 0.5f : filter == Filter::TENT ? 1.0f : 2.0f),
+		sums(width * height, glm::vec3(0.0)), weights(width * height, 0.0f) {
+	}
+
+	/** Parses the name of a filter, box, tent or mitchell. */
+	static bool parse(const string &name, Filter &filter) {
+		if (name == "box") filter = Filter::BOX;
+		else if (name == "tent") filter = Filter::TENT;
+		else if (name == "mitchell") filter = Filter::MITCHELL;
+		else return false;
+		return true;
+	}
+
+	/** Weight of the filter at a signed distance in pixels along one axis. */
+	[[nodiscard]] float weight(float x) const {
+		switch (filter) {
+			case Filter::BOX: return x >= -0.5f && x < 0.5f ? 1.0f : 0.0f; // a sample on an edge goes to one pixel
+			case Filter::TENT: return max(0.0f, 1 - std::abs(x));
+			default: return mitchell(x);
+		}
+	}
+
+	/** Weight of the Mitchell-Netravali filter at a distance in pixels along one axis. */
+	static float mitchell(float x) {
+		const float B = 1.0f / 3, C = 1.0f / 3;
+		x = std::abs(x);
+		if (x >= 2) return 0;
+		if (x < 1) return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6;
+		return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x + (8 * B + 24 * C)) / 6;
+	}
+
+	/**
+	 Adds a sample to the pixels around it.
+	 @param x,y position of the sample in the image, in pixels: the center of the pixel (i, j) is (i + 0.5, j + 0.5)
+	 @param weight weight of the sample, which multiplies the filter; the samples of a pixel which has more than the
+	 others should share the weight of one, or they would draw the pixels around towards theirs
+	 */
+	void splat(float x, float y, const glm::vec3 &color, float weight = 1) {
+		int i_min = max(0, (int)std::ceil(x - 0.5f - radius)), i_max = min(width - 1, (int)std::floor(x - 0.5f + radius));
+		int j_min = max(0, (int)std::ceil(y - 0.5f - radius)), j_max = min(height - 1, (int)std::floor(y - 0.5f + radius));
+		float wx[5];
+		for (int i = i_min; i <= i_max; i++) wx[i - i_min] = weight * this->weight((float)i + 0.5f - x);
+		for (int j = j_min; j <= j_max; j++) {
+			float wy = this->weight((float)j + 0.5f - y);
+			for (int i = i_min; i <= i_max; i++) {
+				float w = wx[i - i_min] * wy;
+				sums[j * width + i] += w * color;
+				weights[j * width + i] += w;
+			}
+		}
+	}
+
+	/** Color of a pixel, the weighted mean of the samples around it. */
+	[[nodiscard]] glm::vec3 pixel(int i, int j) const {
+		float w = weights[j * width + i];
+		if (w <= 1e-6f) return glm::vec3(0.0);
+		return glm::max(sums[j * width + i] / w, glm::vec3(0.0)); // the negative lobes may overshoot below black
+	}
+
+	/** Writes the tone mapped pixels to an image of the same size. */
+	void write(Image &image) const {
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width; i++) image.setPixel(i, j, toneMapping(pixel(i, j)));
+		}
+	}
+
+private:
+	vector<glm::vec3> sums;
+	vector<float> weights;
+};
+
+/**
+ Runs pass(first row, last row) on the bands of rows of an image, in parallel: the even bands, then the odd ones, so
+ that the samples splatted by concurrent bands onto a film do not reach the same pixels.
+ @param rows number of rows of a band, more than twice the radius of the filter
+ */
+template<typename Pass>
+void for_bands(thread_pool &pool, int height, int rows, Pass pass) {
+	int bands = (height + rows - 1) / rows;
+	for (int parity = 0; parity < 2; parity++) {
+		pool.parallelize_loop(0, (bands + 1 - parity) / 2, [&](int first, int last) {
+			for (int b = first; b < last; b++) {
+				int band = 2 * b + parity;
+				pass(band * rows, min(height, (band + 1) * rows));
+			}
+		}, (uint32_t)bands);
+	}
+}
+
+/**
+ Renders an image with the same number of samples in every pixel, splatted onto the film as they are traced. The
+ samples of a pixel are the points of the Sobol sequence scrambled by the pixel (see sobol), which are stratified
+ like jittered grids when their number is a power of 2, and which other numbers of samples spread evenly too. The
+ samples of the tiles of 32x32 pixels are traced together, and the rows of tiles in parallel, see for_bands.
+ @param trace function tracing a grid of primary rays, like trace_tile:
+ trace(const Ray *rays, int columns, int rows, glm::vec3 *colors, uint32_t seed, uint32_t stride)
+ @param camera function of a position in the image, in pixels (see Film::splat), giving the ray through it
+ @return the number of samples traced
+ */
+template<typename Camera, typename Trace>
+long render_supersampled(Film &film, int samples, thread_pool &pool, Camera camera, Trace trace) {
+	const int tile = 32;
+	int width = film.width, height = film.height;
+	for_bands(pool, height, tile, [&](int j_min, int j_max) {
+		vector<Ray> group;
+		vector<glm::vec2> positions;
+		vector<glm::vec3> colors;
+		for (int i_min = 0; i_min < width; i_min += tile) {
+			int columns = min(tile, width - i_min);
+			group.clear();
+			positions.clear();
+			// the samples of a pixel follow each other in its row
+			for (int j = j_min; j < j_max; j++) {
+				for (int i = i_min; i < i_min + columns; i++) {
+					uint32_t scramble = hash_point(glm::vec3((float)i, (float)j, 0.0f));
+					for (int k = 0; k < samples; k++) {
+						glm::vec2 p = glm::vec2((float)i, (float)j) + sobol((uint32_t)k, scramble);
+						positions.push_back(p);
+						group.push_back(camera(p.x, p.y));
+					}
+				}
+			}
+			colors.resize(group.size());
+			trace(group.data(), columns * samples, j_max - j_min, colors.data(), (uint32_t)((j_min * width + i_min) * samples), (uint32_t)(width * samples));
+			for (size_t k = 0; k < group.size(); k++) film.splat(positions[k].x, positions[k].y, colors[k]);
+		}
+	});
+	return (long)width * height * samples;
+}
+
+/** Refinement of the pixels by render_adaptive. */
+struct AdaptiveSettings {
+	/// A pixel is refined when its tone mapped color differs from one of its 8 neighbours by more than this, in 8-bit
+	/// levels, and keeps being refined while the standard error of its samples is above it
+	float contrast = 8;
+	int samples = 16; ///< Samples of the finest grid of a pixel, 4, 16 or 64; the grids of 4, 16... samples come first
+};
+
+/** Work of render_adaptive. */
+struct AdaptiveStatistics {
+	long samples = 0; ///< Samples traced, with the centers of the pixels
+	long refined = 0; ///< Pixels which received more than their center
+};
+
+/**
+ Renders an image with adaptive anti-aliasing. The center of every pixel is traced first, by tiles of 32x32 pixels.
+ The pixels whose tone mapped color differs from one of their neighbours by more than the contrast threshold of the
+ settings, the edges and the textures, are then refined by grids of 2x2, 4x4... jittered samples, one in each
+ cell, as long as the standard error of the mean of their samples, in 8-bit levels of the tone mapped color, stays
+ above the threshold. The samples of a pixel are splatted onto the film once it is done, sharing the weight of one
+ sample, so that the film reconstructs the image from the means of the pixels. The rows of tiles are traced in
+ parallel, see for_bands.
+ @param trace function tracing a grid of primary rays, like trace_tile:
+ trace(const Ray *rays, int columns, int rows, glm::vec3 *colors, uint32_t seed, uint32_t stride)
+ @param camera function of a position in the image, in pixels (see Film::splat), giving the ray through it
+ */
+template<typename Camera, typename Trace>
+AdaptiveStatistics render_adaptive(Film &film, const AdaptiveSettings &settings, thread_pool &pool, Camera camera, Trace trace) {
+	const int tile = 32;
+	int width = film.width, height = film.height;
+	vector<glm::vec3> centers(width * height);
+	vector<uint8_t> active(width * height, 0);
+	atomic<long> samples((long)width * height), refined(0);
+	auto bands = [&](auto pass) {
+		for_bands(pool, height, tile, pass);
+	};
+
+	// the centers of the pixels
+	bands([&](int j_min, int j_max) {
+		vector<Ray> group;
+		for (int i_min = 0; i_min < width; i_min += tile) {
+			int columns = min(tile, width - i_min);
+			group.clear();
+			for (int j = j_min; j < j_max; j++) {
+				for (int i = i_min; i < i_min + columns; i++) group.push_back(camera((float)i + 0.5f, (float)j + 0.5f));
+			}
+			vector<glm::vec3> colors(group.size());
+			trace(group.data(), columns, j_max - j_min, colors.data(), (uint32_t)(j_min * width + i_min), (uint32_t)width);
+			for (int k = 0; k < (int)group.size(); k++) centers[(j_min + k / columns) * width + i_min + k % columns] = colors[k];
+		}
+	});
+
+	// the pixels differing from a neighbour, in 8-bit levels of the tone mapped colors
+	pool.parallelize_loop(0, height, [&](int first, int last) {
+		for (int j = first; j < last; j++) {
+			for (int i = 0; i < width; i++) {
+				glm::vec3 c = 255.0f * toneMapping(centers[j * width + i]);
+				for (int dj = -1; dj <= 1 && !active[j * width + i]; dj++) {
+					for (int di = -1; di <= 1; di++) {
+						int x = i + di, y = j + dj;
+						if (x < 0 || y < 0 || x >= width || y >= height) continue;
+						glm::vec3 d = glm::abs(255.0f * toneMapping(centers[y * width + x]) - c);
+						if (max(d.x, max(d.y, d.z)) > settings.contrast) {
+							active[j * width + i] = 1;
+							break;
+						}
+					}
+				}
+			}
+		}
+	});
+
+	// grids of samples, finer and finer, in the pixels still noisy, then the samples of every pixel onto the film
+	bands([&](int j_min, int j_max) {
+		vector<Ray> group;
+		vector<glm::vec3> colors;
+		vector<glm::vec2> positions;
+		long count = 0, pixels = 0;
+		for (int j = j_min; j < j_max; j++) {
+			for (int i = 0; i < width; i++) {
+				int pixel = j * width + i;
+				positions.assign(1, glm::vec2((float)i + 0.5f, (float)j + 0.5f));
+				colors.assign(1, centers[pixel]);
+				// running mean and squared deviations of the tone mapped samples, see AccumulationBuffer
+				glm::vec3 mean = 255.0f * toneMapping(centers[pixel]), deviations(0.0);
+				uint32_t random = (uint32_t)pixel * 0x9e3779b9u;
+				for (int grid = 2; active[pixel] && grid * grid <= settings.samples; grid *= 2) {
+					int first = (int)positions.size(), n = grid * grid;
+					group.clear();
+					for (int k = 0; k < n; k++) {
+						float x = (float)i + ((float)(k % grid) + random_float(random)) / (float)grid;
+						float y = (float)j + ((float)(k / grid) + random_float(random)) / (float)grid;
+						positions.emplace_back(x, y);
+						group.push_back(camera(x, y));
+					}
+					colors.resize(first + n);
+					trace(group.data(), grid, grid, colors.data() + first, random, (uint32_t)grid);
+					for (int k = first; k < first + n; k++) {
+						glm::vec3 level = 255.0f * toneMapping(colors[k]);
+						glm::vec3 delta = level - mean;
+						mean += delta / (float)(k + 1);
+						deviations += delta * (level - mean);
+					}
+					count += n;
+					float total = (float)colors.size();
+					glm::vec3 error = glm::sqrt(deviations / ((total - 1) * total));
+					if (max(error.x, max(error.y, error.z)) <= settings.contrast) break;
+				}
+				pixels += colors.size() > 1;
+				float weight = 1.0f / (float)colors.size();
+				for (size_t k = 0; k < colors.size(); k++) film.splat(positions[k].x, positions[k].y, colors[k], weight);
+			}
+		}
+		samples += count;
+		refined += pixels;
+	});
+	return {samples, refined};
+}
+
+#endif
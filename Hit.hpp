@@ -21,11 +21,13 @@ struct Hit{
     float distance; ///< Distance from the origin of the ray to the intersection point
     Object *object; ///< A pointer to the intersected object
 	glm::vec2 uv; ///< Coordinates for computing the texture (texture coordinates)
+	uint16_t materialId = MaterialTable::none; ///< Index of the material at the intersection point if it differs from the material of the object
+	float uvDensity = 0; ///< Texture coordinate units per unit of length on the surface around the point, 0 if unknown
 
     bool debug = false;
 
     Hit() : hit(false), distance(FLOAT_INFINITY), object(nullptr) {}
-    Hit(const Hit &h) : hit(h.hit), normal(h.normal), intersection(h.intersection), distance(h.distance), object(h.object), uv(h.uv) {}
+    Hit(const Hit &h) : hit(h.hit), normal(h.normal), intersection(h.intersection), distance(h.distance), object(h.object), uv(h.uv), materialId(h.materialId), uvDensity(h.uvDensity) {}
 };
 
 #endif
\ No newline at end of file
@@ -13,6 +13,8 @@
 #ifndef Image_h
 #define Image_h
 
+#include <cstdint>
+
 using namespace std;
 
 /**
@@ -22,7 +24,7 @@ class Image{
 
 private:
     int width, height; ///< width and height of the image
-    int *data; ///< a pointer to the data representing the images
+    uint8_t *data; ///< a pointer to the data representing the images, 3 bytes per pixel
     
 public:
     /**
@@ -30,7 +32,7 @@ public:
      @param height height of the image
      */
     Image(int width, int height): width(width), height(height){
-        data = new int[3*width*height];
+        data = new uint8_t[3*width*height];
     }
     
     /**
@@ -45,9 +47,9 @@ public:
         file << 255 << endl;
         for(int h = 0; h < height; h++){
             for (int w = 0; w < width; w++){
-                file << data[3 * (h*width + w)] <<" ";
-                file << data[3 * (h*width + w) + 1] <<" ";
-                file << data[3 * (h*width + w) + 2] << "  ";
+                file << (int)data[3 * (h*width + w)] <<" ";
+                file << (int)data[3 * (h*width + w) + 1] <<" ";
+                file << (int)data[3 * (h*width + w) + 2] << "  ";
             }
             file<<endl;
         }
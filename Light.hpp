@@ -1,20 +1,248 @@
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
 #include "glm/glm.hpp"
+#include "CPU.hpp"
 
 #ifndef LIGHT_HPP
 #define LIGHT_HPP
 
 /**
- Light class
+ Point i of the two-dimensional Sobol sequence in [0,1)^2, whose first 2^k points form a stratified pattern with
+ one point in each of the 2^k cells of any grid of 2^a x 2^b cells (a + b = k). The bits of the coordinates are
+ scrambled by those of scramble, which keeps the stratification while decorrelating the patterns of the points.
+ */
+glm::vec2 sobol(uint32_t i, uint32_t scramble) {
+	// the first dimension is the van der Corput sequence, the bits of i reversed
+	uint32_t x = i;
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	// the second one has the direction numbers of the primitive polynomial x + 1
+	uint32_t y = 0;
+	for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+		if (i & 1) y ^= v;
+	}
+	uint32_t sx = scramble, sy = scramble * 0x9e3779b9u;
+	return glm::vec2((float)((x ^ sx) >> 8), (float)((y ^ sy) >> 8)) * (1.0f / (1 << 24));
+}
+
+/**
+ Light class. Point lights are the default; rectangle and sphere lights have an area, over which their shadow rays
+ are spread (see sample), so that they cast soft shadows. Their Phong terms are those of their center.
  */
 class Light{
 public:
+	/** Shapes of the lights */
+	enum class Shape {
+		POINT,
+		RECTANGLE, ///< Parallelogram centered on position, with the edges edgeU and edgeV
+		SPHERE ///< Sphere of the given radius around position
+	};
+
 	glm::vec3 position; ///< Position of the light source
 	glm::vec3 color; ///< Color/intentisty of the light source
+	Shape shape = Shape::POINT;
+	glm::vec3 edgeU = glm::vec3(0.0), edgeV = glm::vec3(0.0); ///< Edges of a rectangle light
+	float radius = 0; ///< Radius of a sphere light
+	/// Distance from the position beyond which the light cannot change the image, see set_influence_radii
+	float influence = INFINITY;
+
 	Light(glm::vec3 position): position(position){
 		color = glm::vec3(1.0);
 	}
 	Light(glm::vec3 position, glm::vec3 color): position(position), color(color){
 	}
+
+	/** Rectangle light, with its center and the vectors of two adjacent edges. */
+	static Light *rectangle(const glm::vec3 &center, const glm::vec3 &edgeU, const glm::vec3 &edgeV, const glm::vec3 &color){
+		Light *light = new Light(center, color);
+		light->shape = Shape::RECTANGLE;
+		light->edgeU = edgeU;
+		light->edgeV = edgeV;
+		return light;
+	}
+
+	/** Sphere light. */
+	static Light *sphere(const glm::vec3 &center, float radius, const glm::vec3 &color){
+		Light *light = new Light(center, color);
+		light->shape = Shape::SPHERE;
+		light->radius = radius;
+		return light;
+	}
+
+	/** Whether the light has an area, so that its shadow rays are spread over it. */
+	[[nodiscard]] bool area() const{
+		return shape == Shape::RECTANGLE || shape == Shape::SPHERE;
+	}
+
+	/**
+	 Point of the light at the given coordinates, the target of a shadow ray. The coordinates are mapped uniformly
+	 onto the rectangle, or onto the disk of the sphere facing the shaded point, which is its outline seen from the point.
+	 @param st coordinates in [0,1)^2, such as the points of sobol
+	 @param from the shaded point
+	 */
+	[[nodiscard]] glm::vec3 sample(const glm::vec2 &st, const glm::vec3 &from) const{
+		if (shape == Shape::RECTANGLE) return position + (st.x - 0.5f) * edgeU + (st.y - 0.5f) * edgeV;
+		if (shape != Shape::SPHERE) return position;
+		glm::vec3 w = glm::normalize(from - position);
+		glm::vec3 u = glm::normalize(glm::cross(std::abs(w.x) > 0.5f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), w));
+		glm::vec3 v = glm::cross(w, u);
+		// concentric mapping of the square onto the disk, which keeps the strata compact
+		float a = 2 * st.x - 1, b = 2 * st.y - 1;
+		if (a == 0 && b == 0) return position;
+		float r, phi;
+		if (std::abs(a) > std::abs(b)) {
+			r = a;
+			phi = (float)M_PI / 4 * (b / a);
+		} else {
+			r = b;
+			phi = (float)M_PI / 2 - (float)M_PI / 4 * (a / b);
+		}
+		return position + radius * r * (std::cos(phi) * u + std::sin(phi) * v);
+	}
+};
+
+/**
+ Geometric terms of the Phong model for a batch of lights seen from one point, see PhongModel.
+ The positions are filled by the caller, the other arrays by a kernel selected at startup according to the CPU.
+ */
+struct alignas(64) LightTerms{
+	static const int size = 16; ///< Number of lights in a batch, the width of the widest kernel
+
+	float px[size], py[size], pz[size]; ///< Positions of the lights
+	float lx[size], ly[size], lz[size]; ///< Normalized directions from the point to the lights
+	float NdotL[size]; ///< Cosine between the normal and the direction to the light, clamped to (0,1)
+	float VdotR[size]; ///< Cosine between the view direction and the reflected light direction, clamped to (0,1)
+	float r[size]; ///< Distances to the lights
+
+	/**
+	 Computes the terms of the first n lights of the batch.
+	 @param n Number of lights, the positions of the others must be initialized but are ignored
+	 @param point The shaded point
+	 @param normal Normal vector at the point
+	 @param view Normalized direction from the point to the viewer
+	 */
+	void compute(int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view){
+		kernel(*this, n, point, normal, view);
+	}
+
+	/** Selects the kernel used by compute for the given instruction set. */
+	static void selectKernel(CPU::ISA isa){
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512: kernel = &computeAVX512; break;
+			case CPU::ISA::AVX2: kernel = &computeAVX2; break;
+			case CPU::ISA::SSE42: kernel = &computeSSE42; break;
+#endif
+			default: kernel = &computeScalar;
+		}
+	}
+
+	/** Reference kernel, one light at a time. */
+	static void computeScalar(LightTerms &b, int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view){
+		float NdotV = glm::dot(normal, view);
+		for (int i = 0; i < n; i++) {
+			glm::vec3 d = glm::vec3(b.px[i], b.py[i], b.pz[i]) - point;
+			float r = glm::length(d);
+			glm::vec3 l = d / r;
+			float NL = glm::dot(normal, l);
+			// dot(view, reflect(-l, normal)) without computing the reflected direction
+			float VR = 2 * NL * NdotV - glm::dot(view, l);
+			b.lx[i] = l.x; b.ly[i] = l.y; b.lz[i] = l.z;
+			b.NdotL[i] = glm::clamp(NL, 0.0f, 1.0f);
+			b.VdotR[i] = glm::clamp(VR, 0.0f, 1.0f);
+			b.r[i] = r;
+		}
+	}
+
+#ifdef CPU_X86
+	/** SSE4.2 kernel, four lights at a time. */
+	TARGET_SSE42 static void computeSSE42(LightTerms &b, int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view){
+		const __m128 Px = _mm_set1_ps(point.x), Py = _mm_set1_ps(point.y), Pz = _mm_set1_ps(point.z);
+		const __m128 Nx = _mm_set1_ps(normal.x), Ny = _mm_set1_ps(normal.y), Nz = _mm_set1_ps(normal.z);
+		const __m128 Vx = _mm_set1_ps(view.x), Vy = _mm_set1_ps(view.y), Vz = _mm_set1_ps(view.z);
+		const __m128 NdotV2 = _mm_set1_ps(2 * glm::dot(normal, view));
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+		for (int i = 0; i < n; i += 4) {
+			__m128 dx = _mm_sub_ps(_mm_load_ps(b.px + i), Px);
+			__m128 dy = _mm_sub_ps(_mm_load_ps(b.py + i), Py);
+			__m128 dz = _mm_sub_ps(_mm_load_ps(b.pz + i), Pz);
+			__m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+			__m128 inv = _mm_div_ps(one, r);
+			dx = _mm_mul_ps(dx, inv);
+			dy = _mm_mul_ps(dy, inv);
+			dz = _mm_mul_ps(dz, inv);
+			__m128 NL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, dx), _mm_mul_ps(Ny, dy)), _mm_mul_ps(Nz, dz));
+			__m128 VL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Vx, dx), _mm_mul_ps(Vy, dy)), _mm_mul_ps(Vz, dz));
+			__m128 VR = _mm_sub_ps(_mm_mul_ps(NdotV2, NL), VL);
+			_mm_store_ps(b.lx + i, dx);
+			_mm_store_ps(b.ly + i, dy);
+			_mm_store_ps(b.lz + i, dz);
+			_mm_store_ps(b.NdotL + i, _mm_min_ps(_mm_max_ps(NL, zero), one));
+			_mm_store_ps(b.VdotR + i, _mm_min_ps(_mm_max_ps(VR, zero), one));
+			_mm_store_ps(b.r + i, r);
+		}
+	}
+
+	/** AVX2 kernel, eight lights at a time. */
+	TARGET_AVX2 static void computeAVX2(LightTerms &b, int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view){
+		const __m256 Px = _mm256_set1_ps(point.x), Py = _mm256_set1_ps(point.y), Pz = _mm256_set1_ps(point.z);
+		const __m256 Nx = _mm256_set1_ps(normal.x), Ny = _mm256_set1_ps(normal.y), Nz = _mm256_set1_ps(normal.z);
+		const __m256 Vx = _mm256_set1_ps(view.x), Vy = _mm256_set1_ps(view.y), Vz = _mm256_set1_ps(view.z);
+		const __m256 NdotV2 = _mm256_set1_ps(2 * glm::dot(normal, view));
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+		for (int i = 0; i < n; i += 8) {
+			__m256 dx = _mm256_sub_ps(_mm256_load_ps(b.px + i), Px);
+			__m256 dy = _mm256_sub_ps(_mm256_load_ps(b.py + i), Py);
+			__m256 dz = _mm256_sub_ps(_mm256_load_ps(b.pz + i), Pz);
+			__m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+			__m256 inv = _mm256_div_ps(one, r);
+			dx = _mm256_mul_ps(dx, inv);
+			dy = _mm256_mul_ps(dy, inv);
+			dz = _mm256_mul_ps(dz, inv);
+			__m256 NL = _mm256_fmadd_ps(Nx, dx, _mm256_fmadd_ps(Ny, dy, _mm256_mul_ps(Nz, dz)));
+			__m256 VL = _mm256_fmadd_ps(Vx, dx, _mm256_fmadd_ps(Vy, dy, _mm256_mul_ps(Vz, dz)));
+			__m256 VR = _mm256_fmsub_ps(NdotV2, NL, VL);
+			_mm256_store_ps(b.lx + i, dx);
+			_mm256_store_ps(b.ly + i, dy);
+			_mm256_store_ps(b.lz + i, dz);
+			_mm256_store_ps(b.NdotL + i, _mm256_min_ps(_mm256_max_ps(NL, zero), one));
+			_mm256_store_ps(b.VdotR + i, _mm256_min_ps(_mm256_max_ps(VR, zero), one));
+			_mm256_store_ps(b.r + i, r);
+		}
+	}
+
+	/** AVX-512 kernel, the whole batch at once, the lanes beyond the first n lights left untouched. */
+	TARGET_AVX512 static void computeAVX512(LightTerms &b, int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view){
+		const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+		const __mmask16 lanes = (__mmask16)((1u << n) - 1);
+		__m512 dx = _mm512_sub_ps(_mm512_maskz_load_ps(lanes, b.px), _mm512_set1_ps(point.x));
+		__m512 dy = _mm512_sub_ps(_mm512_maskz_load_ps(lanes, b.py), _mm512_set1_ps(point.y));
+		__m512 dz = _mm512_sub_ps(_mm512_maskz_load_ps(lanes, b.pz), _mm512_set1_ps(point.z));
+		__m512 r = _mm512_maskz_sqrt_ps(lanes, _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz))));
+		__m512 inv = _mm512_div_ps(one, r);
+		dx = _mm512_mul_ps(dx, inv);
+		dy = _mm512_mul_ps(dy, inv);
+		dz = _mm512_mul_ps(dz, inv);
+		__m512 NL = _mm512_fmadd_ps(_mm512_set1_ps(normal.x), dx, _mm512_fmadd_ps(_mm512_set1_ps(normal.y), dy, _mm512_mul_ps(_mm512_set1_ps(normal.z), dz)));
+		__m512 VL = _mm512_fmadd_ps(_mm512_set1_ps(view.x), dx, _mm512_fmadd_ps(_mm512_set1_ps(view.y), dy, _mm512_mul_ps(_mm512_set1_ps(view.z), dz)));
+		__m512 VR = _mm512_fmsub_ps(_mm512_set1_ps(2 * glm::dot(normal, view)), NL, VL);
+		_mm512_mask_store_ps(b.lx, lanes, dx);
+		_mm512_mask_store_ps(b.ly, lanes, dy);
+		_mm512_mask_store_ps(b.lz, lanes, dz);
+		_mm512_mask_store_ps(b.NdotL, lanes, _mm512_maskz_min_ps(lanes, _mm512_maskz_max_ps(lanes, NL, zero), one));
+		_mm512_mask_store_ps(b.VdotR, lanes, _mm512_maskz_min_ps(lanes, _mm512_maskz_max_ps(lanes, VR, zero), one));
+		_mm512_mask_store_ps(b.r, lanes, r);
+	}
+#endif
+
+	/** Signature of the kernels, see compute */
+	typedef void (*Kernel)(LightTerms &batch, int n, const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view);
+	static inline Kernel kernel = &computeScalar; ///< Kernel used by compute, see selectKernel
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,149 @@
+#ifndef LIGHTTREE_HPP
+#define LIGHTTREE_HPP
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "Light.hpp"
+
+using namespace std;
+
+/**
+ Bounding volume hierarchy of the lights of a scene, from which a fixed number of lights is sampled per shaded
+ point instead of shading every light, so that the cost of a point hardly grows with the number of lights. Every
+ node bounds its lights by a box, and carries their total intensity. A light is sampled by a walk from the root,
+ which goes down into each child with a probability proportional to an estimate of its contribution to the point:
+ the intensity of the child divided by its squared distance, times the largest cosine between the normal and the
+ cone of directions from the point to the box. The lights are omnidirectional, so that their own emission cones
+ would not bound anything. Lights which are behind the surface keep a small probability, since the specular term
+ of the Phong model does not vanish there.
+ */
+class LightTree {
+public:
+	static constexpr int maxSamples = 16; ///< Largest number of lights sampled per point
+
+	/** Node of the tree, whose first child follows it. */
+	struct Node {
+		glm::vec3 lo, hi; ///< Bounds of the lights below, with their extent
+		float power; ///< Sum of the intensities of the lights below, the average of the components of their colors
+		int32_t light; ///< Index of the light of a leaf, -1 for the other nodes
+		int32_t second; ///< Index of the second child
+	};
+
+	explicit LightTree(const vector<Light *> &lights): lights(lights) {
+		if (lights.empty()) return;
+		vector<int32_t> order(lights.size());
+		iota(order.begin(), order.end(), 0);
+		nodes.reserve(2 * lights.size() - 1);
+		build(order, 0, (int32_t)order.size());
+	}
+
+	[[nodiscard]] size_t size() const {
+		return lights.size();
+	}
+
+	/**
+	 Samples lights for a point, stratified over the walks: the k-th walk follows the number (k + offset) / count.
+	 @param normal Normal vector at the point, facing the viewer
+	 @param offset uniform random number in [0,1), which should differ between points
+	 @param count number of lights sampled, at most maxSamples; a light may be sampled several times
+	 @param sampled receives the lights
+	 @param weights receives the weights of their contributions, 1 / (count * probability), so that the weighted sum of
+	 the contributions of the sampled lights is on average that of all the lights
+	 @return the number of lights sampled, 0 if there are no lights
+	 */
+	int sample(const glm::vec3 &point, const glm::vec3 &normal, float offset, int count, const Light **sampled, float *weights) const {
+		if (nodes.empty()) return 0;
+		count = std::min(count, maxSamples);
+		for (int k = 0; k < count; k++) {
+			float u = ((float)k + offset) / (float)count;
+			float probability = 1;
+			int32_t n = 0;
+			while (nodes[n].light < 0) {
+				float left = importance(nodes[n + 1], point, normal), right = importance(nodes[nodes[n].second], point, normal);
+				float p = left + right > 0 ? left / (left + right) : 0.5f;
+				if (u < p) {
+					u /= p;
+					probability *= p;
+					n = n + 1;
+				} else {
+					u = std::min((u - p) / (1 - p), 0.99999994f);
+					probability *= 1 - p;
+					n = nodes[n].second;
+				}
+			}
+			sampled[k] = lights[nodes[n].light];
+			weights[k] = 1 / ((float)count * probability);
+		}
+		return count;
+	}
+
+private:
+	vector<Light *> lights;
+	vector<Node> nodes;
+
+	/** Estimate of the contribution of the lights of a node to a point, see the class description. */
+	static float importance(const Node &node, const glm::vec3 &point, const glm::vec3 &normal) {
+		glm::vec3 d = (node.lo + node.hi) * 0.5f - point;
+		float radius2 = glm::dot(node.hi - node.lo, node.hi - node.lo) * 0.25f;
+		float distance2 = glm::dot(d, d);
+		float cosine = 1;
+		if (distance2 > radius2) {
+			// the bounding sphere of the box is seen within an angle of asin(radius / distance) around d
+			float distance = std::sqrt(distance2);
+			float sinU = std::sqrt(radius2) / distance, cosU = std::sqrt(1 - sinU * sinU);
+			float cosT = glm::dot(normal, d) / distance;
+			if (cosT < cosU) {
+				float sinT = std::sqrt(std::max(0.0f, 1 - cosT * cosT));
+				cosine = cosT * cosU + sinT * sinU; // cosine of the angle from the normal to the closest direction
+			}
+		}
+		// like PhongModel, the lights are not closer than 0.1
+		return node.power * std::max(cosine, 0.1f) / std::max({distance2, radius2, 0.01f});
+	}
+
+	/** Builds the subtree of the lights order[begin, end), split in the middle of the longest axis of their centers. */
+	int32_t build(vector<int32_t> &order, int32_t begin, int32_t end) {
+		int32_t index = (int32_t)nodes.size();
+		nodes.emplace_back();
+		glm::vec3 lo(INFINITY), hi(-INFINITY), clo(INFINITY), chi(-INFINITY);
+		float power = 0;
+		for (int32_t i = begin; i < end; i++) {
+			const Light &light = *lights[order[i]];
+			glm::vec3 extent(light.radius);
+			if (light.shape == Light::Shape::RECTANGLE) extent = (glm::abs(light.edgeU) + glm::abs(light.edgeV)) * 0.5f;
+			lo = glm::min(lo, light.position - extent);
+			hi = glm::max(hi, light.position + extent);
+			clo = glm::min(clo, light.position);
+			chi = glm::max(chi, light.position);
+			power += (light.color.r + light.color.g + light.color.b) / 3;
+		}
+		Node node{lo, hi, power, -1, -1};
+		if (end - begin == 1) {
+			node.light = order[begin];
+		} else {
+			glm::vec3 e = chi - clo;
+			int axis = e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+			int32_t middle = begin + (end - begin) / 2;
+			nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int32_t a, int32_t b) {
+				return lights[a]->position[axis] < lights[b]->position[axis];
+			});
+			build(order, begin, middle);
+			node.second = build(order, middle, end);
+		}
+		nodes[index] = node;
+		return index;
+	}
+};
+
+/** Sampling of the lights shaded at each point, see LightTree. */
+struct LightSampling {
+	const LightTree *tree = nullptr; ///< Tree of the lights to sample, null to shade every light
+	int samples = 8; ///< Number of lights sampled per point, at most LightTree::maxSamples
+};
+
+#endif
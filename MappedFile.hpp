@@ -0,0 +1,72 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <iostream>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ Read-only memory mapping of a whole file. The pages are only read from the disk when they are accessed,
+ and the system can drop them again under memory pressure.
+ */
+struct MappedFile {
+	bool good = false;
+	const char *data = nullptr; ///< Content of the file, not null terminated
+	size_t size = 0; ///< Number of bytes of the file
+
+	explicit MappedFile(const string &path) {
+		fd = open(path.c_str(), O_RDONLY);
+		struct stat st{};
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			cerr << "Could not open file " << path << endl;
+			return;
+		}
+		size = st.st_size;
+		if (size > 0) { // empty files cannot be mapped
+			void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				cerr << "Could not map file " << path << endl;
+				return;
+			}
+			data = (const char *)p;
+		}
+		good = true;
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() {
+		if (data) munmap((void *)data, size);
+		if (fd >= 0) close(fd);
+	}
+
+	/** Tells the system that the given range will be read sequentially, so that it is read ahead. */
+	void sequential(size_t offset, size_t length) const {
+		advise(offset, length, POSIX_MADV_SEQUENTIAL);
+	}
+
+	/** Tells the system that the pages within the given range are not needed anymore. */
+	void release(size_t offset, size_t length) const {
+		advise(offset, length, POSIX_MADV_DONTNEED);
+	}
+
+private:
+	int fd = -1;
+
+	// Applies the advice to the whole pages within the range, the pages at its ends may be shared with other data
+	void advise(size_t offset, size_t length, int advice) const {
+		if (!data) return;
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t begin = (offset + page - 1) / page * page, end = std::min(offset + length, size) / page * page;
+		if (end > begin) posix_madvise((void *)(data + begin), end - begin, advice);
+	}
+};
+
+#endif
@@ -11,6 +11,9 @@
 #include "glm/glm.hpp"
 #include "Textures.h"
 
+class Texture;
+namespace Procedural { class Evaluator; }
+
 /**
  Structure describing a material of an object
  */
@@ -20,6 +23,8 @@ struct Material{
     glm::vec3 specular = glm::vec3(0.0);
     float shininess = 0.0;
     glm::vec3 (* texture)(glm::vec2 uv) = nullptr;
+    const Procedural::Evaluator *procedural = nullptr; ///< Procedural texture of the diffuse color, see Procedural::compile
+    const Texture *diffuseMap = nullptr; ///< Image modulating the diffuse color, see Texture
     float refraction = 0.0;
     float reflection = 0.0;
 };
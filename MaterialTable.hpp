@@ -0,0 +1,204 @@
+#ifndef MATERIALTABLE_HPP
+#define MATERIALTABLE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <filesystem>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "Material.h"
+#include "Texture.hpp"
+#include "Procedural.hpp"
+
+using namespace std;
+
+/**
+ Materials shared by the objects of a scene, which refer to them by their 16-bit index (material ID): the
+ objects register their material once (see Object::registerMaterials), meshes store one index per triangle,
+ and hits carry the index of the material they hit. The fields are stored in structure-of-arrays form, so
+ that shading reads only the fields it needs, and the textures are kept apart from the numbers.
+ Materials can be named, the names are used by the MTL libraries referenced by OBJ files. The image textures of
+ the MTL files are owned by the table and share its cache of texture tiles.
+ */
+struct MaterialTable {
+	static constexpr uint16_t none = UINT16_MAX; ///< Index meaning that the material of the object is used
+
+	vector<glm::vec3> ambient;
+	vector<glm::vec3> diffuse;
+	vector<glm::vec3> specular;
+	vector<float> shininess;
+	vector<float> reflection;
+	vector<float> refraction;
+	vector<glm::vec3 (*)(glm::vec2 uv)> texture; ///< Texture function of the diffuse color, or null
+	vector<const Procedural::Evaluator *> procedural; ///< Procedural texture of the diffuse color, or null
+	vector<const Texture *> diffuseMap; ///< Image modulating the diffuse color, or null
+
+	TextureCache textureCache; ///< Cache of the tiles of the textures loaded by the MTL files
+
+	/**
+	 Diffuse color of a material at a point, from its texture function or its procedural texture, or its diffuse
+	 color modulated by its image.
+	 @param uv texture coordinates of the point
+	 @param footprint width of the area seen by the pixel in texture coordinate units, see Texture::sample
+	 */
+	[[nodiscard]] glm::vec3 diffuseColor(uint16_t index, const glm::vec2 &uv, float footprint = 0) const {
+		if (texture[index]) return texture[index](uv);
+		if (procedural[index]) return (*procedural[index])(uv);
+		if (diffuseMap[index]) return diffuse[index] * diffuseMap[index]->sample(uv, footprint);
+		return diffuse[index];
+	}
+
+	/** Index of the material with the given name, or none if there is no such material. */
+	[[nodiscard]] uint16_t find(const string &name) const {
+		auto it = indices.find(name);
+		return it == indices.end() ? none : it->second;
+	}
+
+	/**
+	 Adds a material, or replaces the material with the same name. Materials with an empty name are always added.
+	 @return its index, or none if the table is full
+	 */
+	uint16_t add(const string &name, const Material &material) {
+		uint16_t index = name.empty() ? none : find(name);
+		if (index == none) {
+			if (size() >= none) return none;
+			index = (uint16_t)size();
+			for (auto v : {&ambient, &diffuse, &specular}) v->emplace_back();
+			for (auto v : {&shininess, &reflection, &refraction}) v->emplace_back();
+			texture.emplace_back();
+			procedural.emplace_back();
+			diffuseMap.emplace_back();
+			names.push_back(name);
+			if (!name.empty()) indices[name] = index;
+		}
+		ambient[index] = material.ambient;
+		diffuse[index] = material.diffuse;
+		specular[index] = material.specular;
+		shininess[index] = material.shininess;
+		reflection[index] = material.reflection;
+		refraction[index] = material.refraction;
+		texture[index] = material.texture;
+		procedural[index] = material.procedural;
+		diffuseMap[index] = material.diffuseMap;
+		return index;
+	}
+
+	/** Adds an unnamed material. @return its index, or none if the table is full */
+	uint16_t add(const Material &material) {
+		return add("", material);
+	}
+
+	/**
+	 Adds the materials of an MTL file. The Phong parameters are converted as follows: Ka, Kd and Ks are the
+	 ambient, diffuse and specular colors, Ns is the shininess, and a dissolve d (or 1 - Tr) below 1 makes
+	 the material refract with the index Ni. The illumination models 3 and 5 make it reflect as much as its
+	 strongest specular component, and map_Kd gives the image modulating the diffuse color (see Texture), whose
+	 path is relative to the MTL file. A library is only read once.
+	 @return whether the file could be read
+	 */
+	bool load(const string &path) {
+		if (std::find(libraries.begin(), libraries.end(), path) != libraries.end()) return true;
+		ifstream file(path);
+		if (!file.is_open()) {
+			cerr << "Could not open file " << path << endl;
+			return false;
+		}
+		libraries.push_back(path);
+		string name, line;
+		Material material;
+		float dissolve = 1, ior = 1;
+		int illum = 0;
+		auto flush = [&]() {
+			if (name.empty()) return;
+			material.refraction = dissolve < 1 ? ior : 0.0f;
+			if (illum == 3 || illum == 5) material.reflection = std::max({material.specular.x, material.specular.y, material.specular.z});
+			if (add(name, material) == none) cerr << path << ": too many materials" << endl;
+		};
+		while (getline(file, line)) {
+			istringstream ss(line);
+			string keyword;
+			ss >> keyword;
+			glm::vec3 c;
+			if (keyword == "newmtl") {
+				flush();
+				getline(ss >> ws, name);
+				while (!name.empty() && (name.back() == '\r' || name.back() == ' ' || name.back() == '\t')) name.pop_back();
+				material = Material();
+				dissolve = ior = 1;
+				illum = 0;
+			} else if (keyword == "Ka" && ss >> c.x >> c.y >> c.z) {
+				material.ambient = c;
+			} else if (keyword == "Kd" && ss >> c.x >> c.y >> c.z) {
+				material.diffuse = c;
+			} else if (keyword == "Ks" && ss >> c.x >> c.y >> c.z) {
+				material.specular = c;
+			} else if (keyword == "Ns") {
+				ss >> material.shininess;
+			} else if (keyword == "Ni") {
+				ss >> ior;
+			} else if (keyword == "d") {
+				ss >> dissolve;
+			} else if (keyword == "Tr" && ss >> c.x) {
+				dissolve = 1 - c.x;
+			} else if (keyword == "illum") {
+				ss >> illum;
+			} else if (keyword == "map_Kd") {
+				// the options before the file name are ignored
+				string token, file;
+				while (ss >> token) file = token;
+				if (!file.empty()) material.diffuseMap = image((filesystem::path(path).parent_path() / file).string());
+			}
+		}
+		flush();
+		return true;
+	}
+
+	[[nodiscard]] size_t size() const {
+		return names.size();
+	}
+
+	/** Gathers the fields of a material. */
+	Material operator[](uint16_t index) const {
+		Material m;
+		m.ambient = ambient[index];
+		m.diffuse = diffuse[index];
+		m.specular = specular[index];
+		m.shininess = shininess[index];
+		m.reflection = reflection[index];
+		m.refraction = refraction[index];
+		m.texture = texture[index];
+		m.procedural = procedural[index];
+		m.diffuseMap = diffuseMap[index];
+		return m;
+	}
+
+	/** Texture of an image, opened on first use and then shared by the materials. @return null if it cannot be read */
+	const Texture *image(const string &path) {
+		for (auto &t : images) {
+			if (t.first == path) return t.second->good ? t.second.get() : nullptr;
+		}
+		images.emplace_back(path, make_unique<Texture>(path, textureCache));
+		const Texture *t = images.back().second.get();
+		return t->good ? t : nullptr;
+	}
+
+	/** Name of the material with the given index. */
+	[[nodiscard]] const string &name(uint16_t index) const {
+		return names[index];
+	}
+
+private:
+	vector<string> names;
+	unordered_map<string, uint16_t> indices;
+	vector<string> libraries; ///< Paths of the MTL files already loaded
+	vector<pair<string, unique_ptr<Texture>>> images; ///< Textures opened by image, with their paths
+};
+
+#endif
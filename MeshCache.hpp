@@ -0,0 +1,314 @@
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <type_traits>
+
+#include "glm/glm.hpp"
+#include "OBJ.hpp"
+#include "PLY.hpp"
+#include "MappedFile.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+using namespace OBJ;
+
+/**
+ Binary cache of the meshes read from OBJ files. After the first parse, the indexed arrays of the model are
+ written next to the OBJ file, and later runs load them with a single mapping of the cache instead of
+ parsing the text again.
+
+ The format is versioned and little-endian: a Header, the name of the model, the paths of its MTL files
+ (relative to the directory of the OBJ file, so that the cache does not depend on the working directory), the names of its materials and its groups (a name, the first triangle and the number of triangles), then
+ the positions and the normals (3 floats each), the texture coordinates (2 floats each), the vertex, normal
+ and texture coordinate indices of the triangles (3 uint32 each, the last ones only if there are texture
+ coordinates) and the material indices of the triangles (uint16, only if there are materials). Strings
+ are stored as their uint32 length followed by their bytes padded to 4 bytes. The header records the size, the modification time and a hash of the OBJ file; the cache is used
+ when the size matches and either the modification time or the hash does, so that touching the OBJ file
+ without changing it does not trigger a parse.
+ */
+namespace MeshCache {
+
+const uint32_t version = 4;
+
+struct Header {
+	char magic[8]; ///< "CGCMESH" followed by the byte 'C'
+	uint32_t version;
+	uint32_t groupCount, libraryCount, materialCount;
+	uint64_t sourceSize; ///< Size in bytes of the OBJ file
+	int64_t sourceTime; ///< Modification time of the OBJ file, in the units of the file clock
+	uint64_t sourceHash; ///< Hash of the content of the OBJ file, see hash
+	uint64_t vertexCount, normalCount, texcoordCount, triangleCount;
+	float min[3], max[3]; ///< Bounds of the positions
+};
+
+/** Path of the cache of an OBJ file. */
+string path(const string &source) {
+	return source + ".meshcache";
+}
+
+/** Fast 64-bit hash of a block of memory, reading 8 bytes at a time. Not meant to resist collisions on purpose. */
+uint64_t hash(const char *data, size_t size) {
+	const uint64_t m = 0x9E3779B97F4A7C15ull;
+	uint64_t h = size * m;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		h = (h ^ (w * m)) * 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 31;
+	}
+	for (; i < size; i++) h = (h ^ (uint8_t)data[i]) * m;
+	return h ^ (h >> 29);
+}
+
+/** Whether the host stores numbers in little-endian order, like the cache. */
+constexpr bool littleEndian() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return false;
+#else
+	return true;
+#endif
+}
+
+/** Reverses the byte order of count values of 4 bytes in place, on big-endian hosts only. */
+void toLittleEndian(void *data, size_t count) {
+	if (littleEndian()) return;
+	auto *p = (uint32_t *)data;
+	for (size_t i = 0; i < count; i++) p[i] = __builtin_bswap32(p[i]);
+}
+
+void toLittleEndian(Header &h) {
+	toLittleEndian(&h.version, 4);
+	toLittleEndian(h.min, 6);
+	if (littleEndian()) return;
+	for (uint64_t *v : {&h.sourceSize, (uint64_t *)&h.sourceTime, &h.sourceHash, &h.vertexCount, &h.normalCount, &h.texcoordCount, &h.triangleCount}) {
+		*v = __builtin_bswap64(*v);
+	}
+}
+
+/** Size, modification time and hash of a source file. */
+struct Stamp {
+	uint64_t size = 0;
+	int64_t time = 0;
+	uint64_t hash = 0;
+};
+
+/** Stamp of a file; the hash is only computed if requested, as it reads the whole file. */
+bool stamp(const string &source, Stamp &s, bool withHash) {
+	error_code ec;
+	s.size = filesystem::file_size(source, ec);
+	if (ec) return false;
+	s.time = (int64_t)filesystem::last_write_time(source, ec).time_since_epoch().count();
+	if (ec) return false;
+	if (withHash) {
+		MappedFile file(source);
+		if (!file.good) return false;
+		file.sequential(0, file.size);
+		s.hash = hash(file.data, file.size);
+	}
+	return true;
+}
+
+/**
+ Writes the cache of a model. The file is written under a temporary name and then renamed, so that a
+ concurrent reader never sees a partial cache.
+ @return whether the cache could be written
+ */
+bool write(const Model &model, const string &cachePath, const string &sourcePath, const Stamp &source) {
+	if (model.compressed || model.materialTable) return false; // the cache stores the float geometry and the material names
+	Header header{};
+	memcpy(header.magic, "CGCMESHC", 8);
+	header.version = version;
+	header.groupCount = (uint32_t)model.groups.size();
+	header.libraryCount = (uint32_t)model.materialLibraries.size();
+	header.materialCount = (uint32_t)model.materialNames.size();
+	header.sourceSize = source.size;
+	header.sourceTime = source.time;
+	header.sourceHash = source.hash;
+	header.vertexCount = model.vertices.size();
+	header.normalCount = model.normals.size();
+	header.texcoordCount = model.texcoords.size();
+	header.triangleCount = model.size();
+	glm::vec3 min, max;
+	model.bounds(min, max);
+	for (int d = 0; d < 3; d++) {
+		header.min[d] = min[d];
+		header.max[d] = max[d];
+	}
+	toLittleEndian(header);
+
+	string temporary = cachePath + ".tmp";
+	ofstream file(temporary, ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+	file.write((const char *)&header, sizeof(Header));
+	auto writeWord = [&file](uint32_t word) {
+		toLittleEndian(&word, 1);
+		file.write((const char *)&word, 4);
+	};
+	auto writeString = [&file, &writeWord](const string &s) {
+		char padding[4] = {};
+		writeWord((uint32_t)s.size());
+		file.write(s.data(), (streamsize)s.size());
+		file.write(padding, (4 - s.size() % 4) % 4);
+	};
+	writeString(model.name);
+	// the paths of the model are resolved against the directory of the OBJ file (see OBJ::read), which is stripped;
+	// an absolute path given in the OBJ file is not relative to it and is kept
+	filesystem::path directory = filesystem::path(sourcePath).parent_path();
+	for (auto &library : model.materialLibraries) {
+		filesystem::path relative = filesystem::path(library).lexically_relative(directory);
+		writeString(relative.empty() ? library : relative.string());
+	}
+	for (auto &material : model.materialNames) writeString(material);
+	for (auto &group : model.groups) {
+		writeString(group.name);
+		writeWord(group.first);
+		writeWord(group.count);
+	}
+	auto writeArray = [&file](const auto &values) {
+		using T = typename decay_t<decltype(values)>::value_type;
+		if (littleEndian()) {
+			file.write((const char *)values.data(), values.size() * sizeof(T));
+			return;
+		}
+		for (T v : values) {
+			if constexpr (sizeof(T) == 2) {
+				v = __builtin_bswap16(v);
+			} else {
+				toLittleEndian(&v, sizeof(T) / 4);
+			}
+			file.write((const char *)&v, sizeof(T));
+		}
+	};
+	writeArray(model.vertices);
+	writeArray(model.normals);
+	writeArray(model.texcoords);
+	writeArray(model.vertexIndices);
+	writeArray(model.normalIndices);
+	writeArray(model.texcoordIndices);
+	writeArray(model.materialIndices);
+	file.close();
+	error_code ec;
+	if (!file || (filesystem::rename(temporary, cachePath, ec), ec)) {
+		filesystem::remove(temporary, ec);
+		return false;
+	}
+	return true;
+}
+
+/**
+ Loads the cache of a model if it is valid for the given source.
+ @param source stamp of the source file, whose hash is computed here only if the modification times differ
+ @return whether the model was loaded
+ */
+bool load(const string &cachePath, const string &sourcePath, Stamp &source, Model &model) {
+	error_code ec;
+	if (!filesystem::exists(cachePath, ec)) return false;
+	MappedFile file(cachePath);
+	if (!file.good || file.size < sizeof(Header)) return false;
+	Header header{};
+	memcpy(&header, file.data, sizeof(Header));
+	toLittleEndian(header);
+	if (memcmp(header.magic, "CGCMESHC", 8) != 0 || header.version != version || header.sourceSize != source.size) return false;
+	if (header.sourceTime != source.time) {
+		Stamp hashed;
+		if (!stamp(sourcePath, hashed, true) || hashed.hash != header.sourceHash) return false;
+		source.hash = hashed.hash;
+	}
+	const char *p = file.data + sizeof(Header), *end = file.data + file.size;
+	auto readWord = [&p, end](uint32_t &word) {
+		if (end - p < 4) return false;
+		memcpy(&word, p, 4);
+		toLittleEndian(&word, 1);
+		p += 4;
+		return true;
+	};
+	auto readString = [&p, end, &readWord](string &s) {
+		uint32_t length;
+		if (!readWord(length) || (size_t)(end - p) < (length + 3) / 4 * 4) return false;
+		s.assign(p, length);
+		p += (length + 3) / 4 * 4;
+		return true;
+	};
+	if (!readString(model.name) || header.libraryCount > file.size || header.materialCount > file.size || header.groupCount > file.size) return false;
+	model.materialLibraries.resize(header.libraryCount);
+	for (auto &library : model.materialLibraries) {
+		if (!readString(library)) return false;
+		library = (filesystem::path(sourcePath).parent_path() / library).string();
+	}
+	model.materialNames.resize(header.materialCount);
+	for (auto &material : model.materialNames) if (!readString(material)) return false;
+	model.groups.resize(header.groupCount);
+	for (auto &group : model.groups) {
+		if (!readString(group.name) || !readWord(group.first) || !readWord(group.count)) return false;
+	}
+
+	if (header.vertexCount > file.size || header.normalCount > file.size || header.texcoordCount > file.size || header.triangleCount > file.size) return false;
+	size_t bytes = (header.vertexCount + header.normalCount) * sizeof(glm::vec3) + header.texcoordCount * sizeof(glm::vec2)
+		+ header.triangleCount * (header.texcoordCount ? 3 : 2) * sizeof(glm::uvec3) + (header.materialCount ? header.triangleCount * sizeof(uint16_t) : 0);
+	if ((size_t)(end - p) != bytes) return false;
+
+	auto readArray = [&p](auto &values, size_t count) {
+		using T = typename decay_t<decltype(values)>::value_type;
+		values.resize(count);
+		memcpy(values.data(), p, count * sizeof(T));
+		if constexpr (sizeof(T) == 2) {
+			if (!littleEndian()) for (auto &v : values) v = __builtin_bswap16(v);
+		} else {
+			toLittleEndian(values.data(), count * sizeof(T) / 4);
+		}
+		p += count * sizeof(T);
+	};
+	readArray(model.vertices, header.vertexCount);
+	readArray(model.normals, header.normalCount);
+	readArray(model.texcoords, header.texcoordCount);
+	readArray(model.vertexIndices, header.triangleCount);
+	readArray(model.normalIndices, header.triangleCount);
+	readArray(model.texcoordIndices, header.texcoordCount ? header.triangleCount : 0);
+	readArray(model.materialIndices, header.materialCount ? header.triangleCount : 0);
+	for (size_t i = 0; i < model.size(); i++) {
+		for (int k = 0; k < 3; k++) {
+			if (model.vertexIndices[i][k] >= model.vertices.size() || model.normalIndices[i][k] >= model.normals.size()) return false;
+			if (!model.texcoords.empty() && model.texcoordIndices[i][k] >= model.texcoords.size()) return false;
+		}
+		if (!model.materialIndices.empty() && model.materialIndices[i] >= model.materialNames.size() && model.materialIndices[i] != MaterialTable::none) return false;
+	}
+	for (auto &group : model.groups) if ((uint64_t)group.first + group.count > model.size()) return false;
+	model.good = true;
+	return true;
+}
+
+/**
+ Reads an OBJ file through its cache: the cache is loaded if it is valid, otherwise the OBJ file is parsed
+ (see OBJ::read) and the cache is written for the next runs. Binary PLY files are read directly with
+ PLY::read, as they load as fast as the cache.
+ @param pool passed to OBJ::read or PLY::read
+ */
+Model read(const string &source, thread_pool *pool = nullptr) {
+	if (filesystem::path(source).extension() == ".ply") return PLY::read(source, pool);
+	Stamp s;
+	if (!stamp(source, s, false)) return OBJ::read(source, pool); // reports the error
+	string cachePath = path(source);
+	Model model("", false);
+	if (load(cachePath, source, s, model)) {
+		// the source was touched without being modified, the cache is stamped again to skip the hash next time
+		if (s.hash) write(model, cachePath, source, s);
+		return model;
+	}
+	// the source is stamped before it is parsed, so that a concurrent modification invalidates the cache
+	bool stamped = stamp(source, s, true);
+	model = OBJ::read(source, pool);
+	if (model.good && stamped && !write(model, cachePath, source, s)) cerr << "Could not write the cache " << cachePath << endl;
+	return model;
+}
+
+} // namespace MeshCache
+
+#endif
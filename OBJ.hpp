@@ -9,36 +9,333 @@
 #include <algorithm>
 #include <cmath>
 #include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <system_error>
+#include <filesystem>
+#include <unordered_map>
 
 #include "glm/glm.hpp"
+#include "Object.hpp"
+#include "Hit.hpp"
+#include "Ray.hpp"
 #include "Triangle.hpp"
+#include "Compression.hpp"
+#include "MappedFile.hpp"
+#include "thread_pool.hpp"
 #include "Material.h"
+#include "MaterialTable.hpp"
 
 using namespace std;
 
 namespace OBJ {
 
-struct Model {
+/**
+ Indexed triangle mesh: the positions and normals are stored once and each triangle refers to them
+ through indices. The hierarchy of bounding boxes and the intersection code read the vertices through
+ these indices. The mesh is an Object, whose transformation places it in the scene.
+ After compress, the positions are quantized to 16 bits and the normals are octahedral encoded; they are
+ then decoded on the fly wherever a vertex or a normal is read.
+ The triangles can be split into named groups and use materials of a MaterialTable, see bindMaterials;
+ the others use the material of the object.
+ */
+struct Model : Object {
+	/** Consecutive triangles declared under an o or g statement. */
+	struct Group {
+		string name;
+		uint32_t first; ///< Index of the first triangle
+		uint32_t count; ///< Number of triangles
+	};
+
 	bool good;
 	string name;
-	vector<Triangle> triangles;
-	Material material;
-
-	glm::mat4 transformationMatrix;
-	glm::mat4 inverseTransformationMatrix;
-	glm::mat4 normalMatrix;
+	vector<glm::vec3> vertices; ///< Positions of the vertices, in the coordinate system of the model
+	vector<glm::vec3> normals; ///< Normals of the vertices, in the coordinate system of the model
+	vector<glm::uvec3> vertexIndices; ///< Indices in vertices of the three vertices of each triangle
+	vector<glm::uvec3> normalIndices; ///< Indices in normals of the three normals of each triangle
+	vector<glm::vec2> texcoords; ///< Texture coordinates of the vertices, empty if the mesh has none
+	vector<glm::uvec3> texcoordIndices; ///< Indices in texcoords of the three texture coordinates of each triangle, empty if the mesh has none
+	bool compressed = false; ///< Whether the geometry is stored in the two arrays below instead of vertices and normals
+	vector<glm::u16vec3> quantizedVertices; ///< Positions quantized with quantization, only filled when compressed
+	vector<uint32_t> octahedralNormals; ///< Normals encoded with Compression::encodeOctahedral, only filled when compressed
+	Compression::Quantization quantization; ///< Quantization of the positions to the bounds of the mesh
+	vector<Group> groups; ///< Groups of triangles in the order of the file, empty if there is none
+	vector<string> materialLibraries; ///< Paths of the MTL files referenced by the mesh
+	vector<string> materialNames; ///< Names of the materials used by the triangles, in the order of their first use
+	/// Per triangle, index of its material in materialNames, or once bound in materialTable; MaterialTable::none
+	/// for the material of the object. Empty if no triangle has a material.
+	vector<uint16_t> materialIndices;
+	const MaterialTable *materialTable = nullptr; ///< Table indexed by materialIndices, null until bindMaterials
 
+	using Object::transformationMatrix;
+	using Object::inverseTransformationMatrix;
+	using Object::normalMatrix;
 
 	explicit Model(string name) : Model(std::move(name), true) {}
-	Model(string name, bool good) : name(std::move(name)), good(good) {}
+	Model(string name, bool good) : name(std::move(name)), good(good) {
+		setTransformation(glm::mat4(1.0f));
+	}
+
+	/** Number of triangles of the mesh. */
+	[[nodiscard]] size_t size() const {
+		return vertexIndices.size();
+	}
+
+	/** Position of the k-th vertex of the i-th triangle. */
+	[[nodiscard]] glm::vec3 vertex(size_t i, int k) const {
+		if (compressed) return quantization.decode(quantizedVertices[vertexIndices[i][k]]);
+		return vertices[vertexIndices[i][k]];
+	}
+
+	/** Normal of the k-th vertex of the i-th triangle. */
+	[[nodiscard]] glm::vec3 normal(size_t i, int k) const {
+		if (compressed) return Compression::decodeOctahedral(octahedralNormals[normalIndices[i][k]]);
+		return normals[normalIndices[i][k]];
+	}
+
+	/** Interpolated normal of the i-th triangle at the barycentric coordinates u, v. */
+	[[nodiscard]] glm::vec3 normal(size_t i, float u, float v) const {
+		return (1 - u - v) * normal(i, 0) + u * normal(i, 1) + v * normal(i, 2);
+	}
+
+	/**
+	 Texture coordinate units per unit of length on the i-th triangle, once transformed, from the ratio of its areas
+	 in texture and in space; 0 if the mesh has no texture coordinates.
+	 */
+	[[nodiscard]] float texcoordDensity(size_t i) const {
+		if (texcoords.empty()) return 0;
+		glm::mat3 m(transformationMatrix);
+		glm::vec3 a = vertex(i, 0);
+		float area = glm::length(glm::cross(m * (vertex(i, 1) - a), m * (vertex(i, 2) - a)));
+		const glm::uvec3 &t = texcoordIndices[i];
+		glm::vec2 e1 = texcoords[t[1]] - texcoords[t[0]], e2 = texcoords[t[2]] - texcoords[t[0]];
+		float uvArea = std::abs(e1.x * e2.y - e1.y * e2.x);
+		return area > 0 ? std::sqrt(uvArea / area) : 0.0f;
+	}
+
+	/** Interpolated texture coordinates of the i-th triangle at the barycentric coordinates u, v, or 0 if the mesh has none. */
+	[[nodiscard]] glm::vec2 texcoord(size_t i, float u, float v) const {
+		if (texcoords.empty()) return glm::vec2(0);
+		const glm::uvec3 &t = texcoordIndices[i];
+		return (1 - u - v) * texcoords[t[0]] + u * texcoords[t[1]] + v * texcoords[t[2]];
+	}
+
+	/** Appends a standalone triangle, its vertices are not shared with the other triangles. The mesh must not be compressed. */
+	void addTriangle(const Triangle &t) {
+		auto first = (unsigned int)vertices.size();
+		vertices.insert(vertices.end(), {t.a, t.b, t.c});
+		vertexIndices.emplace_back(first, first + 1, first + 2);
+		first = (unsigned int)normals.size();
+		normals.insert(normals.end(), {t.n_a, t.n_b, t.n_c});
+		normalIndices.emplace_back(first, first + 1, first + 2);
+		if (!texcoords.empty()) { // Triangle has no texture coordinates
+			texcoordIndices.emplace_back((unsigned int)texcoords.size());
+			texcoords.emplace_back(0);
+		}
+		if (!materialIndices.empty()) materialIndices.push_back(MaterialTable::none);
+	}
+
+	/** Index in the material table of the material of the i-th triangle, or MaterialTable::none if it uses the material of the object. */
+	[[nodiscard]] uint16_t triangleMaterial(size_t i) const {
+		return materialTable && !materialIndices.empty() ? materialIndices[i] : MaterialTable::none;
+	}
+
+	/**
+	 Loads the MTL libraries of the mesh into the table and makes materialIndices refer to it. The materials
+	 which are not found in the libraries are reported, and their triangles use the material of the object.
+	 The table must outlive the mesh. This can only be done once.
+	 */
+	void bindMaterials(MaterialTable &table) {
+		if (materialTable) return;
+		for (auto &library : materialLibraries) table.load(library);
+		vector<uint16_t> remap(materialNames.size());
+		for (size_t m = 0; m < materialNames.size(); m++) {
+			remap[m] = table.find(materialNames[m]);
+			if (remap[m] == MaterialTable::none) cerr << name << ": unknown material " << materialNames[m] << endl;
+		}
+		for (auto &index : materialIndices) if (index != MaterialTable::none) index = remap[index];
+		materialTable = &table;
+	}
+
+	/** Binds the materials of the triangles (see bindMaterials) and registers the material of the object. */
+	void registerMaterials(MaterialTable &table) override {
+		bindMaterials(table);
+		Object::registerMaterials(table);
+	}
 
-	void addTriangle(Triangle t) {
-		triangles.push_back(t);
+	/**
+	 Merges the vertices and the normals which are exactly equal, as exporters often write one copy of
+	 each per face, and remaps the indices of the triangles accordingly. The order of first appearance is kept.
+	 This works on the float arrays, so it must be called before compress.
+	 */
+	void deduplicate() {
+		deduplicate(vertices, vertexIndices);
+		deduplicate(normals, normalIndices);
+		deduplicate(texcoords, texcoordIndices);
 	}
 
+	/**
+	 Computes smooth normals at the vertices, as the sum of the geometric normals of the triangles around them
+	 weighted by their areas, and makes the triangles flagged in missing use them. The normals are appended
+	 to normals, one per vertex.
+	 @param missing per triangle, the bit k is set if its k-th vertex has no normal
+	 @param pool if not null, the normals are computed in parallel
+	 */
+	void smoothNormals(const vector<uint8_t> &missing, thread_pool *pool = nullptr) {
+		auto loop = [pool](size_t n, const auto &body) {
+			if (pool && n > 4096) {
+				pool->parallelize_loop(0, n, [&body](size_t first, size_t last) {
+					for (size_t i = first; i < last; i++) body(i);
+				});
+			} else {
+				for (size_t i = 0; i < n; i++) body(i);
+			}
+		};
+		// the cross product of two edges has the direction of the normal and twice the area as length
+		vector<glm::vec3> faceNormals(size());
+		loop(size(), [this, &faceNormals](size_t i) {
+			faceNormals[i] = glm::cross(vertex(i, 1) - vertex(i, 0), vertex(i, 2) - vertex(i, 0));
+		});
+		// triangles around each vertex, in compressed rows, so that every vertex is summed by a single thread
+		size_t vertexCount = compressed ? quantizedVertices.size() : vertices.size();
+		vector<uint32_t> first(vertexCount + 1, 0), around(3 * size());
+		for (auto &t : vertexIndices) for (int k = 0; k < 3; k++) first[t[k] + 1]++;
+		for (size_t v = 0; v < vertexCount; v++) first[v + 1] += first[v];
+		vector<uint32_t> next(first.begin(), first.end() - 1);
+		for (size_t i = 0; i < size(); i++) for (int k = 0; k < 3; k++) around[next[vertexIndices[i][k]]++] = (uint32_t)i;
+
+		auto base = (unsigned int)(compressed ? octahedralNormals.size() : normals.size());
+		vector<glm::vec3> smooth(vertexCount);
+		loop(vertexCount, [&](size_t v) {
+			glm::vec3 sum(0);
+			for (uint32_t j = first[v]; j < first[v + 1]; j++) sum += faceNormals[around[j]];
+			smooth[v] = glm::length(sum) > 0 ? glm::normalize(sum) : glm::vec3(0, 0, 1);
+		});
+		if (compressed) {
+			for (auto &n : smooth) octahedralNormals.push_back(Compression::encodeOctahedral(n));
+		} else {
+			normals.insert(normals.end(), smooth.begin(), smooth.end());
+		}
+		loop(size(), [&](size_t i) {
+			for (int k = 0; k < 3; k++) if (missing[i] & (1 << k)) normalIndices[i][k] = base + vertexIndices[i][k];
+		});
+	}
+
+	/**
+	 Switches to the compressed geometry: 6 bytes per position instead of 12 and 4 bytes per normal
+	 instead of 12. The float arrays are released. Positions move by at most quantization.maxError(),
+	 and normals are normalized by the encoding.
+	 */
+	void compress() {
+		if (compressed) return;
+		glm::vec3 min, max;
+		bounds(min, max);
+		quantization = Compression::Quantization(min, max);
+		quantizedVertices.clear();
+		quantizedVertices.reserve(vertices.size());
+		for (auto &v : vertices) quantizedVertices.push_back(quantization.encode(v));
+		octahedralNormals.clear();
+		octahedralNormals.reserve(normals.size());
+		for (auto &n : normals) octahedralNormals.push_back(Compression::encodeOctahedral(n));
+		vector<glm::vec3>().swap(vertices);
+		vector<glm::vec3>().swap(normals);
+		compressed = true;
+	}
+
+	/** Bounding box of the vertices of the mesh, in the coordinate system of the model. */
+	void bounds(glm::vec3 &min, glm::vec3 &max) const {
+		min = glm::vec3(FLOAT_INFINITY);
+		max = glm::vec3(-FLOAT_INFINITY);
+		if (compressed) {
+			for (auto &q : quantizedVertices) {
+				min = glm::min(min, quantization.decode(q));
+				max = glm::max(max, quantization.decode(q));
+			}
+			return;
+		}
+		for (auto &v : vertices) {
+			min = glm::min(min, v);
+			max = glm::max(max, v);
+		}
+	}
+
+	/** Number of bytes used by the geometry of the mesh. */
+	[[nodiscard]] size_t memory() const {
+		return (vertices.capacity() + normals.capacity()) * sizeof(glm::vec3) + texcoords.capacity() * sizeof(glm::vec2)
+			+ quantizedVertices.capacity() * sizeof(glm::u16vec3) + octahedralNormals.capacity() * sizeof(uint32_t)
+			+ (vertexIndices.capacity() + normalIndices.capacity() + texcoordIndices.capacity()) * sizeof(glm::uvec3)
+			+ materialIndices.capacity() * sizeof(uint16_t);
+	}
+
+	/**
+	 Intersects the ray with every triangle of the mesh. This is only meant for small meshes and as a
+	 reference, larger ones should be intersected through a hierarchy of bounding boxes (see BoundingBox).
+	 */
+	Hit intersect(const Ray &ray) override {
+		glm::vec3 local_o = inverseTransformationMatrix * glm::vec4(ray.origin, 1.0);
+		glm::vec3 local_d = glm::normalize(glm::vec3(inverseTransformationMatrix * glm::vec4(ray.direction, 0.0)));
+		Ray R(local_o, local_d);
+		Hit hit;
+		float bestT = FLOAT_INFINITY;
+		for (size_t i = 0; i < size(); i++) {
+			float t, u, v;
+			if (!intersectTriangle(vertex(i, 0), vertex(i, 1), vertex(i, 2), R, t, u, v) || t >= bestT) continue;
+			bestT = t;
+			hit.hit = true;
+			hit.intersection = transformationMatrix * glm::vec4(R.origin + t * R.direction, 1.0);
+			hit.normal = glm::normalize(glm::vec3(normalMatrix * glm::vec4(normal(i, u, v), 0.0)));
+			hit.uv = texcoord(i, u, v);
+			hit.uvDensity = texcoordDensity(i);
+			hit.materialId = triangleMaterial(i);
+			hit.distance = glm::length(hit.intersection - ray.origin);
+			hit.object = this;
+		}
+		return hit;
+	}
+
+private:
+	template <typename T>
+	static void deduplicate(vector<T> &values, vector<glm::uvec3> &indices) {
+		// open addressing table of indices in unique; the values are compared bit for bit, so that the hash
+		// agrees with the equality (0 and -0 are kept apart)
+		const int words = sizeof(T) / 4;
+		const uint64_t primes[3] = {73856093u, 19349663u, 83492791u};
+		size_t capacity = 16;
+		while (capacity < 2 * values.size()) capacity *= 2;
+		vector<uint32_t> table(capacity, UINT32_MAX);
+		vector<unsigned int> remap(values.size());
+		vector<T> unique;
+		for (size_t i = 0; i < values.size(); i++) {
+			uint32_t b[words];
+			memcpy(b, &values[i], sizeof(b));
+			uint64_t h = 0;
+			for (int w = 0; w < words; w++) h ^= (uint64_t)b[w] * primes[w];
+			size_t slot = (h * 0x9E3779B97F4A7C15ull) >> 32 & (capacity - 1);
+			while (table[slot] != UINT32_MAX && memcmp(&unique[table[slot]], &values[i], sizeof(T)) != 0) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			if (table[slot] == UINT32_MAX) {
+				table[slot] = (uint32_t)unique.size();
+				unique.push_back(values[i]);
+			}
+			remap[i] = table[slot];
+		}
+		for (auto &t : indices) t = glm::uvec3(remap[t.x], remap[t.y], remap[t.z]);
+		unique.shrink_to_fit();
+		values = std::move(unique);
+	}
+
+public:
 	[[nodiscard]] string toString() const {
 		stringstream ss;
-		ss << "OBJ::Model (" << name << "): " << triangles.size() << " triangles";
+		ss << "OBJ::Model (" << name << "): " << size() << " triangles, "
+		   << (compressed ? quantizedVertices.size() : vertices.size()) << " vertices, "
+		   << (compressed ? octahedralNormals.size() : normals.size()) << " normals";
+		if (!texcoords.empty()) ss << ", " << texcoords.size() << " texture coordinates";
+		if (!groups.empty()) ss << ", " << groups.size() << " groups";
+		if (!materialNames.empty()) ss << ", " << materialNames.size() << " materials";
+		if (compressed) ss << " (compressed)";
 		return ss.str();
 	}
 	
@@ -46,68 +343,342 @@ struct Model {
 		os << obj.toString();
 		return os;
 	}
-
-	void setTransformation(glm::mat4 matrix){
-		transformationMatrix = matrix;
-		inverseTransformationMatrix = glm::inverse(matrix);
-		normalMatrix = glm::transpose(inverseTransformationMatrix);
-	}
 };
 
-// Assuming no texture coordinates are present in the OBJ file
-Model read(const string &filename) {
-	Model model("", false);
-	// Open file
-	ifstream file(filename);
-	if (!file.is_open()) {
-		cerr << "Could not open file " << filename << endl;
-		return model;
-	}
-	string name;
+/**
+ Content of a range of lines of an OBJ file, see parse. The indices of the faces are kept as written in the
+ file (1-based, 0 when missing) except the negative ones, which count back from the last element read and
+ are converted to 0-based indices relative to the first element of the chunk, flagged in relative.
+ */
+struct Chunk {
+	string name; ///< Name of the last object declared in the chunk
+	vector<pair<string, size_t>> groups; ///< Name and first triangle, counted in the chunk, of the groups starting in the chunk
+	vector<pair<string, size_t>> materials; ///< Name and first triangle, counted in the chunk, of the usemtl statements
+	vector<string> libraries; ///< Names of the MTL files, as written in the file
 	vector<glm::vec3> vertices;
 	vector<glm::vec3> normals;
-	string line;
-	while (getline(file, line)) {
-		if (line.substr(0, 1) == "o") {
-			model.name = line.substr(2, line.length() - 2);
-		} else if (line.substr(0,2) == "vn") {
-			stringstream ss(line.substr(3));
-			glm::vec3 normal;
-			ss >> normal.x >> normal.y >> normal.z;
-			normals.push_back(normal);
-		} else if (line.substr(0,1) == "v") {
-			stringstream ss(line.substr(2));
-			glm::vec3 vertex;
-			ss >> vertex.x >> vertex.y >> vertex.z;
-			vertices.push_back(vertex);
-		} else if (line.substr(0,1) == "f") {
-			stringstream ss(line.substr(2));
-			vector<int> face_vertices, face_normals;
-			string token;
-			while (getline(ss, token, ' ')) {
-				stringstream token_ss(token);
-				int vertex = -1, normal;
-				string index;
-				while (getline(token_ss, index, '/')) {
-					if (index.length() > 0) {
-						stringstream index_ss(index);
-						if (vertex == -1) {
-							index_ss >> vertex;
-						}
-						else index_ss >> normal;
+	vector<glm::vec2> texcoords;
+	vector<glm::ivec3> vertexIndices; ///< Per triangle of the faces
+	vector<glm::ivec3> normalIndices;
+	vector<glm::ivec3> textureIndices;
+	vector<uint16_t> relative; ///< Per triangle, bit k (vertex k), 3 + k (normal k) or 6 + k (texture k) is set for relative indices
+	vector<glm::ivec3> polygon; ///< Vertex, texture and normal indices of the face being parsed, kept to reuse its memory
+	vector<uint8_t> polygonRelative; ///< Per vertex of polygon, bit 0 (vertex), 1 (texture) or 2 (normal) is set for relative indices
+	size_t lines = 0; ///< Number of lines of the chunk
+	size_t errorLine = 0; ///< Number of the first malformed line, counted from 1 in the chunk, 0 if none
+};
+
+/** Skips spaces, tabs and carriage returns. */
+const char *skipSpaces(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	return p;
+}
+
+/** The text between p and end without the spaces around it. */
+string trimmed(const char *p, const char *end) {
+	p = skipSpaces(p, end);
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+	return string(p, end);
+}
+
+/**
+ Parses a float at p, after optional spaces.
+ @return the position after the number, or nullptr if there is none
+ */
+const char *parseFloat(const char *p, const char *end, float &value) {
+	p = skipSpaces(p, end);
+	if (p < end && *p == '+') p++; // not accepted by from_chars
+#if defined(__cpp_lib_to_chars)
+	auto [next, ec] = from_chars(p, end, value);
+	return ec == errc() ? next : nullptr;
+#else
+	// the mapping is not null terminated, the number is copied for strtof
+	char buffer[64];
+	size_t n = 0;
+	while (p + n < end && n < sizeof(buffer) - 1 && strchr("0123456789+-.eEinfatyINFATY", p[n])) n++;
+	memcpy(buffer, p, n);
+	buffer[n] = 0;
+	char *next;
+	value = strtof(buffer, &next);
+	return next == buffer ? nullptr : p + (next - buffer);
+#endif
+}
+
+/**
+ Parses a signed integer at p, without skipping spaces.
+ @return the position after the number, or nullptr if there is none
+ */
+const char *parseInt(const char *p, const char *end, int &value) {
+	bool negative = p < end && *p == '-';
+	if (negative || (p < end && *p == '+')) p++;
+	if (p == end || *p < '0' || *p > '9') return nullptr;
+	int64_t v = 0;
+	while (p < end && *p >= '0' && *p <= '9' && v <= INT32_MAX) v = v * 10 + (*p++ - '0');
+	value = (int)(negative ? -v : v);
+	return p;
+}
+
+/**
+ Parses a vertex reference of a face, v, v/vt, v//vn or v/vt/vn. Missing indices are set to 0.
+ @return the position after it, or nullptr if it is malformed
+ */
+const char *parseFaceVertex(const char *p, const char *end, int &vertex, int &texture, int &normal) {
+	texture = normal = 0;
+	p = parseInt(p, end, vertex);
+	if (!p || p == end || *p != '/') return p;
+	p++;
+	if (p < end && *p != '/') {
+		p = parseInt(p, end, texture);
+		if (!p || p == end || *p != '/') return p;
+	}
+	return parseInt(p + 1, end, normal);
+}
+
+/**
+ Parses the lines between begin and end, which must start at the beginning of a line, without any copy of the
+ text and without allocating per line. Faces with more than three vertices are split in a fan of triangles
+ around their first vertex, which is exact for the convex polygons written by modeling tools.
+ @param chunk the parsed content, whose indices still need to be resolved (see merge)
+ */
+void parse(const char *begin, const char *end, Chunk &chunk) {
+	for (const char *p = begin; p < end; chunk.lines++) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+		p = skipSpaces(p, eol);
+		bool ok = true;
+		if (eol - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			glm::vec3 v;
+			ok = (p = parseFloat(p + 2, eol, v.x)) && (p = parseFloat(p, eol, v.y)) && (p = parseFloat(p, eol, v.z));
+			if (ok) chunk.vertices.push_back(v);
+		} else if (eol - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+			glm::vec3 n;
+			ok = (p = parseFloat(p + 3, eol, n.x)) && (p = parseFloat(p, eol, n.y)) && (p = parseFloat(p, eol, n.z));
+			if (ok) chunk.normals.push_back(n);
+		} else if (eol - p >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+			glm::vec2 t; // an optional third coordinate is ignored
+			ok = (p = parseFloat(p + 3, eol, t.x)) && (p = parseFloat(p, eol, t.y));
+			if (ok) chunk.texcoords.push_back(t);
+		} else if (eol - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			vector<glm::ivec3> &polygon = chunk.polygon;
+			vector<uint8_t> &polygonRelative = chunk.polygonRelative;
+			polygon.clear();
+			polygonRelative.clear();
+			const int counts[3] = {(int)chunk.vertices.size(), (int)chunk.texcoords.size(), (int)chunk.normals.size()};
+			p = skipSpaces(p + 2, eol);
+			while (p < eol) {
+				glm::ivec3 r; // vertex, texture and normal
+				ok = (p = parseFaceVertex(p, eol, r[0], r[1], r[2])) && r[0] != 0 && (p == eol || *p == ' ' || *p == '\t' || *p == '\r');
+				if (!ok) break;
+				uint8_t relative = 0;
+				for (int j = 0; j < 3; j++) {
+					if (r[j] < 0) {
+						r[j] += counts[j];
+						relative |= 1 << j;
 					}
 				}
-				face_vertices.push_back(vertex - 1);
-				face_normals.push_back(normal - 1);
+				polygon.push_back(r);
+				polygonRelative.push_back(relative);
+				p = skipSpaces(p, eol);
+			}
+			ok = ok && polygon.size() >= 3;
+			for (size_t k = 2; ok && k < polygon.size(); k++) {
+				const size_t corners[3] = {0, k - 1, k};
+				glm::ivec3 v, t, n;
+				uint16_t relative = 0;
+				for (int c = 0; c < 3; c++) {
+					const glm::ivec3 &r = polygon[corners[c]];
+					uint8_t flags = polygonRelative[corners[c]];
+					v[c] = r[0];
+					t[c] = r[1];
+					n[c] = r[2];
+					relative |= (flags & 1) << c | (flags >> 2 & 1) << (3 + c) | (flags >> 1 & 1) << (6 + c);
+				}
+				chunk.vertexIndices.push_back(v);
+				chunk.normalIndices.push_back(n);
+				chunk.textureIndices.push_back(t);
+				chunk.relative.push_back(relative);
+			}
+		} else if (eol - p >= 1 && (p[0] == 'o' || p[0] == 'g') && (eol - p == 1 || p[1] == ' ' || p[1] == '\t')) {
+			string name = trimmed(p + 1, eol);
+			chunk.groups.emplace_back(name, chunk.vertexIndices.size());
+			if (p[0] == 'o') chunk.name = std::move(name);
+		} else if (eol - p >= 7 && memcmp(p, "usemtl", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+			chunk.materials.emplace_back(trimmed(p + 6, eol), chunk.vertexIndices.size());
+		} else if (eol - p >= 7 && memcmp(p, "mtllib", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+			for (p = skipSpaces(p + 6, eol); p < eol; p = skipSpaces(p, eol)) {
+				const char *last = p;
+				while (last < eol && *last != ' ' && *last != '\t' && *last != '\r') last++;
+				chunk.libraries.emplace_back(p, last);
+				p = last;
 			}
-			model.addTriangle(Triangle(vertices[face_vertices[0]],
-                                           vertices[face_vertices[1]],
-                                           vertices[face_vertices[2]],
-                                           normals[face_normals[0]],
-                                           normals[face_normals[1]],
-                                           normals[face_normals[2]]));
 		}
+		if (!ok && !chunk.errorLine) chunk.errorLine = chunk.lines + 1;
+		p = eol + 1;
+	}
+}
+
+/**
+ Merges the chunks, in the order of the file, into the model: the arrays are concatenated and the indices
+ are resolved with the number of vertices, normals and texture coordinates which precede each chunk.
+ Missing normals are replaced by smooth vertex normals (see Model::smoothNormals) and, if the file has
+ texture coordinates, missing ones by (0, 0). The groups and the materials of the triangles are gathered
+ from the statements of all the chunks; empty groups are dropped.
+ @param pool if not null, the chunks are merged and the normals computed in parallel
+ @return whether all the indices are valid
+ */
+bool merge(vector<Chunk> &chunks, Model &model, thread_pool *pool = nullptr) {
+	// exclusive prefix sums of the number of vertices, normals, texture coordinates and triangles
+	size_t n = chunks.size();
+	vector<size_t> vertexBase(n + 1, 0), normalBase(n + 1, 0), texcoordBase(n + 1, 0), faceBase(n + 1, 0);
+	for (size_t c = 0; c < n; c++) {
+		vertexBase[c + 1] = vertexBase[c] + chunks[c].vertices.size();
+		normalBase[c + 1] = normalBase[c] + chunks[c].normals.size();
+		texcoordBase[c + 1] = texcoordBase[c] + chunks[c].texcoords.size();
+		faceBase[c + 1] = faceBase[c] + chunks[c].vertexIndices.size();
+		if (!chunks[c].name.empty()) model.name = chunks[c].name;
+	}
+	bool textured = texcoordBase.back() > 0;
+	model.vertices.resize(vertexBase.back());
+	model.normals.resize(normalBase.back());
+	model.texcoords.resize(texcoordBase.back());
+	model.vertexIndices.resize(faceBase.back());
+	model.normalIndices.resize(faceBase.back());
+	model.texcoordIndices.resize(textured ? faceBase.back() : 0);
+	vector<uint8_t> missing(faceBase.back(), 0); // per triangle, bit k is set if its k-th vertex has no normal
+	vector<uint8_t> valid(n, true), untextured(n, false), unnormalized(n, false);
+	auto mergeChunk = [&](size_t c) {
+		Chunk &chunk = chunks[c];
+		copy(chunk.vertices.begin(), chunk.vertices.end(), model.vertices.begin() + vertexBase[c]);
+		copy(chunk.normals.begin(), chunk.normals.end(), model.normals.begin() + normalBase[c]);
+		copy(chunk.texcoords.begin(), chunk.texcoords.end(), model.texcoords.begin() + texcoordBase[c]);
+		// resolves an index of the file to a 0-based one, -1 if it is missing, and checks it against the count
+		auto resolve = [&valid, c](int index, bool relative, size_t base, size_t count) {
+			int64_t i = relative ? (int64_t)base + index : (int64_t)index - 1;
+			if (i < (relative ? 0 : -1) || i >= (int64_t)count) valid[c] = false;
+			return (unsigned int)i;
+		};
+		for (size_t f = 0; f < chunk.vertexIndices.size(); f++) {
+			size_t i = faceBase[c] + f;
+			uint16_t relative = chunk.relative[f];
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = resolve(chunk.vertexIndices[f][k], relative & (1 << k), vertexBase[c], vertexBase.back());
+				if (v == UINT32_MAX) valid[c] = false;
+				model.vertexIndices[i][k] = v;
+				model.normalIndices[i][k] = resolve(chunk.normalIndices[f][k], relative & (8 << k), normalBase[c], normalBase.back());
+				if (model.normalIndices[i][k] == UINT32_MAX) {
+					missing[i] |= 1 << k;
+					unnormalized[c] = true;
+				}
+				if (!textured) continue; // the texture indices of a file without texture coordinates are ignored
+				model.texcoordIndices[i][k] = resolve(chunk.textureIndices[f][k], relative & (64 << k), texcoordBase[c], texcoordBase.back());
+				if (model.texcoordIndices[i][k] == UINT32_MAX) untextured[c] = true;
+			}
+		}
+		vector<glm::vec3>().swap(chunk.vertices);
+		vector<glm::vec3>().swap(chunk.normals);
+		vector<glm::vec2>().swap(chunk.texcoords);
+	};
+	if (pool && n > 1) {
+		pool->parallelize_loop(0, n, [&mergeChunk](size_t first, size_t last) {
+			for (size_t c = first; c < last; c++) mergeChunk(c);
+		}, (uint_fast32_t)n);
+	} else {
+		for (size_t c = 0; c < n; c++) mergeChunk(c);
+	}
+	if (find(valid.begin(), valid.end(), false) != valid.end()) return false;
+	if (textured && find(untextured.begin(), untextured.end(), true) != untextured.end()) {
+		auto index = (unsigned int)model.texcoords.size();
+		model.texcoords.emplace_back(0);
+		for (auto &t : model.texcoordIndices) for (int k = 0; k < 3; k++) if (t[k] == UINT32_MAX) t[k] = index;
+	}
+	if (find(unnormalized.begin(), unnormalized.end(), true) != unnormalized.end()) model.smoothNormals(missing, pool);
+
+	// the starts of the groups and of the materials are offset by the triangles of the preceding chunks
+	vector<pair<string, size_t>> groups, materials;
+	for (size_t c = 0; c < n; c++) {
+		for (auto &g : chunks[c].groups) groups.emplace_back(std::move(g.first), faceBase[c] + g.second);
+		for (auto &m : chunks[c].materials) materials.emplace_back(std::move(m.first), faceBase[c] + m.second);
+		for (auto &library : chunks[c].libraries) {
+			if (find(model.materialLibraries.begin(), model.materialLibraries.end(), library) == model.materialLibraries.end()) {
+				model.materialLibraries.push_back(library);
+			}
+		}
+	}
+	if (!groups.empty() && groups[0].second > 0) groups.insert(groups.begin(), {"", 0}); // triangles before the first group
+	for (size_t g = 0; g < groups.size(); g++) {
+		size_t first = groups[g].second, last = g + 1 < groups.size() ? groups[g + 1].second : model.size();
+		if (last > first) model.groups.push_back({std::move(groups[g].first), (uint32_t)first, (uint32_t)(last - first)});
+	}
+	if (!materials.empty()) {
+		unordered_map<string, uint16_t> indices;
+		model.materialIndices.assign(model.size(), MaterialTable::none);
+		for (size_t m = 0; m < materials.size(); m++) {
+			size_t first = materials[m].second, last = m + 1 < materials.size() ? materials[m + 1].second : model.size();
+			if (last == first) continue;
+			auto it = indices.find(materials[m].first);
+			if (it == indices.end()) {
+				if (model.materialNames.size() == MaterialTable::none) {
+					cerr << model.name << ": too many materials, " << materials[m].first << " is ignored" << endl;
+					continue;
+				}
+				it = indices.emplace(materials[m].first, (uint16_t)model.materialNames.size()).first;
+				model.materialNames.push_back(materials[m].first);
+			}
+			fill(model.materialIndices.begin() + first, model.materialIndices.begin() + last, it->second);
+		}
+		if (model.materialNames.empty()) model.materialIndices.clear();
+	}
+	return true;
+}
+
+const size_t chunkBytes = 1 << 20; ///< Smallest part of a file parsed by one task of OBJ::read
+
+/**
+ Reads an OBJ file: the file is memory mapped and parsed in place, see parse. Vertices, normals and texture
+ coordinates are then deduplicated.
+ @param pool if not null, the file is split at line boundaries into chunks which are parsed in parallel, and
+ the result is the same as when it is read serially
+ */
+Model read(const string &filename, thread_pool *pool = nullptr) {
+	Model model("", false);
+	MappedFile file(filename);
+	if (!file.good) return model;
+	file.sequential(0, file.size);
+
+	// a few chunks per thread balance the load, as their content and speed vary
+	size_t count = pool ? std::max<size_t>(1, std::min<size_t>(file.size / chunkBytes, 4 * pool->get_thread_count())) : 1;
+	vector<const char *> bounds(count + 1, file.data + file.size);
+	bounds[0] = file.data;
+	for (size_t c = 1; c < count; c++) {
+		// the chunk starts after the end of the line which contains the byte before its nominal start
+		const char *p = std::max(bounds[c - 1], file.data + file.size * c / count) - 1;
+		const char *eol = (const char *)memchr(p, '\n', file.data + file.size - p);
+		bounds[c] = eol ? eol + 1 : file.data + file.size;
+	}
+	vector<Chunk> chunks(count);
+	if (count > 1) {
+		pool->parallelize_loop(0, count, [&chunks, &bounds](size_t first, size_t last) {
+			for (size_t c = first; c < last; c++) parse(bounds[c], bounds[c + 1], chunks[c]);
+		}, (uint_fast32_t)count);
+	} else {
+		parse(bounds[0], bounds[1], chunks[0]);
+	}
+
+	size_t line = 0;
+	for (auto &chunk : chunks) {
+		if (chunk.errorLine) {
+			cerr << filename << ": malformed line " << line + chunk.errorLine << endl;
+			break;
+		}
+		line += chunk.lines;
+	}
+	if (!merge(chunks, model, pool)) {
+		cerr << filename << ": invalid face index" << endl;
+		return model;
 	}
+	// the MTL files are found relative to the OBJ file
+	for (auto &library : model.materialLibraries) library = (filesystem::path(filename).parent_path() / library).string();
+	model.deduplicate();
 	model.good = true;
 	return model;
 }
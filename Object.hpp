@@ -1,5 +1,6 @@
 #include "glm/glm.hpp"
 #include "Material.h"
+#include "MaterialTable.hpp"
 #include "Ray.hpp"
 
 #ifndef OBJECT_HPP
@@ -16,10 +17,15 @@ protected:
 	glm::mat4 transformationMatrix; ///< Matrix representing the transformation from the local to the global coordinate system
 	glm::mat4 inverseTransformationMatrix; ///< Matrix representing the transformation from the global to the local coordinate system
 	glm::mat4 normalMatrix; ///< Matrix for transforming normal vectors from the local to the global coordinate system
+	/// Structure describing the material of the object, only changed through setMaterial so that materialId follows it
+	Material material;
 	
 public:
 	glm::vec3 color; ///< Color of the object
-	Material material; ///< Structure describing the material of the object
+	/// Index of the material in the material table of the scene, none until the object is registered, see registerMaterials
+	uint16_t materialId = MaterialTable::none;
+	virtual ~Object() = default;
+
 	/** A function computing an intersection, which returns the structure Hit */
     virtual Hit intersect(const Ray &ray) = 0;
 
@@ -27,11 +33,20 @@ public:
 	[[nodiscard]] Material getMaterial() const {
 		return material;
 	}
-	/** Function that set the material
+	/** Function that set the material. The object has to be registered again in the material table before shading,
+	 see registerMaterials.
 	 @param material A structure describing the material of the object
 	*/
 	void setMaterial(Material material){
 		this->material = material;
+		materialId = MaterialTable::none;
+	}
+	/** Function that adds the material of the object to the material table of the scene, which is then used for shading.
+	 It must be called for every object before rendering, and again after setMaterial.
+	 @param table The material table of the scene
+	*/
+	virtual void registerMaterials(MaterialTable &table){
+		if (materialId == MaterialTable::none) materialId = table.add(material);
 	}
 	
 	void setTransformation(glm::mat4 matrix){
@@ -0,0 +1,393 @@
+#ifndef PLY_HPP
+#define PLY_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <initializer_list>
+#include <cstdint>
+#include <cstring>
+
+#include "glm/glm.hpp"
+#include "OBJ.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+
+/**
+ Reader of binary PLY files (Stanford polygon format), in which scanned models are usually distributed.
+ The file is memory mapped and the vertex and face elements are decoded straight into the arrays of an
+ OBJ::Model, so that the result is the same as for an OBJ file: positions, and normals and texture
+ coordinates if the vertices have them. Both byte orders and all the scalar types are supported; the
+ properties and elements which are not used are skipped.
+ */
+namespace PLY {
+
+enum class Type : uint8_t {INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64};
+
+/** Size in bytes of a value of the given type. */
+size_t size(Type type) {
+	const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+	return sizes[(int)type];
+}
+
+/** Type of a property from its name in the header, both the old and the sized names are accepted. @return whether the name is known */
+bool parseType(const string &name, Type &type) {
+	const char *names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+							  {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+	for (int t = 0; t < 8; t++) {
+		if (name == names[t][0] || name == names[t][1]) {
+			type = (Type)t;
+			return true;
+		}
+	}
+	return false;
+}
+
+struct Property {
+	string name;
+	Type type; ///< Type of the value, or of the items of a list
+	bool list = false;
+	Type countType = Type::UINT8; ///< Type of the number of items of a list
+	size_t offset = 0; ///< Offset in the element, only meaningful if all the properties before are scalars
+};
+
+struct Element {
+	string name;
+	size_t count = 0;
+	vector<Property> properties;
+	size_t stride = 0; ///< Size in bytes of an element, 0 if it has a list and its size varies
+
+	/** Index of the property with one of the given names, or -1. */
+	[[nodiscard]] int find(initializer_list<const char *> names) const {
+		for (size_t i = 0; i < properties.size(); i++) {
+			for (const char *name : names) if (properties[i].name == name) return (int)i;
+		}
+		return -1;
+	}
+};
+
+/** Whether the host stores numbers in little-endian order. */
+constexpr bool littleEndian() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return false;
+#else
+	return true;
+#endif
+}
+
+/** Reads a value of the given type at p, reversing its bytes if swap is set. */
+template <typename T>
+T value(const char *p, Type type, bool swap) {
+	char b[8];
+	size_t n = size(type);
+	memcpy(b, p, n);
+	if (swap) reverse(b, b + n);
+	switch (type) {
+		case Type::INT8: return (T)*(int8_t *)b;
+		case Type::UINT8: return (T)*(uint8_t *)b;
+		case Type::INT16: { int16_t v; memcpy(&v, b, 2); return (T)v; }
+		case Type::UINT16: { uint16_t v; memcpy(&v, b, 2); return (T)v; }
+		case Type::INT32: { int32_t v; memcpy(&v, b, 4); return (T)v; }
+		case Type::UINT32: { uint32_t v; memcpy(&v, b, 4); return (T)v; }
+		case Type::FLOAT32: { float v; memcpy(&v, b, 4); return (T)v; }
+		default: { double v; memcpy(&v, b, 8); return (T)v; }
+	}
+}
+
+/**
+ Parses the header, which ends with the line end_header.
+ @param bigEndian set to the byte order of the data
+ @param dataOffset set to the position of the first byte after the header
+ @return an empty string on success, otherwise the error
+ */
+string parseHeader(const char *data, size_t fileSize, vector<Element> &elements, bool &bigEndian, size_t &dataOffset) {
+	if (fileSize < 4 || memcmp(data, "ply", 3) != 0 || (data[3] != '\n' && data[3] != '\r')) return "not a PLY file";
+	bool format = false;
+	for (size_t p = 0; p < fileSize;) {
+		const char *eol = (const char *)memchr(data + p, '\n', fileSize - p);
+		if (!eol) return "truncated header";
+		istringstream line(string(data + p, eol));
+		p = eol - data + 1;
+		string keyword;
+		line >> keyword;
+		if (keyword == "format") {
+			string name;
+			line >> name;
+			if (name == "ascii") return "ASCII PLY files are not supported";
+			if (name != "binary_little_endian" && name != "binary_big_endian") return "unknown format " + name;
+			bigEndian = name == "binary_big_endian";
+			format = true;
+		} else if (keyword == "element") {
+			Element e;
+			if (!(line >> e.name >> e.count)) return "malformed element";
+			elements.push_back(e);
+		} else if (keyword == "property") {
+			if (elements.empty()) return "property outside of an element";
+			Property property;
+			string type;
+			line >> type;
+			if (type == "list") {
+				string countType;
+				property.list = true;
+				if (!(line >> countType >> type) || !parseType(countType, property.countType)) return "malformed list property";
+			}
+			if (!parseType(type, property.type) || !(line >> property.name)) return "malformed property";
+			elements.back().properties.push_back(property);
+		} else if (keyword == "end_header") {
+			if (!format) return "missing format";
+			dataOffset = p;
+			for (Element &e : elements) {
+				for (Property &property : e.properties) {
+					property.offset = e.stride;
+					e.stride += size(property.type);
+					if (property.list) {
+						e.stride = 0;
+						break;
+					}
+				}
+			}
+			return "";
+		}
+	}
+	return "truncated header";
+}
+
+/** Size in bytes of the property at p, or 0 if it exceeds end. */
+size_t propertySize(const Property &property, const char *p, const char *end, bool swap) {
+	size_t n = size(property.type);
+	if (property.list) {
+		if ((size_t)(end - p) < size(property.countType)) return 0;
+		auto count = value<int64_t>(p, property.countType, swap);
+		if (count < 0 || (size_t)(end - p - size(property.countType)) / n < (size_t)count) return 0;
+		n = size(property.countType) + count * n;
+	}
+	return (size_t)(end - p) < n ? 0 : n;
+}
+
+/** Size in bytes of the element at p, or 0 if it exceeds end. */
+size_t elementSize(const Element &e, const char *p, const char *end, bool swap) {
+	const char *q = p;
+	for (const Property &property : e.properties) {
+		size_t n = propertySize(property, q, end, swap);
+		if (!n) return 0;
+		q += n;
+	}
+	return q - p;
+}
+
+/**
+ Decodes the vertices into the model: the positions, and the normals and texture coordinates if they are
+ all present. The positions are copied without conversion when they are consecutive floats in the byte order
+ of the host.
+ @return the position after the vertices, or nullptr if the file is truncated
+ */
+const char *readVertices(const Element &e, const char *p, const char *end, bool swap, OBJ::Model &model) {
+	int position[3] = {e.find({"x"}), e.find({"y"}), e.find({"z"})};
+	int normal[3] = {e.find({"nx"}), e.find({"ny"}), e.find({"nz"})};
+	int texcoord[2] = {e.find({"u", "s", "texture_u", "texture_s"}), e.find({"v", "t", "texture_v", "texture_t"})};
+	if (position[0] < 0 || position[1] < 0 || position[2] < 0 || !e.stride) return nullptr;
+	bool normals = normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0, texcoords = texcoord[0] >= 0 && texcoord[1] >= 0;
+	if ((size_t)(end - p) / e.stride < e.count) return nullptr;
+
+	model.vertices.resize(e.count);
+	if (normals) model.normals.resize(e.count);
+	if (texcoords) model.texcoords.resize(e.count);
+	const Property &x = e.properties[position[0]];
+	bool packed = !swap && x.type == Type::FLOAT32 && position[1] == position[0] + 1 && position[2] == position[0] + 2
+		&& e.properties[position[1]].type == Type::FLOAT32 && e.properties[position[2]].type == Type::FLOAT32;
+	if (packed && e.stride == sizeof(glm::vec3)) {
+		memcpy(model.vertices.data(), p, e.count * sizeof(glm::vec3));
+	} else {
+		for (size_t i = 0; i < e.count; i++) {
+			const char *v = p + i * e.stride;
+			if (packed) {
+				memcpy(&model.vertices[i], v + x.offset, sizeof(glm::vec3));
+			} else {
+				for (int d = 0; d < 3; d++) {
+					const Property &c = e.properties[position[d]];
+					model.vertices[i][d] = value<float>(v + c.offset, c.type, swap);
+				}
+			}
+		}
+	}
+	for (size_t i = 0; i < e.count && (normals || texcoords); i++) {
+		const char *v = p + i * e.stride;
+		for (int d = 0; d < 3 && normals; d++) {
+			const Property &c = e.properties[normal[d]];
+			model.normals[i][d] = value<float>(v + c.offset, c.type, swap);
+		}
+		for (int d = 0; d < 2 && texcoords; d++) {
+			const Property &c = e.properties[texcoord[d]];
+			model.texcoords[i][d] = value<float>(v + c.offset, c.type, swap);
+		}
+	}
+	return p + e.count * e.stride;
+}
+
+/**
+ Decodes the faces into the indices of the model, splitting the polygons in fans of triangles. The normals
+ and texture coordinates of the vertices share their indices.
+ @return the position after the faces, or nullptr if the file is truncated or an index is invalid
+ */
+const char *readFaces(const Element &e, const char *p, const char *end, bool swap, OBJ::Model &model) {
+	int list = e.find({"vertex_indices", "vertex_index"});
+	if (list < 0 || !e.properties[list].list) return nullptr;
+	const Property &indices = e.properties[list];
+	size_t indexSize = size(indices.type), countSize = size(indices.countType);
+	// the common layout, a face with only a list of 32-bit indices in the byte order of the host
+	bool packed = !swap && e.properties.size() == 1 && indices.countType == Type::UINT8
+		&& (indices.type == Type::INT32 || indices.type == Type::UINT32);
+	auto vertexCount = (int64_t)model.vertices.size();
+	model.vertexIndices.reserve(e.count);
+	int64_t polygon[3];
+	for (size_t f = 0; f < e.count; f++) {
+		const char *q = p;
+		for (size_t k = 0; k < e.properties.size(); k++) {
+			const Property &property = e.properties[k];
+			if ((int)k != list) {
+				size_t skip = propertySize(property, q, end, swap);
+				if (!skip) return nullptr;
+				q += skip;
+				continue;
+			}
+			if ((size_t)(end - q) < countSize) return nullptr;
+			auto n = packed ? (int64_t)(uint8_t)*q : value<int64_t>(q, indices.countType, swap);
+			q += countSize;
+			if (n < 3 || (size_t)(end - q) / indexSize < (size_t)n) return nullptr;
+			for (int64_t j = 0; j < n; j++, q += indexSize) {
+				int64_t index;
+				if (packed) {
+					int32_t v;
+					memcpy(&v, q, 4);
+					index = indices.type == Type::UINT32 ? (int64_t)(uint32_t)v : v;
+				} else {
+					index = value<int64_t>(q, indices.type, swap);
+				}
+				if (index < 0 || index >= vertexCount) return nullptr;
+				if (j < 2) {
+					polygon[j] = index;
+					continue;
+				}
+				model.vertexIndices.emplace_back((unsigned int)polygon[0], (unsigned int)polygon[1], (unsigned int)index);
+				polygon[1] = index;
+			}
+		}
+		p = q;
+	}
+	return p;
+}
+
+/**
+ Reads a binary PLY file. The vertex and face elements are required, the other elements are skipped.
+ Meshes without normals get smooth vertex normals, see OBJ::Model::smoothNormals.
+ @param pool if not null, the normals are computed in parallel
+ @return the model, whose good flag is false if the file could not be read
+ */
+OBJ::Model read(const string &filename, thread_pool *pool = nullptr) {
+	OBJ::Model model("", false);
+	MappedFile file(filename);
+	if (!file.good) return model;
+	file.sequential(0, file.size);
+	vector<Element> elements;
+	bool bigEndian = false;
+	size_t offset = 0;
+	string error = parseHeader(file.data, file.size, elements, bigEndian, offset);
+	if (!error.empty()) {
+		cerr << filename << ": " << error << endl;
+		return model;
+	}
+	bool swap = bigEndian == littleEndian();
+	const char *p = file.data + offset, *end = file.data + file.size;
+	bool vertices = false, faces = false;
+	for (const Element &e : elements) {
+		if (e.name == "vertex" && !vertices) {
+			p = readVertices(e, p, end, swap, model);
+			vertices = true;
+		} else if (e.name == "face" && vertices && !faces) {
+			p = readFaces(e, p, end, swap, model);
+			faces = true;
+		} else if (e.stride) {
+			p = (size_t)(end - p) / e.stride < e.count ? nullptr : p + e.count * e.stride;
+		} else {
+			for (size_t i = 0; i < e.count && p; i++) {
+				size_t n = elementSize(e, p, end, swap);
+				p = n ? p + n : nullptr;
+			}
+		}
+		if (!p) {
+			cerr << filename << ": invalid or truncated element " << e.name << endl;
+			return model;
+		}
+	}
+	if (!faces) {
+		cerr << filename << ": missing vertex or face element" << endl;
+		return model;
+	}
+	model.name = filesystem::path(filename).stem().string();
+	if (!model.texcoords.empty()) model.texcoordIndices = model.vertexIndices;
+	if (model.normals.empty()) {
+		model.normalIndices.resize(model.size());
+		model.smoothNormals(vector<uint8_t>(model.size(), 7), pool);
+	} else {
+		model.normalIndices = model.vertexIndices;
+	}
+	model.good = true;
+	return model;
+}
+
+/**
+ Writes a model as a binary PLY file with the given byte order: the positions and the normals of the
+ vertices, and a list of three 32-bit indices per face. The vertices are split where the triangles around
+ them do not share their normal, as PLY has a single index per vertex. Texture coordinates are not written.
+ @return whether the file could be written
+ */
+bool write(const OBJ::Model &model, const string &filename, bool bigEndian = false) {
+	// one PLY vertex per distinct pair of position and normal indices
+	vector<glm::uvec2> pairs;
+	vector<glm::uvec3> faces(model.size());
+	{
+		vector<pair<uint64_t, uint32_t>> keys(3 * model.size());
+		for (size_t i = 0; i < model.size(); i++) {
+			for (int k = 0; k < 3; k++) keys[3 * i + k] = {(uint64_t)model.vertexIndices[i][k] << 32 | model.normalIndices[i][k], (uint32_t)(3 * i + k)};
+		}
+		sort(keys.begin(), keys.end());
+		for (size_t j = 0; j < keys.size(); j++) {
+			if (j == 0 || keys[j].first != keys[j - 1].first) pairs.emplace_back(keys[j].first >> 32, keys[j].first & 0xffffffff);
+			faces[keys[j].second / 3][(int)(keys[j].second % 3)] = (unsigned int)(pairs.size() - 1);
+		}
+	}
+	ofstream file(filename, ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+	file << "ply\nformat " << (bigEndian ? "binary_big_endian" : "binary_little_endian") << " 1.0\n"
+		 << "element vertex " << pairs.size() << "\nproperty float x\nproperty float y\nproperty float z\n"
+		 << "property float nx\nproperty float ny\nproperty float nz\n"
+		 << "element face " << faces.size() << "\nproperty list uchar int vertex_indices\nend_header\n";
+	bool swap = bigEndian == littleEndian();
+	auto put = [&file, swap](const void *value, size_t n) {
+		char b[4];
+		memcpy(b, value, n);
+		if (swap) reverse(b, b + n);
+		file.write(b, (streamsize)n);
+	};
+	for (const glm::uvec2 &v : pairs) {
+		glm::vec3 position = model.compressed ? model.quantization.decode(model.quantizedVertices[v.x]) : model.vertices[v.x];
+		glm::vec3 normal = model.compressed ? Compression::decodeOctahedral(model.octahedralNormals[v.y]) : model.normals[v.y];
+		for (int d = 0; d < 3; d++) put(&position[d], 4);
+		for (int d = 0; d < 3; d++) put(&normal[d], 4);
+	}
+	for (const glm::uvec3 &f : faces) {
+		file.put(3);
+		for (int k = 0; k < 3; k++) put(&f[k], 4);
+	}
+	file.close();
+	return !file.fail();
+}
+
+} // namespace PLY
+
+#endif
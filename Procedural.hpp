@@ -0,0 +1,310 @@
+#ifndef PROCEDURAL_HPP
+#define PROCEDURAL_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+#include "glm/glm.hpp"
+#include "CPU.hpp"
+
+/**
+ Procedural textures made of typed nodes (Constant, Checker, Stripes, Noise) composed at compile time, such as
+ checker(stripes(...), noise(...), scale). The nodes are templates over the type of their lanes: a float, or a
+ vector of 4 or 8 floats (GCC and Clang vector extensions), so that the same source is evaluated one point at a
+ time by the scalar path of the renderer and 8 points at a time by ShadingBatch. compile wraps a texture into an
+ Evaluator whose batched function instantiates the whole tree of nodes, fully inlined, once per instruction set,
+ and chooses between them according to the CPU (see selectKernel). Texture functions (Material::texture) remain
+ supported as a fallback, called one hit at a time.
+ */
+namespace Procedural {
+
+/// Forces the evaluation of the nodes into the batched functions, whose instruction sets they then use
+#define PROCEDURAL_INLINE __attribute__((always_inline)) inline
+
+typedef float Float4 __attribute__((vector_size(16))); ///< 4 lanes, an SSE register
+typedef float Float8 __attribute__((vector_size(32))); ///< 8 lanes, an AVX2 register
+
+/** Integer types of the lanes of type F, with the same number of lanes. */
+template<typename F> struct Lanes;
+template<> struct Lanes<float> { typedef int32_t Int; typedef uint32_t Uint; };
+template<> struct Lanes<Float4> {
+	typedef int32_t Int __attribute__((vector_size(16)));
+	typedef uint32_t Uint __attribute__((vector_size(16)));
+};
+template<> struct Lanes<Float8> {
+	typedef int32_t Int __attribute__((vector_size(32)));
+	typedef uint32_t Uint __attribute__((vector_size(32)));
+};
+
+/** Color of the lanes, one component per member. */
+template<typename F> struct Color {
+	F r, g, b;
+};
+
+/** Value of all the lanes. */
+template<typename F> PROCEDURAL_INLINE F splat(float x) {
+	if constexpr (std::is_same_v<F, float>) return x;
+	else return F{} + x;
+}
+
+PROCEDURAL_INLINE float floor(float x) {
+	return std::floor(x);
+}
+
+/** Largest integer not above each lane, for lanes within the range of 32-bit integers. */
+template<typename F> PROCEDURAL_INLINE F floor(const F &x) {
+	F t = __builtin_convertvector(__builtin_convertvector(x, typename Lanes<F>::Int), F);
+	return t + __builtin_convertvector(t > x, F); // the comparison gives -1 where the truncation went up
+}
+
+/** Integer value of lanes holding integers. */
+template<typename F> PROCEDURAL_INLINE typename Lanes<F>::Int integer(const F &x) {
+	if constexpr (std::is_same_v<F, float>) return (int32_t)x;
+	else return __builtin_convertvector(x, typename Lanes<F>::Int);
+}
+
+/** Lanes of a where the lanes of x and y are equal, of b elsewhere. */
+template<typename F> PROCEDURAL_INLINE F select(const F &x, const F &y, const F &a, const F &b) {
+	if constexpr (std::is_same_v<F, float>) {
+		return x == y ? a : b;
+	} else {
+		typedef typename Lanes<F>::Int I;
+		I mask = x == y;
+		return (F)(((I)a & mask) | ((I)b & ~mask));
+	}
+}
+
+template<typename F> PROCEDURAL_INLINE Color<F> select(const F &x, const F &y, const Color<F> &a, const Color<F> &b) {
+	return {select(x, y, a.r, b.r), select(x, y, a.g, b.g), select(x, y, a.b, b.b)};
+}
+
+/** Pseudo-random value in [0,1) of a point of the integer lattice. */
+template<typename F> PROCEDURAL_INLINE F lattice(const F &x, const F &y, uint32_t seed) {
+	typedef typename Lanes<F>::Uint U;
+	U h = (U)integer(x) * 0x8da6b343u ^ (U)integer(y) * 0xd8163841u ^ seed;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	h *= 0x297a2d39u;
+	h ^= h >> 15;
+	if constexpr (std::is_same_v<F, float>) return (float)(h >> 8) * (1.0f / (1 << 24));
+	else return __builtin_convertvector((typename Lanes<F>::Int)(h >> 8), F) * (1.0f / (1 << 24));
+}
+
+/** Uniform color. */
+struct Constant {
+	glm::vec3 color;
+
+	template<typename F> PROCEDURAL_INLINE Color<F> operator()(const F &, const F &) const {
+		return {splat<F>(color.r), splat<F>(color.g), splat<F>(color.b)};
+	}
+};
+
+/** Checkerboard of two textures, with scale.x squares along u and scale.y along v per unit. */
+template<typename Even, typename Odd> struct Checker {
+	Even even; ///< Texture of the squares whose corner has an even sum of coordinates, such as the one at the origin
+	Odd odd;
+	glm::vec2 scale;
+
+	template<typename F> PROCEDURAL_INLINE Color<F> operator()(const F &u, const F &v) const {
+		F n = floor(u * scale.x) + floor(v * scale.y);
+		F parity = n - floor(n * 0.5f) * 2.0f;
+		return select(parity, splat<F>(0), even(u, v), odd(u, v));
+	}
+};
+
+/**
+ Parallel stripes cycling through the textures, across the direction: the stripe of a point is the integer part
+ of dot(direction, uv), so that the length of direction is the number of stripes per unit.
+ */
+template<typename... Bands> struct Stripes {
+	std::tuple<Bands...> bands;
+	glm::vec2 direction;
+
+	template<typename F> PROCEDURAL_INLINE Color<F> operator()(const F &u, const F &v) const {
+		return evaluate(u, v, std::index_sequence_for<Bands...>());
+	}
+
+private:
+	template<typename F, size_t... I> PROCEDURAL_INLINE Color<F> evaluate(const F &u, const F &v, std::index_sequence<I...>) const {
+		const float n = sizeof...(Bands);
+		F stripe = floor(u * direction.x + v * direction.y);
+		F band = stripe - floor(stripe / n) * n;
+		Color<F> c = std::get<0>(bands)(u, v);
+		((c = I == 0 ? c : select(band, splat<F>(I), std::get<I>(bands)(u, v), c)), ...);
+		return c;
+	}
+};
+
+/**
+ Fractal value noise blending two textures: the sum of octaves of bilinearly interpolated random values on
+ integer lattices, each one twice as fine and half as strong as the previous one, scaled to [0,1].
+ */
+template<typename Low, typename High> struct Noise {
+	Low low; ///< Texture where the noise is 0
+	High high; ///< Texture where the noise is 1
+	float frequency; ///< Number of cells of the first octave per unit
+	int octaves;
+	uint32_t seed;
+
+	template<typename F> PROCEDURAL_INLINE Color<F> operator()(const F &u, const F &v) const {
+		F sum = splat<F>(0);
+		float amplitude = 1, total = 0, f = frequency;
+		for (int o = 0; o < octaves; o++) {
+			sum += value(u * f, v * f, seed + o) * amplitude;
+			total += amplitude;
+			amplitude *= 0.5f;
+			f *= 2;
+		}
+		F t = sum * (1 / total);
+		Color<F> a = low(u, v), b = high(u, v);
+		return {a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t};
+	}
+
+private:
+	template<typename F> PROCEDURAL_INLINE static F value(const F &x, const F &y, uint32_t seed) {
+		F x0 = floor(x), y0 = floor(y);
+		F fx = x - x0, fy = y - y0;
+		fx = fx * fx * (3.0f - 2.0f * fx); // smoothstep, so that the noise has no visible cell edges
+		fy = fy * fy * (3.0f - 2.0f * fy);
+		F x1 = x0 + 1.0f, y1 = y0 + 1.0f;
+		F a = lattice(x0, y0, seed), b = lattice(x1, y0, seed);
+		F c = lattice(x0, y1, seed), d = lattice(x1, y1, seed);
+		F top = a + (b - a) * fx, bottom = c + (d - c) * fx;
+		return top + (bottom - top) * fy;
+	}
+};
+
+/** Node of a texture given as a node or as a color. */
+template<typename T> using Node = std::conditional_t<std::is_same_v<T, glm::vec3>, Constant, T>;
+
+template<typename T> Node<T> node(const T &t) {
+	if constexpr (std::is_same_v<T, glm::vec3>) return Constant{t};
+	else return t;
+}
+
+inline Constant constant(const glm::vec3 &color) {
+	return {color};
+}
+
+/** Checkerboard, the textures are nodes or colors. */
+template<typename Even, typename Odd> Checker<Node<Even>, Node<Odd>> checker(const Even &even, const Odd &odd, const glm::vec2 &scale) {
+	return {node(even), node(odd), scale};
+}
+
+/** Stripes across direction, the textures are nodes or colors. */
+template<typename... Bands> Stripes<Node<Bands>...> stripes(const glm::vec2 &direction, const Bands &... bands) {
+	static_assert(sizeof...(Bands) > 0, "stripes need at least one band");
+	return {std::make_tuple(node(bands)...), direction};
+}
+
+/** Fractal value noise, the textures are nodes or colors. */
+template<typename Low, typename High> Noise<Node<Low>, Node<High>> noise(const Low &low, const High &high, float frequency, int octaves = 4, uint32_t seed = 0) {
+	return {node(low), node(high), frequency, octaves, seed};
+}
+
+/** Number of points evaluated together by Evaluator::evaluate, the width of ShadingBatch */
+constexpr int lanes = 8;
+
+inline CPU::ISA isa = CPU::ISA::SCALAR; ///< Instruction set of the batched evaluations, see selectKernel
+
+/** Selects the instruction set of the batched evaluations. AVX-512 processors use the AVX2 code. */
+inline void selectKernel(CPU::ISA i) {
+	isa = i;
+}
+
+/** Procedural texture of a material, whatever the types of its nodes, see compile. */
+class Evaluator {
+public:
+	virtual ~Evaluator() = default;
+
+	/** Color at a point. */
+	virtual glm::vec3 operator()(const glm::vec2 &uv) const = 0;
+
+	/** Colors at `lanes` points, whose coordinates are in u and v. */
+	virtual void evaluate(const float *u, const float *v, float *r, float *g, float *b) const = 0;
+};
+
+template<typename Texture> void evaluateScalar(const Texture &texture, const float *u, const float *v, float *r, float *g, float *b) {
+	for (int i = 0; i < lanes; i++) {
+		Color<float> c = texture(u[i], v[i]);
+		r[i] = c.r; g[i] = c.g; b[i] = c.b;
+	}
+}
+
+/** Evaluates the points by groups of the width of F. */
+template<typename F, typename Texture> PROCEDURAL_INLINE void evaluateLanes(const Texture &texture, const float *u, const float *v, float *r, float *g, float *b) {
+	constexpr int width = sizeof(F) / sizeof(float);
+	for (int i = 0; i < lanes; i += width) {
+		F x, y;
+		memcpy(&x, u + i, sizeof(F));
+		memcpy(&y, v + i, sizeof(F));
+		Color<F> c = texture(x, y);
+		memcpy(r + i, &c.r, sizeof(F));
+		memcpy(g + i, &c.g, sizeof(F));
+		memcpy(b + i, &c.b, sizeof(F));
+	}
+}
+
+#ifdef CPU_X86
+template<typename Texture> TARGET_SSE42 void evaluateSSE42(const Texture &texture, const float *u, const float *v, float *r, float *g, float *b) {
+	evaluateLanes<Float4>(texture, u, v, r, g, b);
+}
+
+template<typename Texture> TARGET_AVX2 void evaluateAVX2(const Texture &texture, const float *u, const float *v, float *r, float *g, float *b) {
+	evaluateLanes<Float8>(texture, u, v, r, g, b);
+}
+#endif
+
+/** Evaluator of a texture of a given type, see compile. */
+template<typename Texture> class Compiled : public Evaluator {
+public:
+	explicit Compiled(const Texture &texture) : texture(texture) {}
+
+	glm::vec3 operator()(const glm::vec2 &uv) const override {
+		Color<float> c = texture(uv.x, uv.y);
+		return {c.r, c.g, c.b};
+	}
+
+	void evaluate(const float *u, const float *v, float *r, float *g, float *b) const override {
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512:
+			case CPU::ISA::AVX2: evaluateAVX2(texture, u, v, r, g, b); break;
+			case CPU::ISA::SSE42: evaluateSSE42(texture, u, v, r, g, b); break;
+#endif
+			default: evaluateScalar(texture, u, v, r, g, b);
+		}
+	}
+
+private:
+	Texture texture;
+};
+
+/**
+ Evaluator of a texture, to be referenced by Material::procedural. It must outlive the materials using it.
+ @param texture tree of nodes, such as checker(...)
+ */
+template<typename Texture> Compiled<Texture> compile(const Texture &texture) {
+	return Compiled<Texture>(texture);
+}
+
+/** Procedural version of checkerboardTexture, identical for non-negative texture coordinates. */
+inline const Evaluator *checkerboard() {
+	static const auto texture = compile(checker(glm::vec3(0.0), glm::vec3(1.0), glm::vec2(20, 40)));
+	return &texture;
+}
+
+/** Procedural version of rainbowTexture, identical for non-negative texture coordinates. */
+inline const Evaluator *rainbow() {
+	static const auto texture = compile(stripes(glm::vec2(20, 40), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1)));
+	return &texture;
+}
+
+} // namespace Procedural
+
+#endif
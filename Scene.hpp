@@ -7,6 +7,7 @@
 #include "Sphere.hpp"
 #include "Plane.hpp"
 #include "Cone.hpp"
+#include "MaterialTable.hpp"
 
 #ifndef SCENE_HPP
 #define SCENE_HPP
@@ -16,6 +17,7 @@ using namespace std;
 vector<Light *> lights; ///< A list of lights in the scene
 glm::vec3 ambient_light(0.001,0.001,0.001);
 vector<Object *> objects; ///< A list of all objects in the scene
+MaterialTable materials; ///< Materials shared by the meshes of the scene, see OBJ::Model::bindMaterials
 
 /**
  Function defining the scene
@@ -40,22 +42,26 @@ void sceneDefinition (){
 	blue_specular.reflection = 1.0f;
 
 
-	 objects.push_back(new Sphere(1.0, glm::vec3(1,-2,8), blue_specular));
-	 objects.push_back(new Sphere(0.5, glm::vec3(-1,-2.5,6), red_specular));
-	objects.push_back(new Sphere(1.0, glm::vec3(3,-2,6), green_diffuse));
+	// Spheres are grouped together so that they are intersected all at once
+	SphereSet *spheres = new SphereSet();
+	objects.push_back(spheres);
+
+	 spheres->add(new Sphere(1.0, glm::vec3(1,-2,8), blue_specular));
+	 spheres->add(new Sphere(0.5, glm::vec3(-1,-2.5,6), red_specular));
+	spheres->add(new Sphere(1.0, glm::vec3(3,-2,6), green_diffuse));
 	
 	
 	//Textured sphere
 	
 	Material textured;
 	textured.texture = &rainbowTexture;
-	// objects.push_back(new Sphere(7.0, glm::vec3(-6,4,23), textured));
+	// spheres->add(new Sphere(7.0, glm::vec3(-6,4,23), textured));
 
 
 	Material glass;
 	glass.refraction = 2.0f;
 
-	 objects.push_back(new Sphere(2.0, glm::vec3(-3, -1, 8), glass));
+	 spheres->add(new Sphere(2.0, glm::vec3(-3, -1, 8), glass));
 	
 	
 	//Planes
@@ -0,0 +1,333 @@
+#ifndef SHADING_HPP
+#define SHADING_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "glm/glm.hpp"
+#include "CPU.hpp"
+#include "MaterialTable.hpp"
+
+/**
+ Hits shaded together by the Phong model, see shade_batch. The hits are added with their material, whose fields
+ are gathered into the lanes, then for every light a kernel selected at startup according to the CPU computes the
+ direction and distance to the light and the contribution of the light for all the hits at once, before the
+ shadow rays are traced one by one for the hits which the light reaches. The hits may also have different lights,
+ such as the lights sampled for each of them from a LightTree.
+ */
+struct alignas(32) ShadingBatch{
+	static constexpr int size = 8; ///< Number of hits in a batch, the width of an AVX2 register
+	static_assert(size == Procedural::lanes, "procedural textures are evaluated for a whole batch");
+
+	float px[size], py[size], pz[size]; ///< Shaded points
+	float nx[size], ny[size], nz[size]; ///< Normal vectors at the points, facing the viewer
+	float vx[size], vy[size], vz[size]; ///< Normalized directions from the points to the viewer
+	float dr[size], dg[size], db[size]; ///< Diffuse colors, after texturing
+	float sr[size], sg[size], sb[size]; ///< Specular colors
+	float shininess[size];
+	float ar[size], ag[size], ab[size]; ///< Ambient colors
+
+	float lightX[size], lightY[size], lightZ[size]; ///< Positions of the current lights of the hits
+	float lightR[size], lightG[size], lightB[size]; ///< Colors of the current lights of the hits
+	float lx[size], ly[size], lz[size]; ///< Normalized directions to the current light
+	float r[size]; ///< Distances to the current light, at least 0.1
+	float cr[size], cg[size], cb[size]; ///< Contributions of the current light if it is not shadowed
+
+	float red[size], green[size], blue[size]; ///< Sums of the contributions of the lights which are not shadowed
+
+	float u[size], v[size]; ///< Texture coordinates
+	const Procedural::Evaluator *procedural[size]; ///< Procedural textures whose colors are still missing, see texture
+
+	int count = 0; ///< Number of hits added, the other lanes hold harmless values which are ignored
+
+	ShadingBatch(){
+		clear();
+	}
+
+	/** Removes the hits. */
+	void clear(){
+		count = 0;
+		for (int i = 0; i < size; i++) {
+			px[i] = py[i] = pz[i] = 0;
+			nx[i] = ny[i] = 0; nz[i] = 1;
+			vx[i] = vy[i] = 0; vz[i] = 1;
+			dr[i] = dg[i] = db[i] = sr[i] = sg[i] = sb[i] = shininess[i] = 0;
+			ar[i] = ag[i] = ab[i] = 0;
+			red[i] = green[i] = blue[i] = 0;
+			setLight(i, glm::vec3(0, 1, 0), glm::vec3(0.0));
+			u[i] = v[i] = 0;
+			procedural[i] = nullptr;
+		}
+	}
+
+	/**
+	 Adds a hit, the batch must not be full. The colors of procedural textures are only known after texture.
+	 @param view Normalized direction from the point to the viewer
+	 @param material index of the material of the hit in materials
+	 @param uv texture coordinates of the hit
+	 @param footprint width of the area seen by the pixel in texture coordinate units, see Texture::sample
+	 */
+	void add(const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &view,
+			 const MaterialTable &materials, uint16_t material, const glm::vec2 &uv, float footprint = 0){
+		int i = count++;
+		px[i] = point.x; py[i] = point.y; pz[i] = point.z;
+		nx[i] = normal.x; ny[i] = normal.y; nz[i] = normal.z;
+		vx[i] = view.x; vy[i] = view.y; vz[i] = view.z;
+		u[i] = uv.x; v[i] = uv.y;
+		procedural[i] = materials.texture[material] ? nullptr : materials.procedural[material];
+		if (!procedural[i]) {
+			glm::vec3 diffuse = materials.diffuseColor(material, uv, footprint);
+			dr[i] = diffuse.x; dg[i] = diffuse.y; db[i] = diffuse.z;
+		}
+		const glm::vec3 &specular = materials.specular[material];
+		sr[i] = specular.x; sg[i] = specular.y; sb[i] = specular.z;
+		shininess[i] = materials.shininess[material];
+		const glm::vec3 &ambient = materials.ambient[material];
+		ar[i] = ambient.x; ag[i] = ambient.y; ab[i] = ambient.z;
+		red[i] = green[i] = blue[i] = 0;
+	}
+
+	/**
+	 Sets the diffuse colors of the hits with a procedural texture. All the lanes are evaluated at once by the
+	 batched function of each distinct texture, and the lanes of the hits using it are kept.
+	 */
+	void texture(){
+		unsigned pending = 0;
+		for (int i = 0; i < count; i++) {
+			if (procedural[i]) pending |= 1u << i;
+		}
+		while (pending) {
+			const Procedural::Evaluator *t = procedural[__builtin_ctz(pending)];
+			alignas(32) float r[size], g[size], b[size];
+			t->evaluate(u, v, r, g, b);
+			for (int i = 0; i < count; i++) {
+				if (procedural[i] != t) continue;
+				dr[i] = r[i]; dg[i] = g[i]; db[i] = b[i];
+				procedural[i] = nullptr;
+				pending &= ~(1u << i);
+			}
+		}
+	}
+
+	/** Computes the direction, distance and contribution of a light for every lane. */
+	void light(const glm::vec3 &position, const glm::vec3 &color){
+		for (int i = 0; i < size; i++) setLight(i, position, color);
+		kernel(*this);
+	}
+
+	/** Sets the current light of a lane, which may differ between the lanes, see light(). */
+	void setLight(int i, const glm::vec3 &position, const glm::vec3 &color){
+		lightX[i] = position.x; lightY[i] = position.y; lightZ[i] = position.z;
+		lightR[i] = color.x; lightG[i] = color.y; lightB[i] = color.z;
+	}
+
+	/** Computes the direction, distance and contribution of the current light of every lane, see setLight. */
+	void light(){
+		kernel(*this);
+	}
+
+	/** Final color of a hit, with the ambient term, clamped to (0,1). */
+	[[nodiscard]] glm::vec3 color(int i, const glm::vec3 &ambient_light) const{
+		glm::vec3 c = glm::vec3(red[i], green[i], blue[i]) + ambient_light * glm::vec3(ar[i], ag[i], ab[i]);
+		return glm::clamp(c, glm::vec3(0.0), glm::vec3(1.0));
+	}
+
+	/**
+	 Selects the kernel used by light for the given instruction set. A batch is as wide as an AVX2 register, so
+	 the AVX2 kernel is also used on AVX-512 processors.
+	 */
+	static void selectKernel(CPU::ISA isa){
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512:
+			case CPU::ISA::AVX2: kernel = &lightAVX2; break;
+			case CPU::ISA::SSE42: kernel = &lightSSE42; break;
+#endif
+			default: kernel = &lightScalar;
+		}
+	}
+
+	/** Reference kernel, one hit at a time, with the same arithmetic as PhongModel. */
+	static void lightScalar(ShadingBatch &b){
+		for (int i = 0; i < size; i++) {
+			glm::vec3 position(b.lightX[i], b.lightY[i], b.lightZ[i]), color(b.lightR[i], b.lightG[i], b.lightB[i]);
+			glm::vec3 normal(b.nx[i], b.ny[i], b.nz[i]), view(b.vx[i], b.vy[i], b.vz[i]);
+			glm::vec3 d = position - glm::vec3(b.px[i], b.py[i], b.pz[i]);
+			float r = glm::length(d);
+			glm::vec3 l = d / r;
+			float NL = glm::dot(normal, l);
+			float VR = 2 * NL * glm::dot(normal, view) - glm::dot(view, l);
+			NL = glm::clamp(NL, 0.0f, 1.0f);
+			VR = glm::clamp(VR, 0.0f, 1.0f);
+			r = std::max(r, 0.1f);
+			glm::vec3 diffuse = glm::vec3(b.dr[i], b.dg[i], b.db[i]) * glm::vec3(NL);
+			glm::vec3 specular = glm::vec3(b.sr[i], b.sg[i], b.sb[i]) * glm::vec3(std::pow(VR, b.shininess[i]));
+			glm::vec3 c = color * (diffuse + specular) / r / r;
+			b.lx[i] = l.x; b.ly[i] = l.y; b.lz[i] = l.z;
+			b.r[i] = r;
+			b.cr[i] = c.x; b.cg[i] = c.y; b.cb[i] = c.z;
+		}
+	}
+
+#ifdef CPU_X86
+	/**
+	 Base 2 logarithm of positive normal numbers, to about 1e-7. The mantissa is brought into [sqrt(1/2), sqrt(2))
+	 and log2(m) = 2/ln(2) atanh((m-1)/(m+1)) is expanded to the 7th power.
+	 */
+	TARGET_SSE42 static __m128 log2SSE42(__m128 x){
+		__m128i bits = _mm_castps_si128(x);
+		__m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+		__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f800000)));
+		__m128 large = _mm_cmpge_ps(m, _mm_set1_ps(1.41421356f));
+		m = _mm_blendv_ps(m, _mm_mul_ps(m, _mm_set1_ps(0.5f)), large);
+		e = _mm_sub_epi32(e, _mm_castps_si128(large)); // the mask is -1 where m was halved
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 f = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+		__m128 f2 = _mm_mul_ps(f, f);
+		__m128 p = _mm_add_ps(_mm_mul_ps(f2, _mm_set1_ps(1.0f / 7)), _mm_set1_ps(1.0f / 5));
+		p = _mm_add_ps(_mm_mul_ps(p, f2), _mm_set1_ps(1.0f / 3));
+		p = _mm_add_ps(_mm_mul_ps(p, f2), one);
+		p = _mm_mul_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.0f / 0.69314718f));
+		return _mm_add_ps(_mm_cvtepi32_ps(e), p);
+	}
+
+	/**
+	 Base 2 exponential, to about 1e-7 relative, of numbers clamped to [-126, 127]. The fractional part f is
+	 taken in [-1/2, 1/2) around the integer part plus one half, and 2^f expanded to the 5th power.
+	 */
+	TARGET_SSE42 static __m128 exp2SSE42(__m128 x){
+		x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+		__m128 i = _mm_floor_ps(x);
+		__m128 t = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(x, i), _mm_set1_ps(0.5f)), _mm_set1_ps(0.69314718f));
+		__m128 p = _mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(1.0f / 120)), _mm_set1_ps(1.0f / 24));
+		p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.0f / 6));
+		p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.5f));
+		p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.0f));
+		p = _mm_mul_ps(p, _mm_set1_ps(1.41421356f));
+		// multiplies by 2^i by adding i to the exponent
+		return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(_mm_cvtps_epi32(i), 23)));
+	}
+
+	/** x^y for x in [0,1] and y >= 0, with pow(x, 0) = 1 like std::pow. */
+	TARGET_SSE42 static __m128 powSSE42(__m128 x, __m128 y){
+		__m128 p = _mm_and_ps(exp2SSE42(_mm_mul_ps(y, log2SSE42(x))), _mm_cmpgt_ps(x, _mm_setzero_ps()));
+		return _mm_blendv_ps(p, _mm_set1_ps(1.0f), _mm_cmpeq_ps(y, _mm_setzero_ps()));
+	}
+
+	/** SSE4.2 kernel, four hits at a time. */
+	TARGET_SSE42 static void lightSSE42(ShadingBatch &b){
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+		for (int i = 0; i < size; i += 4) {
+			__m128 dx = _mm_sub_ps(_mm_load_ps(b.lightX + i), _mm_load_ps(b.px + i));
+			__m128 dy = _mm_sub_ps(_mm_load_ps(b.lightY + i), _mm_load_ps(b.py + i));
+			__m128 dz = _mm_sub_ps(_mm_load_ps(b.lightZ + i), _mm_load_ps(b.pz + i));
+			__m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+			__m128 inv = _mm_div_ps(one, r);
+			dx = _mm_mul_ps(dx, inv);
+			dy = _mm_mul_ps(dy, inv);
+			dz = _mm_mul_ps(dz, inv);
+			__m128 Nx = _mm_load_ps(b.nx + i), Ny = _mm_load_ps(b.ny + i), Nz = _mm_load_ps(b.nz + i);
+			__m128 Vx = _mm_load_ps(b.vx + i), Vy = _mm_load_ps(b.vy + i), Vz = _mm_load_ps(b.vz + i);
+			__m128 NL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, dx), _mm_mul_ps(Ny, dy)), _mm_mul_ps(Nz, dz));
+			__m128 NV = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, Vx), _mm_mul_ps(Ny, Vy)), _mm_mul_ps(Nz, Vz));
+			__m128 VL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Vx, dx), _mm_mul_ps(Vy, dy)), _mm_mul_ps(Vz, dz));
+			__m128 VR = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(two, NL), NV), VL);
+			NL = _mm_min_ps(_mm_max_ps(NL, zero), one);
+			VR = _mm_min_ps(_mm_max_ps(VR, zero), one);
+			r = _mm_max_ps(r, _mm_set1_ps(0.1f));
+			__m128 specular = powSSE42(VR, _mm_load_ps(b.shininess + i));
+			__m128 attenuation = _mm_div_ps(one, _mm_mul_ps(r, r));
+			__m128 cr = _mm_add_ps(_mm_mul_ps(_mm_load_ps(b.dr + i), NL), _mm_mul_ps(_mm_load_ps(b.sr + i), specular));
+			__m128 cg = _mm_add_ps(_mm_mul_ps(_mm_load_ps(b.dg + i), NL), _mm_mul_ps(_mm_load_ps(b.sg + i), specular));
+			__m128 cb = _mm_add_ps(_mm_mul_ps(_mm_load_ps(b.db + i), NL), _mm_mul_ps(_mm_load_ps(b.sb + i), specular));
+			_mm_store_ps(b.lx + i, dx);
+			_mm_store_ps(b.ly + i, dy);
+			_mm_store_ps(b.lz + i, dz);
+			_mm_store_ps(b.r + i, r);
+			_mm_store_ps(b.cr + i, _mm_mul_ps(cr, _mm_mul_ps(_mm_load_ps(b.lightR + i), attenuation)));
+			_mm_store_ps(b.cg + i, _mm_mul_ps(cg, _mm_mul_ps(_mm_load_ps(b.lightG + i), attenuation)));
+			_mm_store_ps(b.cb + i, _mm_mul_ps(cb, _mm_mul_ps(_mm_load_ps(b.lightB + i), attenuation)));
+		}
+	}
+
+	/** Base 2 logarithm of positive normal numbers, see log2SSE42. */
+	TARGET_AVX2 static __m256 log2AVX2(__m256 x){
+		__m256i bits = _mm256_castps_si256(x);
+		__m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+		__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000)));
+		__m256 large = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GE_OQ);
+		m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), large);
+		e = _mm256_sub_epi32(e, _mm256_castps_si256(large)); // the mask is -1 where m was halved
+		__m256 one = _mm256_set1_ps(1.0f);
+		__m256 f = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+		__m256 f2 = _mm256_mul_ps(f, f);
+		__m256 p = _mm256_fmadd_ps(f2, _mm256_set1_ps(1.0f / 7), _mm256_set1_ps(1.0f / 5));
+		p = _mm256_fmadd_ps(p, f2, _mm256_set1_ps(1.0f / 3));
+		p = _mm256_fmadd_ps(p, f2, one);
+		p = _mm256_mul_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(2.0f / 0.69314718f));
+		return _mm256_add_ps(_mm256_cvtepi32_ps(e), p);
+	}
+
+	/** Base 2 exponential of numbers clamped to [-126, 127], see exp2SSE42. */
+	TARGET_AVX2 static __m256 exp2AVX2(__m256 x){
+		x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(127.0f));
+		__m256 i = _mm256_floor_ps(x);
+		__m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(x, i), _mm256_set1_ps(0.5f)), _mm256_set1_ps(0.69314718f));
+		__m256 p = _mm256_fmadd_ps(t, _mm256_set1_ps(1.0f / 120), _mm256_set1_ps(1.0f / 24));
+		p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.0f / 6));
+		p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(0.5f));
+		p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.0f));
+		p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(1.0f));
+		p = _mm256_mul_ps(p, _mm256_set1_ps(1.41421356f));
+		return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), _mm256_slli_epi32(_mm256_cvtps_epi32(i), 23)));
+	}
+
+	/** x^y for x in [0,1] and y >= 0, with pow(x, 0) = 1 like std::pow. */
+	TARGET_AVX2 static __m256 powAVX2(__m256 x, __m256 y){
+		__m256 p = _mm256_and_ps(exp2AVX2(_mm256_mul_ps(y, log2AVX2(x))), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ));
+		return _mm256_blendv_ps(p, _mm256_set1_ps(1.0f), _mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_EQ_OQ));
+	}
+
+	/** AVX2 kernel, the eight hits at a time. */
+	TARGET_AVX2 static void lightAVX2(ShadingBatch &b){
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+		__m256 dx = _mm256_sub_ps(_mm256_load_ps(b.lightX), _mm256_load_ps(b.px));
+		__m256 dy = _mm256_sub_ps(_mm256_load_ps(b.lightY), _mm256_load_ps(b.py));
+		__m256 dz = _mm256_sub_ps(_mm256_load_ps(b.lightZ), _mm256_load_ps(b.pz));
+		__m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+		__m256 inv = _mm256_div_ps(one, r);
+		dx = _mm256_mul_ps(dx, inv);
+		dy = _mm256_mul_ps(dy, inv);
+		dz = _mm256_mul_ps(dz, inv);
+		__m256 Nx = _mm256_load_ps(b.nx), Ny = _mm256_load_ps(b.ny), Nz = _mm256_load_ps(b.nz);
+		__m256 Vx = _mm256_load_ps(b.vx), Vy = _mm256_load_ps(b.vy), Vz = _mm256_load_ps(b.vz);
+		__m256 NL = _mm256_fmadd_ps(Nx, dx, _mm256_fmadd_ps(Ny, dy, _mm256_mul_ps(Nz, dz)));
+		__m256 NV = _mm256_fmadd_ps(Nx, Vx, _mm256_fmadd_ps(Ny, Vy, _mm256_mul_ps(Nz, Vz)));
+		__m256 VL = _mm256_fmadd_ps(Vx, dx, _mm256_fmadd_ps(Vy, dy, _mm256_mul_ps(Vz, dz)));
+		__m256 VR = _mm256_fmsub_ps(_mm256_add_ps(NL, NL), NV, VL);
+		NL = _mm256_min_ps(_mm256_max_ps(NL, zero), one);
+		VR = _mm256_min_ps(_mm256_max_ps(VR, zero), one);
+		r = _mm256_max_ps(r, _mm256_set1_ps(0.1f));
+		__m256 specular = powAVX2(VR, _mm256_load_ps(b.shininess));
+		__m256 attenuation = _mm256_div_ps(one, _mm256_mul_ps(r, r));
+		__m256 cr = _mm256_fmadd_ps(_mm256_load_ps(b.dr), NL, _mm256_mul_ps(_mm256_load_ps(b.sr), specular));
+		__m256 cg = _mm256_fmadd_ps(_mm256_load_ps(b.dg), NL, _mm256_mul_ps(_mm256_load_ps(b.sg), specular));
+		__m256 cb = _mm256_fmadd_ps(_mm256_load_ps(b.db), NL, _mm256_mul_ps(_mm256_load_ps(b.sb), specular));
+		_mm256_store_ps(b.lx, dx);
+		_mm256_store_ps(b.ly, dy);
+		_mm256_store_ps(b.lz, dz);
+		_mm256_store_ps(b.r, r);
+		_mm256_store_ps(b.cr, _mm256_mul_ps(cr, _mm256_mul_ps(_mm256_load_ps(b.lightR), attenuation)));
+		_mm256_store_ps(b.cg, _mm256_mul_ps(cg, _mm256_mul_ps(_mm256_load_ps(b.lightG), attenuation)));
+		_mm256_store_ps(b.cb, _mm256_mul_ps(cb, _mm256_mul_ps(_mm256_load_ps(b.lightB), attenuation)));
+	}
+#endif
+
+	/** Signature of the kernels, see light */
+	typedef void (*Kernel)(ShadingBatch &batch);
+	static inline Kernel kernel = &lightScalar; ///< Kernel used by light, see selectKernel
+};
+
+#endif
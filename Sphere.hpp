@@ -1,4 +1,8 @@
+#include <vector>
+#include <algorithm>
+
 #include "glm/glm.hpp"
+#include "CPU.hpp"
 #include "Object.hpp"
 #include "Hit.hpp"
 
@@ -65,6 +69,193 @@ public:
 		}
 		return hit;
     }
+
+	glm::vec3 getCenter() const {
+		return center;
+	}
+	float getRadius() const {
+		return radius;
+	}
+};
+
+/**
+ Group of spheres intersected all at once. The centers and radii are stored in structure-of-arrays form and
+ tested by a kernel selected at startup according to the CPU; the hit is then computed by the nearest sphere.
+ */
+class SphereSet : public Object{
+private:
+	static const int padding = 16; ///< The arrays are padded to a multiple of the widest kernel
+	vector<Sphere *> spheres; ///< The spheres of the set
+	vector<float> cx, cy, cz; ///< Centers of the spheres
+	vector<float> r2; ///< Squared radii of the spheres, negative in the padding so that it is never hit
+
+public:
+	/** Adds a sphere to the set. */
+	void add(Sphere *sphere){
+		size_t i = spheres.size();
+		spheres.push_back(sphere);
+		if (i % padding == 0) {
+			for (auto v : {&cx, &cy, &cz}) v->resize(i + padding, 0.0f);
+			r2.resize(i + padding, -1.0f);
+		}
+		cx[i] = sphere->getCenter().x;
+		cy[i] = sphere->getCenter().y;
+		cz[i] = sphere->getCenter().z;
+		r2[i] = sphere->getRadius() * sphere->getRadius();
+	}
+
+	void registerMaterials(MaterialTable &table) override {
+		for (auto sphere : spheres) sphere->registerMaterials(table);
+	}
+
+	Hit intersect(const Ray &ray) override {
+		float t;
+		int i = kernel(*this, ray, t);
+		if (i < 0) return Hit();
+		return spheres[i]->intersect(ray);
+	}
+
+	/** Selects the kernel used by intersect for the given instruction set. */
+	static void selectKernel(CPU::ISA isa){
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512: kernel = &intersectAVX512; break;
+			case CPU::ISA::AVX2: kernel = &intersectAVX2; break;
+			case CPU::ISA::SSE42: kernel = &intersectSSE42; break;
+#endif
+			default: kernel = &intersectScalar;
+		}
+	}
+
+	/**
+	 Reference kernel, one sphere at a time, with the same conventions as Sphere::intersect: the ray may start inside a sphere.
+	 @param t distance of the nearest hit
+	 @return the index of the nearest sphere hit, or -1
+	 */
+	static int intersectScalar(const SphereSet &set, const Ray &ray, float &t){
+		int nearest = -1;
+		t = FLOAT_INFINITY;
+		for (size_t i = 0; i < set.spheres.size(); i++) {
+			glm::vec3 c = glm::vec3(set.cx[i], set.cy[i], set.cz[i]) - ray.origin;
+			float cdotd = glm::dot(c, ray.direction);
+			float h = set.r2[i] - std::max(glm::dot(c, c) - cdotd * cdotd, 0.0f);
+			if (h < 0) continue;
+			float sq = sqrt(h);
+			float ti = cdotd - sq < 0 ? cdotd + sq : cdotd - sq;
+			if (ti >= 0 && ti < t) {
+				t = ti;
+				nearest = i;
+			}
+		}
+		return nearest;
+	}
+
+#ifdef CPU_X86
+	/** SSE4.2 kernel, four spheres at a time. */
+	TARGET_SSE42 static int intersectSSE42(const SphereSet &set, const Ray &ray, float &t){
+		const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+		const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+		const __m128 zero = _mm_setzero_ps();
+		__m128 bestT = _mm_set1_ps(FLOAT_INFINITY), bestI = _mm_set1_ps(-1);
+		__m128 index = _mm_setr_ps(0, 1, 2, 3);
+		for (size_t i = 0; i < set.spheres.size(); i += 4, index = _mm_add_ps(index, _mm_set1_ps(4))) {
+			__m128 x = _mm_sub_ps(_mm_loadu_ps(&set.cx[i]), ox);
+			__m128 y = _mm_sub_ps(_mm_loadu_ps(&set.cy[i]), oy);
+			__m128 z = _mm_sub_ps(_mm_loadu_ps(&set.cz[i]), oz);
+			__m128 cdotd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, dx), _mm_mul_ps(y, dy)), _mm_mul_ps(z, dz));
+			__m128 cdotc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+			__m128 h = _mm_sub_ps(_mm_loadu_ps(&set.r2[i]), _mm_max_ps(_mm_sub_ps(cdotc, _mm_mul_ps(cdotd, cdotd)), zero));
+			__m128 sq = _mm_sqrt_ps(_mm_max_ps(h, zero));
+			__m128 t1 = _mm_sub_ps(cdotd, sq);
+			__m128 ti = _mm_blendv_ps(t1, _mm_add_ps(cdotd, sq), _mm_cmplt_ps(t1, zero));
+			__m128 mask = _mm_and_ps(_mm_cmpge_ps(h, zero), _mm_and_ps(_mm_cmpge_ps(ti, zero), _mm_cmplt_ps(ti, bestT)));
+			bestT = _mm_blendv_ps(bestT, ti, mask);
+			bestI = _mm_blendv_ps(bestI, index, mask);
+		}
+		alignas(16) float ts[4], is[4];
+		_mm_store_ps(ts, bestT);
+		_mm_store_ps(is, bestI);
+		return nearestLane(ts, is, 4, t);
+	}
+
+	/** AVX2 kernel, eight spheres at a time. */
+	TARGET_AVX2 static int intersectAVX2(const SphereSet &set, const Ray &ray, float &t){
+		const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+		const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 bestT = _mm256_set1_ps(FLOAT_INFINITY), bestI = _mm256_set1_ps(-1);
+		__m256 index = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+		for (size_t i = 0; i < set.spheres.size(); i += 8, index = _mm256_add_ps(index, _mm256_set1_ps(8))) {
+			__m256 x = _mm256_sub_ps(_mm256_loadu_ps(&set.cx[i]), ox);
+			__m256 y = _mm256_sub_ps(_mm256_loadu_ps(&set.cy[i]), oy);
+			__m256 z = _mm256_sub_ps(_mm256_loadu_ps(&set.cz[i]), oz);
+			__m256 cdotd = _mm256_fmadd_ps(x, dx, _mm256_fmadd_ps(y, dy, _mm256_mul_ps(z, dz)));
+			__m256 cdotc = _mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, _mm256_mul_ps(z, z)));
+			__m256 h = _mm256_sub_ps(_mm256_loadu_ps(&set.r2[i]), _mm256_max_ps(_mm256_fnmadd_ps(cdotd, cdotd, cdotc), zero));
+			__m256 sq = _mm256_sqrt_ps(_mm256_max_ps(h, zero));
+			__m256 t1 = _mm256_sub_ps(cdotd, sq);
+			__m256 ti = _mm256_blendv_ps(t1, _mm256_add_ps(cdotd, sq), _mm256_cmp_ps(t1, zero, _CMP_LT_OQ));
+			__m256 mask = _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_GE_OQ),
+			                            _mm256_and_ps(_mm256_cmp_ps(ti, zero, _CMP_GE_OQ), _mm256_cmp_ps(ti, bestT, _CMP_LT_OQ)));
+			bestT = _mm256_blendv_ps(bestT, ti, mask);
+			bestI = _mm256_blendv_ps(bestI, index, mask);
+		}
+		alignas(32) float ts[8], is[8];
+		_mm256_store_ps(ts, bestT);
+		_mm256_store_ps(is, bestI);
+		return nearestLane(ts, is, 8, t);
+	}
+
+	/** AVX-512 kernel, sixteen spheres at a time. */
+	TARGET_AVX512 static int intersectAVX512(const SphereSet &set, const Ray &ray, float &t){
+		const __m512 ox = _mm512_set1_ps(ray.origin.x), oy = _mm512_set1_ps(ray.origin.y), oz = _mm512_set1_ps(ray.origin.z);
+		const __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+		const __m512 zero = _mm512_setzero_ps();
+		// the masked forms of max and sqrt, with every lane, as GCC warns that the others read an undefined register
+		const __mmask16 all = 0xffff;
+		__m512 bestT = _mm512_set1_ps(FLOAT_INFINITY), bestI = _mm512_set1_ps(-1);
+		__m512 index = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		for (size_t i = 0; i < set.spheres.size(); i += 16, index = _mm512_add_ps(index, _mm512_set1_ps(16))) {
+			__m512 x = _mm512_sub_ps(_mm512_loadu_ps(&set.cx[i]), ox);
+			__m512 y = _mm512_sub_ps(_mm512_loadu_ps(&set.cy[i]), oy);
+			__m512 z = _mm512_sub_ps(_mm512_loadu_ps(&set.cz[i]), oz);
+			__m512 cdotd = _mm512_fmadd_ps(x, dx, _mm512_fmadd_ps(y, dy, _mm512_mul_ps(z, dz)));
+			__m512 cdotc = _mm512_fmadd_ps(x, x, _mm512_fmadd_ps(y, y, _mm512_mul_ps(z, z)));
+			__m512 h = _mm512_sub_ps(_mm512_loadu_ps(&set.r2[i]), _mm512_maskz_max_ps(all, _mm512_fnmadd_ps(cdotd, cdotd, cdotc), zero));
+			__mmask16 mask = _mm512_cmp_ps_mask(h, zero, _CMP_GE_OQ);
+			if (mask == 0) continue;
+			__m512 sq = _mm512_maskz_sqrt_ps(all, _mm512_maskz_max_ps(all, h, zero));
+			__m512 t1 = _mm512_sub_ps(cdotd, sq);
+			__m512 ti = _mm512_mask_add_ps(t1, _mm512_cmp_ps_mask(t1, zero, _CMP_LT_OQ), cdotd, sq);
+			mask = _mm512_mask_cmp_ps_mask(mask, ti, zero, _CMP_GE_OQ);
+			mask = _mm512_mask_cmp_ps_mask(mask, ti, bestT, _CMP_LT_OQ);
+			bestT = _mm512_mask_blend_ps(mask, bestT, ti);
+			bestI = _mm512_mask_blend_ps(mask, bestI, index);
+		}
+		alignas(64) float ts[16], is[16];
+		_mm512_store_ps(ts, bestT);
+		_mm512_store_ps(is, bestI);
+		return nearestLane(ts, is, 16, t);
+	}
+#endif
+
+	/** Signature of the kernels, see intersectScalar */
+	typedef int (*Kernel)(const SphereSet &set, const Ray &ray, float &t);
+	static inline Kernel kernel = &intersectScalar; ///< Kernel used by intersect, see selectKernel
+
+private:
+	/** Reduces the nearest hits of the lanes of a kernel to the nearest hit overall. */
+	static int nearestLane(const float *ts, const float *is, int lanes, float &t){
+		int nearest = -1;
+		t = FLOAT_INFINITY;
+		for (int l = 0; l < lanes; l++) {
+			if (is[l] >= 0 && ts[l] < t) {
+				t = ts[l];
+				nearest = (int)is[l];
+			}
+		}
+		return nearest;
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,476 @@
+#ifndef TEXTURE_HPP
+#define TEXTURE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+
+#include "glm/glm.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+
+/**
+ Tiles of the image textures kept in memory. The tiles are paged in from the tiled files of the textures when
+ they are sampled, and the least recently used ones are evicted to stay under a memory budget, so that textures
+ larger than the memory can be sampled. The cache is shared by the textures of a scene and is safe to use from
+ several threads.
+ */
+class TextureCache {
+public:
+	static constexpr uint32_t tileSize = 32; ///< Width and height of a tile in texels
+
+	/** A square of tileSize x tileSize texels, row by row, 4 bytes (RGBA) per texel: one page of memory. */
+	struct Tile {
+		uint8_t texels[tileSize * tileSize * 4];
+	};
+
+	/** Statistics of the residency of the tiles since the cache was created. */
+	struct Statistics {
+		size_t loads = 0; ///< Number of tiles paged in
+		size_t evictions = 0; ///< Number of tiles evicted to stay under the budget
+		size_t residentBytes = 0; ///< Memory used by the resident tiles
+		size_t peakBytes = 0; ///< Largest value of residentBytes
+	};
+
+	size_t budget; ///< Number of bytes the resident tiles may use; the last tile used is always kept
+
+	explicit TextureCache(size_t budget = size_t(256) << 20) : budget(budget) {}
+
+	TextureCache(const TextureCache &) = delete;
+	TextureCache &operator=(const TextureCache &) = delete;
+
+	/** Identifier of a new texture, which distinguishes its tiles from the tiles of the other textures. */
+	uint32_t registerTexture() {
+		lock_guard<mutex> lock(residency);
+		return textures++;
+	}
+
+	/**
+	 Returns a tile, paging it in with load if needed, and marks it as the most recently used. The tile is loaded
+	 without holding the lock, so two threads may load the same tile, in which case one copy is dropped. The
+	 returned pointer keeps the tile alive even if it is evicted meanwhile.
+	 @param texture identifier of the texture, see registerTexture
+	 @param tile index of the tile in the texture
+	 @param load function filling a Tile
+	 */
+	template<typename Load>
+	shared_ptr<const Tile> acquire(uint32_t texture, uint64_t tile, Load load) {
+		uint64_t key = (uint64_t)texture << 40 | tile;
+		{
+			lock_guard<mutex> lock(residency);
+			auto it = resident.find(key);
+			if (it != resident.end()) {
+				lru.splice(lru.begin(), lru, it->second.second);
+				return it->second.first;
+			}
+		}
+		auto loaded = make_shared<Tile>();
+		load(*loaded);
+		shared_ptr<const Tile> result = loaded;
+		lock_guard<mutex> lock(residency);
+		auto it = resident.find(key);
+		if (it != resident.end()) return it->second.first;
+		lru.push_front(key);
+		resident.emplace(key, make_pair(result, lru.begin()));
+		stats.loads++;
+		stats.residentBytes += bytesPerTile;
+		while (stats.residentBytes > budget && lru.size() > 1) {
+			resident.erase(lru.back());
+			lru.pop_back();
+			stats.residentBytes -= bytesPerTile;
+			stats.evictions++;
+		}
+		stats.peakBytes = std::max(stats.peakBytes, stats.residentBytes);
+		return result;
+	}
+
+	[[nodiscard]] Statistics statistics() const {
+		lock_guard<mutex> lock(residency);
+		return stats;
+	}
+
+private:
+	static constexpr size_t bytesPerTile = sizeof(Tile) + 64; ///< A tile with its bookkeeping
+
+	mutable mutex residency; ///< Protects the members below
+	unordered_map<uint64_t, pair<shared_ptr<const Tile>, list<uint64_t>::iterator>> resident; ///< Resident tiles by key
+	list<uint64_t> lru; ///< Keys of the resident tiles, from the most to the least recently used
+	uint32_t textures = 0;
+	Statistics stats;
+};
+
+/**
+ Image texture sampled through a TextureCache. The image (a binary or ASCII PPM or PGM file) is converted once into
+ a tiled file next to it (see write), which holds its mip pyramid, each level halving the size of the previous one
+ down to one texel and stored as tiles of TextureCache::tileSize texels, so that the texels read by a lookup are
+ close in memory. The texture coordinates repeat, v = 0 is the bottom of the image, and the 8-bit values are
+ used as they are, divided by 255. Lookups are filtered bilinearly in one level, or trilinearly between the two
+ levels matching the footprint of the pixel on the texture.
+
+ File layout (native endianness): a Header, the levels (Level), then the tiles of all the levels from the first
+ page boundary on, tile by tile.
+ */
+class Texture {
+public:
+	struct Header {
+		char magic[8]; ///< "CGCTEX" followed by two null bytes
+		uint32_t version;
+		uint32_t width, height, levelCount;
+		uint64_t sourceSize; ///< Size in bytes of the image file
+		int64_t sourceTime; ///< Modification time of the image file, in the units of the file clock
+	};
+
+	struct Level {
+		uint32_t width, height; ///< Size in texels
+		uint32_t tilesX, tilesY; ///< Number of tiles across and down
+		uint64_t firstTile; ///< Index of its first tile in the file
+	};
+
+	enum class Filter {
+		BILINEAR, ///< Always samples the first level
+		TRILINEAR ///< Samples the two levels around the footprint of the lookup
+	};
+
+	static const uint32_t version = 1;
+
+	bool good = false;
+	Filter filter = Filter::TRILINEAR;
+
+	/** Path of the tiled file of an image. */
+	static string path(const string &image) {
+		return image + ".tiles";
+	}
+
+	/**
+	 Opens the texture of an image, converting the image first if its tiled file is missing or older.
+	 @param cache the cache of the tiles, which must outlive the texture
+	 */
+	Texture(const string &image, TextureCache &cache) : name(image), cache(cache) {
+		id = cache.registerTexture();
+		string tiled = path(image);
+		if (!current(image, tiled) && !write(image, tiled)) return;
+		file = make_unique<MappedFile>(tiled);
+		if (!file->good || file->size < sizeof(Header)) return;
+		memcpy(&header, file->data, sizeof(Header));
+		if (memcmp(header.magic, "CGCTEX\0\0", 8) != 0 || header.version != version || header.levelCount == 0
+			|| sizeof(Header) + header.levelCount * sizeof(Level) > file->size) {
+			cerr << "Invalid texture file " << tiled << endl;
+			return;
+		}
+		levels.resize(header.levelCount);
+		memcpy(levels.data(), file->data + sizeof(Header), levels.size() * sizeof(Level));
+		if (!valid(file->size)) {
+			cerr << "Corrupted texture file " << tiled << endl;
+			return;
+		}
+		good = true;
+	}
+
+	Texture(const Texture &) = delete;
+	Texture &operator=(const Texture &) = delete;
+
+	[[nodiscard]] uint32_t width() const {
+		return header.width;
+	}
+
+	[[nodiscard]] uint32_t height() const {
+		return header.height;
+	}
+
+	/** Number of levels of the mip pyramid. */
+	[[nodiscard]] size_t levelCount() const {
+		return levels.size();
+	}
+
+	/**
+	 Filtered color of the texture.
+	 @param uv texture coordinates
+	 @param footprint width of the area seen by the pixel, in texture coordinate units, 0 for the finest level
+	 */
+	[[nodiscard]] glm::vec3 sample(const glm::vec2 &uv, float footprint) const {
+		if (!good) return glm::vec3(1.0f, 0.0f, 1.0f);
+		float lod = 0;
+		if (filter == Filter::TRILINEAR && footprint > 0) {
+			lod = glm::clamp(std::log2(footprint * (float)std::max(header.width, header.height)), 0.0f, (float)(levels.size() - 1));
+		}
+		int level = (int)lod;
+		float f = lod - (float)level;
+		glm::vec3 c = bilinear(level, uv);
+		if (f > 0) c = glm::mix(c, bilinear(level + 1, uv), f);
+		return c;
+	}
+
+	/** Bilinearly filtered color of the texture in one level of the pyramid. */
+	[[nodiscard]] glm::vec3 bilinear(int level, const glm::vec2 &uv) const {
+		const Level &l = levels[level];
+		float x = (uv.x - std::floor(uv.x)) * (float)l.width - 0.5f;
+		float y = (1 - (uv.y - std::floor(uv.y))) * (float)l.height - 0.5f;
+		float fx = std::floor(x), fy = std::floor(y);
+		int x0 = (int)fx, y0 = (int)fy;
+		float tx = x - fx, ty = y - fy;
+		// the four texels usually lie in the same tile, which is then acquired once
+		TileRef ref;
+		glm::vec3 c00 = texel(level, x0, y0, ref), c10 = texel(level, x0 + 1, y0, ref);
+		glm::vec3 c01 = texel(level, x0, y0 + 1, ref), c11 = texel(level, x0 + 1, y0 + 1, ref);
+		return glm::mix(glm::mix(c00, c10, tx), glm::mix(c01, c11, tx), ty);
+	}
+
+	/**
+	 Converts an image into a tiled file with its mip pyramid. The first level is read straight from the memory
+	 mapped image when it is binary, so that only the second level, a quarter of the image, is held in memory.
+	 The file is written under a temporary name and then renamed, so that a concurrent reader never sees a
+	 partial file.
+	 @return whether the image could be read and the file written
+	 */
+	static bool write(const string &image, const string &tiled) {
+		MappedFile source(image);
+		if (!source.good) return false;
+		Image img;
+		if (!parse(source, img)) {
+			cerr << "Unsupported image " << image << ", only PPM and PGM files can be used as textures" << endl;
+			return false;
+		}
+
+		vector<Level> levels;
+		uint32_t w = img.width, h = img.height;
+		uint64_t tiles = 0;
+		while (true) {
+			Level l{w, h, (w + TextureCache::tileSize - 1) / TextureCache::tileSize, (h + TextureCache::tileSize - 1) / TextureCache::tileSize, tiles};
+			levels.push_back(l);
+			tiles += (uint64_t)l.tilesX * l.tilesY;
+			if (w == 1 && h == 1) break;
+			w = std::max(w / 2, 1u);
+			h = std::max(h / 2, 1u);
+		}
+
+		string temporary = tiled + ".tmp";
+		ofstream file(temporary, ios::binary | ios::trunc);
+		if (!file.is_open()) {
+			cerr << "Could not write file " << tiled << endl;
+			return false;
+		}
+		Header header{};
+		memcpy(header.magic, "CGCTEX\0\0", 8);
+		header.version = version;
+		header.width = img.width;
+		header.height = img.height;
+		header.levelCount = (uint32_t)levels.size();
+		error_code ec;
+		header.sourceSize = source.size;
+		header.sourceTime = (int64_t)filesystem::last_write_time(image, ec).time_since_epoch().count();
+		file.write((const char *)&header, sizeof(Header));
+		file.write((const char *)levels.data(), levels.size() * sizeof(Level));
+		file.write(vector<char>(dataOffset(levels.size()) - sizeof(Header) - levels.size() * sizeof(Level), 0).data(),
+				   (streamsize)(dataOffset(levels.size()) - sizeof(Header) - levels.size() * sizeof(Level)));
+
+		// each level is a 2x2 box filter of the previous one, whose last row and column are dropped when odd
+		writeLevel(file, levels[0], [&img](uint32_t x, uint32_t y) { return img.texel(x, y); });
+		vector<glm::u8vec4> previous, current;
+		for (size_t k = 1; k < levels.size(); k++) {
+			const Level &l = levels[k], &p = levels[k - 1];
+			current.resize((size_t)l.width * l.height);
+			for (uint32_t y = 0; y < l.height; y++) {
+				for (uint32_t x = 0; x < l.width; x++) {
+					glm::uvec4 sum(0);
+					for (uint32_t dy = 0; dy < 2; dy++) {
+						for (uint32_t dx = 0; dx < 2; dx++) {
+							uint32_t sx = std::min(2 * x + dx, p.width - 1), sy = std::min(2 * y + dy, p.height - 1);
+							sum += glm::uvec4(k == 1 ? img.texel(sx, sy) : previous[(size_t)sy * p.width + sx]);
+						}
+					}
+					current[(size_t)y * l.width + x] = glm::u8vec4((sum + glm::uvec4(2)) / 4u);
+				}
+			}
+			writeLevel(file, l, [&current, &l](uint32_t x, uint32_t y) { return current[(size_t)y * l.width + x]; });
+			swap(previous, current);
+		}
+		file.close();
+		if (!file.good()) {
+			cerr << "Could not write file " << tiled << endl;
+			filesystem::remove(temporary, ec);
+			return false;
+		}
+		filesystem::rename(temporary, tiled, ec);
+		return !ec;
+	}
+
+	/** Statistics of the tiles of the cache of the texture, which may be shared by other textures. */
+	[[nodiscard]] TextureCache::Statistics statistics() const {
+		return cache.statistics();
+	}
+
+	[[nodiscard]] string toString() const {
+		stringstream ss;
+		ss << "Texture (" << name << "): " << header.width << "x" << header.height << ", " << levels.size() << " levels";
+		return ss.str();
+	}
+
+	friend ostream& operator<<(ostream& os, const Texture& texture) {
+		os << texture.toString();
+		return os;
+	}
+
+private:
+	/** Tile acquired by the last lookup of a filter, which is reused while the texels fall into it. */
+	struct TileRef {
+		uint64_t index = UINT64_MAX;
+		shared_ptr<const TextureCache::Tile> tile;
+	};
+
+	/** Image being converted, read from its mapped file or from its parsed values for the ASCII formats. */
+	struct Image {
+		uint32_t width = 0, height = 0, channels = 3, maxValue = 255;
+		const uint8_t *binary = nullptr; ///< Values of the binary formats, big-endian when 2 bytes wide
+		vector<uint16_t> values; ///< Values of the ASCII formats
+
+		[[nodiscard]] uint32_t value(size_t i) const {
+			if (!binary) return values[i];
+			return maxValue < 256 ? binary[i] : (uint32_t)binary[2 * i] << 8 | binary[2 * i + 1];
+		}
+
+		[[nodiscard]] glm::u8vec4 texel(uint32_t x, uint32_t y) const {
+			size_t i = ((size_t)y * width + x) * channels;
+			glm::u8vec4 t(255);
+			for (uint32_t c = 0; c < 3; c++) t[c] = (uint8_t)((value(i + (channels == 3 ? c : 0)) * 255 + maxValue / 2) / maxValue);
+			return t;
+		}
+	};
+
+	string name;
+	TextureCache &cache;
+	uint32_t id = 0;
+	unique_ptr<MappedFile> file;
+	Header header{};
+	vector<Level> levels;
+
+	/** Offset of the first tile, at the first page boundary after the header and the levels. */
+	static size_t dataOffset(size_t levelCount) {
+		size_t end = sizeof(Header) + levelCount * sizeof(Level);
+		return (end + sizeof(TextureCache::Tile) - 1) / sizeof(TextureCache::Tile) * sizeof(TextureCache::Tile);
+	}
+
+	/**
+	 Whether the levels read from the header are consistent and their tiles lie within a file of the given size:
+	 the sizes of the levels follow the pyramid of the image, with the matching numbers of tiles, so that no
+	 lookup can read outside the file.
+	 */
+	[[nodiscard]] bool valid(size_t size) const {
+		const uint64_t n = TextureCache::tileSize;
+		size_t offset = dataOffset(levels.size());
+		if (header.width == 0 || header.height == 0 || offset > size) return false;
+		uint64_t tiles = (size - offset) / sizeof(TextureCache::Tile);
+		uint32_t width = header.width, height = header.height;
+		for (const Level &l : levels) {
+			if (l.width != width || l.height != height || l.tilesX != (width + n - 1) / n || l.tilesY != (height + n - 1) / n
+				|| l.firstTile > tiles || (uint64_t)l.tilesX * l.tilesY > tiles - l.firstTile) return false;
+			width = std::max(width / 2, 1u);
+			height = std::max(height / 2, 1u);
+		}
+		return true;
+	}
+
+	/** Whether the tiled file exists and was converted from the current version of the image. */
+	static bool current(const string &image, const string &tiled) {
+		ifstream file(tiled, ios::binary);
+		Header header{};
+		if (!file.read((char *)&header, sizeof(Header))) return false;
+		error_code ec;
+		uint64_t size = filesystem::file_size(image, ec);
+		if (ec) return false;
+		auto time = (int64_t)filesystem::last_write_time(image, ec).time_since_epoch().count();
+		return !ec && memcmp(header.magic, "CGCTEX\0\0", 8) == 0 && header.version == version
+			   && header.sourceSize == size && header.sourceTime == time;
+	}
+
+	/** Parses the header of a PPM (P3, P6) or PGM (P2, P5) file, and its values for the ASCII formats. */
+	static bool parse(const MappedFile &source, Image &img) {
+		const char *p = source.data, *end = source.data + source.size;
+		auto token = [&p, end]() {
+			while (p < end && (isspace((unsigned char)*p) || *p == '#')) {
+				if (*p == '#') while (p < end && *p != '\n') p++;
+				else p++;
+			}
+			const char *start = p;
+			while (p < end && !isspace((unsigned char)*p)) p++;
+			return string(start, p);
+		};
+		string magic = token();
+		if (magic != "P2" && magic != "P3" && magic != "P5" && magic != "P6") return false;
+		img.channels = magic == "P3" || magic == "P6" ? 3 : 1;
+		try {
+			img.width = (uint32_t)stoul(token());
+			img.height = (uint32_t)stoul(token());
+			img.maxValue = (uint32_t)stoul(token());
+		} catch (...) {
+			return false;
+		}
+		if (img.width == 0 || img.height == 0 || img.maxValue == 0 || img.maxValue > 65535) return false;
+		size_t count = (size_t)img.width * img.height * img.channels;
+		if (magic == "P5" || magic == "P6") {
+			p++; // a single whitespace separates the header from the values
+			if ((size_t)(end - p) < count * (img.maxValue < 256 ? 1 : 2)) return false;
+			img.binary = (const uint8_t *)p;
+			return true;
+		}
+		img.values.resize(count);
+		for (size_t i = 0; i < count; i++) {
+			string t = token();
+			if (t.empty()) return false;
+			img.values[i] = (uint16_t)std::min(strtoul(t.c_str(), nullptr, 10), (unsigned long)img.maxValue);
+		}
+		return true;
+	}
+
+	/** Writes the tiles of a level, the texels beyond its edges repeating its last row and column. */
+	template<typename Texel>
+	static void writeLevel(ofstream &file, const Level &l, Texel texel) {
+		TextureCache::Tile tile{};
+		const uint32_t n = TextureCache::tileSize;
+		for (uint32_t ty = 0; ty < l.tilesY; ty++) {
+			for (uint32_t tx = 0; tx < l.tilesX; tx++) {
+				for (uint32_t y = 0; y < n; y++) {
+					for (uint32_t x = 0; x < n; x++) {
+						glm::u8vec4 t = texel(std::min(tx * n + x, l.width - 1), std::min(ty * n + y, l.height - 1));
+						memcpy(tile.texels + (y * n + x) * 4, &t, 4);
+					}
+				}
+				file.write((const char *)&tile, sizeof(tile));
+			}
+		}
+	}
+
+	/** Texel of a level, the coordinates wrapping around. */
+	glm::vec3 texel(int level, int x, int y, TileRef &ref) const {
+		const Level &l = levels[level];
+		auto w = (int)l.width, h = (int)l.height;
+		x = (x % w + w) % w;
+		y = (y % h + h) % h;
+		const auto n = (int)TextureCache::tileSize;
+		uint64_t index = l.firstTile + (uint64_t)(y / n) * l.tilesX + x / n;
+		if (index != ref.index) {
+			ref.index = index;
+			ref.tile = cache.acquire(id, index, [this, index](TextureCache::Tile &tile) {
+				size_t offset = dataOffset(levels.size()) + index * sizeof(TextureCache::Tile);
+				memcpy(&tile, file->data + offset, sizeof(TextureCache::Tile));
+				file->release(offset, sizeof(TextureCache::Tile));
+			});
+		}
+		const uint8_t *t = ref.tile->texels + ((y % n) * n + x % n) * 4;
+		return glm::vec3(t[0], t[1], t[2]) * (1.0f / 255.0f);
+	}
+};
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef TONEMAPPING_HPP
+#define TONEMAPPING_HPP
+
+#include "glm/glm.hpp"
+
+/**
+ Curve of the tone mapping, alpha * intensity^gamma, without its clamping to (0,1): it keeps the differences between
+ the intensities brighter than white, such as those the denoiser compares (see Denoiser).
+ */
+glm::vec3 toneCurve(const glm::vec3 &intensity) {
+	float gamma = 1.0/2.0;
+	float alpha = 12.0f;
+	return alpha * glm::pow(intensity, glm::vec3(gamma));
+}
+
+/**
+ Function performing tonemapping of the intensities computed using the raytracer
+ @param intensity Input intensity
+ @return Tonemapped intensity in range (0,1)
+ */
+glm::vec3 toneMapping(const glm::vec3 &intensity) {
+	return glm::clamp(toneCurve(intensity), glm::vec3(0.0), glm::vec3(1.0));
+}
+
+#endif
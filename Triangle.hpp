@@ -69,4 +69,120 @@ struct Triangle : Object {
 	}
 };
 
+/**
+ Intersects a ray with the triangle a, b, c (Möller-Trumbore), culling back faces like Triangle::intersect.
+ This is the test used for indexed meshes, whose vertices are not copied into Triangle objects.
+ @param ray Ray expressed in the same coordinate system as the triangle
+ @param t Distance along the ray, written only on a hit
+ @param u Barycentric coordinate of b, written only on a hit
+ @param v Barycentric coordinate of c, written only on a hit
+ @return Whether the ray hits the front face of the triangle in front of its origin
+ */
+bool intersectTriangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, const Ray &ray, float &t, float &u, float &v) {
+	glm::vec3 e1 = b - a, e2 = c - a;
+	glm::vec3 pv = glm::cross(ray.direction, e2);
+	float det = glm::dot(e1, pv);
+	if (!(det > 0)) return false;
+	float inv = 1.0f / det;
+	glm::vec3 s = ray.origin - a;
+	float u_ = glm::dot(s, pv) * inv;
+	if (u_ < 0 || u_ > 1) return false;
+	glm::vec3 q = glm::cross(s, e1);
+	float v_ = glm::dot(ray.direction, q) * inv;
+	if (v_ < 0 || u_ + v_ > 1) return false;
+	float t_ = glm::dot(e2, q) * inv;
+	if (!(t_ > 0)) return false;
+	t = t_;
+	u = u_;
+	v = v_;
+	return true;
+}
+
+/**
+ Precomputed affine transform of a triangle (Baldwin & Weber, "Fast Ray-Triangle Intersections
+ by Coordinate Transformation", JCGT 2016). The transform maps the triangle onto the unit triangle
+ (0,0,0), (1,0,0), (0,1,0), so that the intersection test costs about a dozen multiply-adds.
+ Only the three rows which are actually needed by the test are stored.
+ */
+struct TriangleTransform {
+	float m[12]; ///< Rows of the transform: barycentric u, barycentric v, signed distance to the plane
+
+	TriangleTransform() = default;
+
+	/**
+	 Computes the transform for the triangle a, b, c.
+	 The third row is scaled so that its sign agrees with the geometric normal cross(b - a, c - a),
+	 which allows culling back faces the same way Triangle::intersect does.
+	 */
+	TriangleTransform(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+		glm::vec3 e1 = b - a;
+		glm::vec3 e2 = c - a;
+		glm::vec3 n = glm::cross(e1, e2);
+		glm::vec3 ca = glm::cross(c, a);
+		glm::vec3 ba = glm::cross(b, a);
+		float d = glm::dot(a, n);
+		glm::vec3 an = glm::abs(n);
+		float nk;
+		if (an.x > an.y && an.x > an.z) {
+			nk = n.x;
+			float s = 1.0f / n.x;
+			set(0, e2.z * s, -e2.y * s, ca.x * s,
+			    0, -e1.z * s, e1.y * s, -ba.x * s,
+			    1, n.y * s, n.z * s, -d * s);
+		} else if (an.y > an.z) {
+			nk = n.y;
+			float s = 1.0f / n.y;
+			set(-e2.z * s, 0, e2.x * s, ca.y * s,
+			    e1.z * s, 0, -e1.x * s, -ba.y * s,
+			    n.x * s, 1, n.z * s, -d * s);
+		} else if (an.z > 0) {
+			nk = n.z;
+			float s = 1.0f / n.z;
+			set(e2.y * s, -e2.x * s, 0, ca.z * s,
+			    -e1.y * s, e1.x * s, 0, -ba.z * s,
+			    n.x * s, n.y * s, 1, -d * s);
+		} else { // degenerate triangle, never hit
+			set(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, 0);
+			return;
+		}
+		// the last row is the plane equation divided by n[k]; flip it so it has the sign of the normal
+		if (nk < 0) for (int i = 8; i < 12; i++) m[i] = -m[i];
+	}
+
+	/**
+	 Intersects the ray with the triangle.
+	 @param ray Ray expressed in the same coordinate system as the triangle
+	 @param t Distance along the ray, written only on a hit
+	 @param u Barycentric coordinate of the second vertex, written only on a hit
+	 @param v Barycentric coordinate of the third vertex, written only on a hit
+	 @return Whether the ray hits the front face of the triangle in front of its origin
+	 */
+	bool intersect(const Ray &ray, float &t, float &u, float &v) const {
+		const glm::vec3 &o = ray.origin;
+		const glm::vec3 &d = ray.direction;
+		float dz = m[8] * d.x + m[9] * d.y + m[10] * d.z;
+		if (dz >= 0) return false;
+		float oz = m[8] * o.x + m[9] * o.y + m[10] * o.z + m[11];
+		float t_ = -oz / dz;
+		if (t_ <= 0) return false;
+		glm::vec3 p = o + t_ * d;
+		float u_ = m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3];
+		if (u_ < 0) return false;
+		float v_ = m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7];
+		if (v_ < 0 || u_ + v_ > 1) return false;
+		t = t_;
+		u = u_;
+		v = v_;
+		return true;
+	}
+
+private:
+	void set(float m0, float m1, float m2, float m3,
+	         float m4, float m5, float m6, float m7,
+	         float m8, float m9, float m10, float m11) {
+		float r[12] = {m0, m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11};
+		for (int i = 0; i < 12; i++) m[i] = r[i];
+	}
+};
+
 #endif
\ No newline at end of file
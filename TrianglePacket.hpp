@@ -0,0 +1,255 @@
+#ifndef TRIANGLEPACKET_HPP
+#define TRIANGLEPACKET_HPP
+
+#include <algorithm>
+#include <limits>
+
+#include "glm/glm.hpp"
+#include "CPU.hpp"
+#include "Triangle.hpp"
+#include "Ray.hpp"
+
+#define FLOAT_INFINITY std::numeric_limits<float>::infinity()
+
+/**
+ Up to eight triangles stored in structure-of-arrays form, so that one ray can be tested against all of
+ them at once (Möller-Trumbore, with the back faces culled like in Triangle::intersect).
+ The kernel is selected at startup according to the CPU: AVX-512 and AVX2 test the eight lanes at once,
+ SSE4.2 in two halves of four. Unused lanes hold degenerate triangles, which are never hit.
+ */
+struct alignas(32) TrianglePacket {
+	static const int width = 8; ///< Number of triangles in a packet
+
+	float ax[width], ay[width], az[width]; ///< First vertex
+	float e1x[width], e1y[width], e1z[width]; ///< Edge from the first to the second vertex
+	float e2x[width], e2y[width], e2z[width]; ///< Edge from the first to the third vertex
+	int count = 0; ///< Number of used lanes
+
+	TrianglePacket() {
+		for (float *f : {ax, ay, az, e1x, e1y, e1z, e2x, e2y, e2z}) std::fill_n(f, width, 0.0f);
+	}
+
+	/**
+	 Adds a triangle to the first free lane.
+	 @return the lane of the triangle
+	 */
+	int add(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+		int i = count++;
+		glm::vec3 e1 = b - a, e2 = c - a;
+		ax[i] = a.x; ay[i] = a.y; az[i] = a.z;
+		e1x[i] = e1.x; e1y[i] = e1.y; e1z[i] = e1.z;
+		e2x[i] = e2.x; e2y[i] = e2.y; e2z[i] = e2.z;
+		return i;
+	}
+
+	/**
+	 Intersects the ray with all the triangles of the packet.
+	 @param ray Ray expressed in the same coordinate system as the triangles
+	 @param t Distance along the ray of the nearest hit, written only on a hit
+	 @param u Barycentric coordinate of the second vertex of the nearest hit, written only on a hit
+	 @param v Barycentric coordinate of the third vertex of the nearest hit, written only on a hit
+	 @return the lane of the nearest triangle hit, or -1
+	 */
+	int intersect(const Ray &ray, float &t, float &u, float &v) const {
+		return kernel(*this, ray, t, u, v);
+	}
+
+	/** Selects the kernel used by intersect for the given instruction set. */
+	static void selectKernel(CPU::ISA isa) {
+		switch (isa) {
+#ifdef CPU_X86
+			case CPU::ISA::AVX512: kernel = &intersectAVX512; break;
+			case CPU::ISA::AVX2: kernel = &intersectAVX2; break;
+			case CPU::ISA::SSE42: kernel = &intersectSSE42; break;
+#endif
+			default: kernel = &intersectScalar;
+		}
+	}
+
+	/** Reference kernel, one lane at a time. */
+	static int intersectScalar(const TrianglePacket &p, const Ray &ray, float &t, float &u, float &v) {
+		int lane = -1;
+		float best = FLOAT_INFINITY;
+		for (int i = 0; i < p.count; i++) {
+			glm::vec3 e1(p.e1x[i], p.e1y[i], p.e1z[i]), e2(p.e2x[i], p.e2y[i], p.e2z[i]);
+			glm::vec3 pv = glm::cross(ray.direction, e2);
+			float det = glm::dot(e1, pv);
+			if (!(det > 0)) continue;
+			float inv = 1.0f / det;
+			glm::vec3 s = ray.origin - glm::vec3(p.ax[i], p.ay[i], p.az[i]);
+			float u_ = glm::dot(s, pv) * inv;
+			glm::vec3 q = glm::cross(s, e1);
+			float v_ = glm::dot(ray.direction, q) * inv;
+			float t_ = glm::dot(e2, q) * inv;
+			if (u_ >= 0 && v_ >= 0 && u_ + v_ <= 1 && t_ > 0 && t_ < best) {
+				best = t = t_;
+				u = u_;
+				v = v_;
+				lane = i;
+			}
+		}
+		return lane;
+	}
+
+#ifdef CPU_X86
+	/** SSE4.2 kernel, tests the packet in two halves of four lanes. */
+	TARGET_SSE42 static int intersectSSE42(const TrianglePacket &p, const Ray &ray, float &t, float &u, float &v) {
+		const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+		const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), inf = _mm_set1_ps(FLOAT_INFINITY);
+		int lane = -1;
+		float best = FLOAT_INFINITY;
+		for (int base = 0; base < p.count; base += 4) {
+			const __m128 E1x = _mm_load_ps(p.e1x + base), E1y = _mm_load_ps(p.e1y + base), E1z = _mm_load_ps(p.e1z + base);
+			const __m128 E2x = _mm_load_ps(p.e2x + base), E2y = _mm_load_ps(p.e2y + base), E2z = _mm_load_ps(p.e2z + base);
+
+			// p = d x e2
+			__m128 px = _mm_sub_ps(_mm_mul_ps(dy, E2z), _mm_mul_ps(dz, E2y));
+			__m128 py = _mm_sub_ps(_mm_mul_ps(dz, E2x), _mm_mul_ps(dx, E2z));
+			__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, E2y), _mm_mul_ps(dy, E2x));
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(E1x, px), _mm_mul_ps(E1y, py)), _mm_mul_ps(E1z, pz));
+			__m128 inv = _mm_div_ps(one, det);
+
+			// s = o - a
+			__m128 sx = _mm_sub_ps(ox, _mm_load_ps(p.ax + base));
+			__m128 sy = _mm_sub_ps(oy, _mm_load_ps(p.ay + base));
+			__m128 sz = _mm_sub_ps(oz, _mm_load_ps(p.az + base));
+			__m128 U = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+			// q = s x e1
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, E1z), _mm_mul_ps(sz, E1y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, E1x), _mm_mul_ps(sx, E1z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, E1y), _mm_mul_ps(sy, E1x));
+			__m128 V = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+			__m128 T = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(E2x, qx), _mm_mul_ps(E2y, qy)), _mm_mul_ps(E2z, qz)), inv);
+
+			__m128 mask = _mm_cmpgt_ps(det, zero);
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(U, zero));
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(V, zero));
+			mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(U, V), one));
+			mask = _mm_and_ps(mask, _mm_cmpgt_ps(T, zero));
+			mask = _mm_and_ps(mask, _mm_cmplt_ps(T, _mm_set1_ps(best)));
+			if (_mm_movemask_ps(mask) == 0) continue;
+
+			// nearest lane: horizontal minimum of the masked distances
+			__m128 Tm = _mm_blendv_ps(inf, T, mask);
+			__m128 m = _mm_min_ps(Tm, _mm_shuffle_ps(Tm, Tm, _MM_SHUFFLE(2, 3, 0, 1)));
+			m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+			int i = __builtin_ctz(_mm_movemask_ps(_mm_and_ps(mask, _mm_cmpeq_ps(Tm, m))));
+
+			alignas(16) float tt[4], uu[4], vv[4];
+			_mm_store_ps(tt, T);
+			_mm_store_ps(uu, U);
+			_mm_store_ps(vv, V);
+			best = t = tt[i];
+			u = uu[i];
+			v = vv[i];
+			lane = base + i;
+		}
+		return lane;
+	}
+
+	/** AVX2 kernel, tests the eight lanes at once using fused multiply-adds. */
+	TARGET_AVX2 static int intersectAVX2(const TrianglePacket &p, const Ray &ray, float &t, float &u, float &v) {
+		const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+		const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+		const __m256 E1x = _mm256_load_ps(p.e1x), E1y = _mm256_load_ps(p.e1y), E1z = _mm256_load_ps(p.e1z);
+		const __m256 E2x = _mm256_load_ps(p.e2x), E2y = _mm256_load_ps(p.e2y), E2z = _mm256_load_ps(p.e2z);
+
+		__m256 px = _mm256_fmsub_ps(dy, E2z, _mm256_mul_ps(dz, E2y));
+		__m256 py = _mm256_fmsub_ps(dz, E2x, _mm256_mul_ps(dx, E2z));
+		__m256 pz = _mm256_fmsub_ps(dx, E2y, _mm256_mul_ps(dy, E2x));
+		__m256 det = _mm256_fmadd_ps(E1x, px, _mm256_fmadd_ps(E1y, py, _mm256_mul_ps(E1z, pz)));
+		__m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+		__m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(p.ax));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(p.ay));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(p.az));
+		__m256 U = _mm256_mul_ps(_mm256_fmadd_ps(sx, px, _mm256_fmadd_ps(sy, py, _mm256_mul_ps(sz, pz))), inv);
+
+		__m256 qx = _mm256_fmsub_ps(sy, E1z, _mm256_mul_ps(sz, E1y));
+		__m256 qy = _mm256_fmsub_ps(sz, E1x, _mm256_mul_ps(sx, E1z));
+		__m256 qz = _mm256_fmsub_ps(sx, E1y, _mm256_mul_ps(sy, E1x));
+		__m256 V = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inv);
+		__m256 T = _mm256_mul_ps(_mm256_fmadd_ps(E2x, qx, _mm256_fmadd_ps(E2y, qy, _mm256_mul_ps(E2z, qz))), inv);
+
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 mask = _mm256_cmp_ps(det, zero, _CMP_GT_OQ);
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(U, zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(V, zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(U, V), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(T, zero, _CMP_GT_OQ));
+		if (_mm256_movemask_ps(mask) == 0) return -1;
+
+		__m256 Tm = _mm256_blendv_ps(_mm256_set1_ps(FLOAT_INFINITY), T, mask);
+		__m256 m = _mm256_min_ps(Tm, _mm256_permute2f128_ps(Tm, Tm, 1));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		int i = __builtin_ctz(_mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(Tm, m, _CMP_EQ_OQ))));
+
+		alignas(32) float tt[8], uu[8], vv[8];
+		_mm256_store_ps(tt, T);
+		_mm256_store_ps(uu, U);
+		_mm256_store_ps(vv, V);
+		t = tt[i];
+		u = uu[i];
+		v = vv[i];
+		return i;
+	}
+
+	/** AVX-512 kernel, like the AVX2 one but with mask registers, which leaves early when no determinant is positive. */
+	TARGET_AVX512 static int intersectAVX512(const TrianglePacket &p, const Ray &ray, float &t, float &u, float &v) {
+		const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+		const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+		const __m256 E1x = _mm256_load_ps(p.e1x), E1y = _mm256_load_ps(p.e1y), E1z = _mm256_load_ps(p.e1z);
+		const __m256 E2x = _mm256_load_ps(p.e2x), E2y = _mm256_load_ps(p.e2y), E2z = _mm256_load_ps(p.e2z);
+
+		__m256 px = _mm256_fmsub_ps(dy, E2z, _mm256_mul_ps(dz, E2y));
+		__m256 py = _mm256_fmsub_ps(dz, E2x, _mm256_mul_ps(dx, E2z));
+		__m256 pz = _mm256_fmsub_ps(dx, E2y, _mm256_mul_ps(dy, E2x));
+		__m256 det = _mm256_fmadd_ps(E1x, px, _mm256_fmadd_ps(E1y, py, _mm256_mul_ps(E1z, pz)));
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+		__mmask8 mask = _mm256_cmp_ps_mask(det, zero, _CMP_GT_OQ);
+		if (mask == 0) return -1;
+		__m256 inv = _mm256_div_ps(one, det); // exact, for the same hits as the other kernels
+
+		__m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(p.ax));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(p.ay));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(p.az));
+		__m256 U = _mm256_mul_ps(_mm256_fmadd_ps(sx, px, _mm256_fmadd_ps(sy, py, _mm256_mul_ps(sz, pz))), inv);
+
+		__m256 qx = _mm256_fmsub_ps(sy, E1z, _mm256_mul_ps(sz, E1y));
+		__m256 qy = _mm256_fmsub_ps(sz, E1x, _mm256_mul_ps(sx, E1z));
+		__m256 qz = _mm256_fmsub_ps(sx, E1y, _mm256_mul_ps(sy, E1x));
+		__m256 V = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inv);
+		__m256 T = _mm256_mul_ps(_mm256_fmadd_ps(E2x, qx, _mm256_fmadd_ps(E2y, qy, _mm256_mul_ps(E2z, qz))), inv);
+
+		mask = _mm256_mask_cmp_ps_mask(mask, U, zero, _CMP_GE_OQ);
+		mask = _mm256_mask_cmp_ps_mask(mask, V, zero, _CMP_GE_OQ);
+		mask = _mm256_mask_cmp_ps_mask(mask, _mm256_add_ps(U, V), one, _CMP_LE_OQ);
+		mask = _mm256_mask_cmp_ps_mask(mask, T, zero, _CMP_GT_OQ);
+		if (mask == 0) return -1;
+
+		__m256 Tm = _mm256_mask_blend_ps(mask, _mm256_set1_ps(FLOAT_INFINITY), T);
+		__m256 m = _mm256_min_ps(Tm, _mm256_permute2f128_ps(Tm, Tm, 1));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		int i = __builtin_ctz(_mm256_mask_cmp_ps_mask(mask, Tm, m, _CMP_EQ_OQ));
+
+		alignas(32) float tt[8], uu[8], vv[8];
+		_mm256_store_ps(tt, T);
+		_mm256_store_ps(uu, U);
+		_mm256_store_ps(vv, V);
+		t = tt[i];
+		u = uu[i];
+		v = vv[i];
+		return i;
+	}
+#endif
+
+	/** Signature of the intersection kernels, see intersect */
+	typedef int (*Kernel)(const TrianglePacket &packet, const Ray &ray, float &t, float &u, float &v);
+	static inline Kernel kernel = &intersectScalar; ///< Kernel used by intersect, see selectKernel
+};
+
+#endif
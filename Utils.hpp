@@ -2,24 +2,84 @@
 #define UTIL_HPP
 
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
 
 #include "glm/glm.hpp"
+#include "CPU.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
+#include "LightTree.hpp"
 #include "Hit.hpp"
+#include "Sphere.hpp"
+#include "TrianglePacket.hpp"
 #include "BoundingBox.hpp"
+#include "Shading.hpp"
+#include "Denoiser.hpp"
+#include "ToneMapping.hpp"
 
 using namespace std;
 
 /**
- Function performing tonemapping of the intensities computed using the raytracer
- @param intensity Input intensity
- @return Tonemapped intensity in range (0,1)
+ Selects the variant of every hot kernel for the given instruction set, see CPU.hpp.
  */
-glm::vec3 toneMapping(const glm::vec3 &intensity) {
-	float gamma = 1.0/2.0;
-	float alpha = 12.0f;
-	return glm::clamp(alpha * glm::pow(intensity, glm::vec3(gamma)), glm::vec3(0.0), glm::vec3(1.0));
+void selectKernels(CPU::ISA isa) {
+	BoundingBox::selectKernel(isa);
+	TrianglePacket::selectKernel(isa);
+	SphereSet::selectKernel(isa);
+	LightTerms::selectKernel(isa);
+	ShadingBatch::selectKernel(isa);
+	Procedural::selectKernel(isa);
+	Denoiser::selectKernel(isa);
+}
+
+/**
+ Smallest intensity added to a point of the given tone mapped value (in [0,1)) which raises it by one 8-bit step.
+ The default is the display mid-grey: a step measured near black, where the curve is the steepest, is far smaller
+ than what can be seen in the rest of the image.
+ */
+float tone_mapping_step(float grey = 0.5f) {
+	// the tone mapping is increasing, so that the intensities are found by bisection whatever its curve
+	auto inverse = [](float value) {
+		float lo = 0, hi = 1;
+		for (int i = 0; i < 64; i++) {
+			float middle = (lo + hi) / 2;
+			if (toneMapping(glm::vec3(middle)).x >= value) hi = middle;
+			else lo = middle;
+		}
+		return hi;
+	};
+	return inverse(grey + 1.0f / 255) - inverse(grey);
+}
+
+/**
+ Sets the influence radius of every light, the distance beyond which it is culled, so that the lights culled at any
+ point add up to less than tone_mapping_step. The contribution of a light is its color times the diffuse and
+ specular terms of the material over the squared distance (see PhongModel), and these terms are bounded by the
+ largest diffuse and specular colors of the materials; the reflected and refracted rays only scale the
+ contributions down. The step is shared between the lights in proportion to their intensities, so that they all
+ get the same radius, where each contributes its share.
+ */
+void set_influence_radii(const vector<Light *> &lights, const MaterialTable &materials) {
+	float response = 0;
+	for (size_t m = 0; m < materials.size(); m++) {
+		const glm::vec3 &diffuse = materials.diffuse[m], &specular = materials.specular[m];
+		float largest = max({diffuse.x, diffuse.y, diffuse.z});
+		if (materials.texture[m] || materials.procedural[m]) largest = max(largest, 1.0f); // textures are in [0,1]
+		response = max(response, largest + max({specular.x, specular.y, specular.z}));
+	}
+	float total = 0;
+	for (Light *light : lights) total += max({light->color.r, light->color.g, light->color.b});
+	float influence = sqrt(total * response / tone_mapping_step());
+	for (Light *light : lights) light->influence = influence;
+}
+
+/** Whether the influence sphere of the light (see set_influence_radii) reaches the box [lo, hi]. */
+bool influences(const Light &light, const glm::vec3 &lo, const glm::vec3 &hi) {
+	glm::vec3 d = light.position - glm::clamp(light.position, lo, hi);
+	return glm::dot(d, d) <= light.influence * light.influence;
 }
 
 float fresnel_factor(const glm::vec3 &reflect_dir, const glm::vec3 &refract_dir, const glm::vec3 &normal, const float &d1, const float &d2) {
@@ -35,12 +95,103 @@ float fresnel_factor(const glm::vec3 &reflect_dir, const glm::vec3 &refract_dir,
 	return F;
 }
 
+/**
+ Whether a shadow ray is blocked by an object or a mesh of the hierarchy before reaching the light.
+ @param r distance to the light
+ */
+bool occluded(const vector<Object *> &objects, const BoundingBox &bbox, const Ray &shadow_ray, float r) {
+	for (auto o : objects) {
+		Hit shadow_hit = o->intersect(shadow_ray);
+		if (shadow_hit.hit && shadow_hit.distance < r) return true;
+	}
+	Hit bb_hit = bbox.trace_ray(shadow_ray);
+	return bb_hit.hit && bb_hit.distance < r;
+}
+
+/** Number of shadow rays traced towards the area lights, see light_visibility. */
+struct ShadowSettings {
+	static constexpr int maxSamples = 4096; ///< Largest number of samples
+
+	/// Shadow rays towards an area light from a point in its penumbra, rounded up to a power of two (see rays), from 1,
+	/// which makes the area lights cast the hard shadows of their center, to maxSamples
+	int samples = 16;
+	/// Whether a quarter of the rays (the probes, at least 2) first tell whether the point is in the penumbra, the
+	/// other ones being only traced if they disagree; otherwise all the samples are traced from every point
+	bool adaptive = true;
+
+	/** Shadow rays traced in a penumbra: samples rounded up to a power of two, at least 2 and at most maxSamples. */
+	[[nodiscard]] int rays() const {
+		int n = 2;
+		while (n < std::min(samples, maxSamples)) n *= 2;
+		return n;
+	}
+};
+
+/** Pseudo-random bits of a point, which decorrelate the sampling patterns of neighbouring points. */
+uint32_t hash_point(const glm::vec3 &point) {
+	uint32_t bits[3];
+	memcpy(bits, &point, sizeof(bits));
+	uint32_t h = (bits[0] * 0x8da6b343u) ^ (bits[1] * 0xd8163841u) ^ (bits[2] * 0xcb1ab31fu);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	return h;
+}
+
+/**
+ Fraction of a light seen from a point, through the objects and the meshes of the hierarchy. A point light is
+ seen or not. An area light is sampled by shadow rays towards the points of a Sobol sequence (see Light::sample),
+ scrambled by a hash of the shaded point (hash_point) so that the patterns of neighbouring points are uncorrelated. The first
+ quarter of the points of the sequence (the probes) covers the light evenly: when their rays agree, the point is
+ taken to be fully lit or fully in the shadow, and only the points of the penumbrae, where they disagree, pay for
+ the remaining samples.
+ @param direction normalized direction from the point to the center of the light, used by point lights
+ @param r distance to the center of the light
+ @param rays if not null, incremented by the number of shadow rays traced
+ */
+float light_visibility(const Light &light,
+					   const vector<Object *> &objects,
+					   const BoundingBox &bbox,
+					   const glm::vec3 &point,
+					   const glm::vec3 &direction,
+					   float r,
+					   const ShadowSettings &settings,
+					   int *rays = nullptr) {
+	if (!light.area() || settings.samples <= 1) {
+		if (rays) (*rays)++;
+		return occluded(objects, bbox, Ray(point + direction * 0.01f, direction), r) ? 0.0f : 1.0f;
+	}
+	int samples = settings.rays();
+	uint32_t scramble = hash_point(point);
+
+	int visible = 0, traced = 0;
+	auto trace = [&](uint32_t i) {
+		glm::vec3 d = light.sample(sobol(i, scramble), point) - point;
+		float distance = glm::length(d);
+		d /= distance;
+		traced++;
+		if (!occluded(objects, bbox, Ray(point + d * 0.01f, d), distance)) visible++;
+	};
+	// fewer probes miss the thin parts of the penumbrae, where an occluder hides a sliver of the light
+	int probes = std::max(2, samples / 4);
+	for (int i = 0; i < probes; i++) trace(i);
+	if (!settings.adaptive || (visible > 0 && visible < probes)) {
+		for (int i = probes; i < samples; i++) trace(i);
+	}
+	if (rays) *rays += traced;
+	return (float)visible / (float)traced;
+}
+
 /** Function for computing color of an object according to the Phong Model
  @param point A point belonging to the object for which the color is computed
  @param normal A normal vector the the point
  @param uv Texture coordinates
  @param view_direction A normalized direction from the point to the viewer/camera
- @param material A material structure representing the material of the object
+ @param materials The material table of the scene
+ @param material The index of the material of the object in materials
+ @param footprint Width of the area seen by the pixel in texture coordinate units, which selects the mip levels of the image textures
+ @param shadows Number of shadow rays towards the area lights
+ @param sampling If it has a tree, the lights shaded are sampled from it instead of shading all of them
 */
 glm::vec3 PhongModel(const vector<Light *> &lights, 
 					const glm::vec3 &ambient_light, 
@@ -49,110 +200,290 @@ glm::vec3 PhongModel(const vector<Light *> &lights,
 					const glm::vec3 &normal, 
 					const glm::vec2 &uv, 
 					const glm::vec3 &view_direction, 
-					const Material &material,
-                    const BoundingBox &bbox){
+					const MaterialTable &materials,
+					uint16_t material,
+                    const BoundingBox &bbox,
+                    float footprint = 0,
+                    const ShadowSettings &shadows = ShadowSettings(),
+                    const LightSampling &sampling = LightSampling()){
 
 	glm::vec3 color(0.0);
-	for(auto light : lights){
+	glm::vec3 diffuse_color = materials.diffuseColor(material, uv, footprint);
+	const glm::vec3 &specular_color = materials.specular[material];
+	float shininess = materials.shininess[material];
 
-		glm::vec3 light_direction = glm::normalize(light->position - point);
-		glm::vec3 reflected_direction = glm::reflect(-light_direction, normal);
+	// the lights shaded, all of them or a few sampled from the tree, with the weights of their contributions
+	const Light *const *shaded = lights.data();
+	size_t count = lights.size();
+	const Light *sampled[LightTree::maxSamples];
+	float weights[LightTree::maxSamples];
+	if (sampling.tree) {
+		float offset = (float)(hash_point(point) >> 8) * (1.0f / 16777216.0f);
+		count = sampling.tree->sample(point, normal, offset, sampling.samples, sampled, weights);
+		shaded = sampled;
+	}
 
-		float NdotL = glm::clamp(glm::dot(normal, light_direction), 0.0f, 1.0f);
-		float VdotR = glm::clamp(glm::dot(view_direction, reflected_direction), 0.0f, 1.0f);
+	// the geometric terms are computed for batches of lights at once
+	LightTerms terms;
+	for(size_t first = 0; first < count; first += LightTerms::size){
+		int n = (int)min(count - first, (size_t)LightTerms::size);
+		for(int i = 0; i < LightTerms::size; i++){
+			glm::vec3 position = i < n ? shaded[first + i]->position : glm::vec3(0.0);
+			terms.px[i] = position.x;
+			terms.py[i] = position.y;
+			terms.pz[i] = position.z;
+		}
+		terms.compute(n, point, normal, view_direction);
 
-		
-		glm::vec3 diffuse_color = material.diffuse;
-		 if(material.texture){
-		 	diffuse_color = material.texture(uv);
-		 }
-		
-		glm::vec3 diffuse = diffuse_color * glm::vec3(NdotL);
-		glm::vec3 specular = material.specular * glm::vec3(pow(VdotR, material.shininess));
+		for(int i = 0; i < n; i++){
+			const Light *light = shaded[first + i];
+			if (terms.r[i] > light->influence) continue; // too far to change the image, nor its shadow rays
+			glm::vec3 light_direction(terms.lx[i], terms.ly[i], terms.lz[i]);
+
+			glm::vec3 diffuse = diffuse_color * glm::vec3(terms.NdotL[i]);
+			glm::vec3 specular = specular_color * glm::vec3(pow(terms.VdotR[i], shininess));
 		
 		
-		// distance to the light
-		float r = glm::distance(point,light->position);
-		r = max(r, 0.1f);
+			// distance to the light
+			float r = max(terms.r[i], 0.1f);
 		
-		// Checking if the light source can be reached directly from the point
-		Ray shadow_ray(point + light_direction * 0.01f, light_direction);
-		Hit shadow_hit;
-		for (auto o : objects) {
-			shadow_hit = o->intersect(shadow_ray);
-			if(shadow_hit.hit && shadow_hit.distance < r) break;
+			// Checking which part of the light source can be reached directly from the point
+			float visible = light_visibility(*light, objects, bbox, point, light_direction, r, shadows);
+			if (sampling.tree) visible *= weights[first + i];
+			if (visible > 0)
+				color += visible * light->color * (diffuse + specular) / r/r;
 		}
-        Hit bb_hit = bbox.trace_ray(shadow_ray);
-        if (bb_hit.hit && bb_hit.distance < r) shadow_hit = bb_hit;
-		if (!shadow_hit.hit || shadow_hit.distance > r)
-			color += light->color * (diffuse + specular) / r/r;
 	}
-	color += ambient_light * material.ambient;
+	color += ambient_light * materials.ambient[material];
 	
 	color = glm::clamp(color, glm::vec3(0.0), glm::vec3(1.0));
 	return color;
 }
 
-glm::vec3 trace_ray(const vector<Light *> &lights, 
-					const glm::vec3 &ambient_light, 
-					const vector<Object *> &objects,
-					const Ray &ray, 
-					const int &maxDepth,
-					const BoundingBox &bbox) {
-	Hit hit;
+/**
+ Shades the hits of a batch by the Phong model, like PhongModel for each of them, but with the terms of every
+ light computed for all the hits at once by the kernel of ShadingBatch, after the procedural textures of the hits
+ are evaluated together. The shadow rays are only traced for the hits to which the light contributes, within its
+ influence radius.
+ @param batch the hits, whose colors are read with ShadingBatch::color
+ @param shadows number of shadow rays towards the area lights
+ @param sampling if it has a tree, the lights shaded are sampled from it for each hit, see PhongModel
+ */
+void shade_batch(ShadingBatch &batch,
+				 const vector<Light *> &lights,
+				 const vector<Object *> &objects,
+				 const BoundingBox &bbox,
+				 const ShadowSettings &shadows = ShadowSettings(),
+				 const LightSampling &sampling = LightSampling()) {
+	batch.texture();
+	// the light of each hit, the same one for all of them unless the lights are sampled
+	const Light *current[ShadingBatch::size];
+	auto shade = [&]() {
+		for (int i = 0; i < batch.count; i++) {
+			if (batch.cr[i] == 0 && batch.cg[i] == 0 && batch.cb[i] == 0) continue; // facing away from the light
+			if (batch.r[i] > current[i]->influence) continue; // too far to change the image, see set_influence_radii
+			glm::vec3 light_direction(batch.lx[i], batch.ly[i], batch.lz[i]);
+			glm::vec3 point(batch.px[i], batch.py[i], batch.pz[i]);
+			float visible = light_visibility(*current[i], objects, bbox, point, light_direction, batch.r[i], shadows);
+			if (visible == 0) continue;
+			batch.red[i] += visible * batch.cr[i];
+			batch.green[i] += visible * batch.cg[i];
+			batch.blue[i] += visible * batch.cb[i];
+		}
+	};
+	if (!sampling.tree) {
+		for (Light *light : lights) {
+			batch.light(light->position, light->color);
+			for (int i = 0; i < batch.count; i++) current[i] = light;
+			shade();
+		}
+		return;
+	}
+	// the k-th light of every hit is shaded by the k-th pass, with its color scaled by its weight
+	const Light *sampled[ShadingBatch::size][LightTree::maxSamples];
+	float weights[ShadingBatch::size][LightTree::maxSamples];
+	// the same number of lights is sampled for every hit, so that each pass shades one light of each of them
+	const int passes = sampling.tree->size() ? min(sampling.samples, LightTree::maxSamples) : 0;
+	for (int i = 0; i < batch.count; i++) {
+		glm::vec3 point(batch.px[i], batch.py[i], batch.pz[i]), normal(batch.nx[i], batch.ny[i], batch.nz[i]);
+		float offset = (float)(hash_point(point) >> 8) * (1.0f / 16777216.0f);
+		[[maybe_unused]] int count = sampling.tree->sample(point, normal, offset, sampling.samples, sampled[i], weights[i]);
+		assert(count == passes);
+	}
+	for (int k = 0; k < passes; k++) {
+		for (int i = 0; i < batch.count; i++) {
+			current[i] = sampled[i][k];
+			batch.setLight(i, current[i]->position, current[i]->color * weights[i][k]);
+		}
+		batch.light();
+		shade();
+	}
+}
 
+/** Closest intersection of the ray with the objects and with the meshes of the hierarchy. */
+Hit closest_hit(const vector<Object *> &objects, const Ray &ray, const BoundingBox &bbox) {
+	Hit hit;
 	hit.hit = false;
 	hit.distance = INFINITY;
-
 	for(auto object : objects){
 		Hit hit_ = object->intersect(ray);
 		if(hit_.hit && hit_.distance < hit.distance) hit = hit_;
 	}
 	Hit bb_hit = bbox.trace_ray(ray);
 	if (bb_hit.hit && bb_hit.distance < hit.distance) hit = bb_hit;
+	return hit;
+}
 
-	// if (hit.debug) return glm::vec3(1.0, 0.0, 0.0);
-	// if (hit.debug) return glm::vec3(1.0 - (hit.distance - 6.0) / 10.0, 0.0, 0.0);
-	// if (hit.debug) return (hit.normal+1.0f)/2.0f;
+/** Ray waiting to be traced by trace_ray, with the share of the pixel color it carries. */
+struct PendingRay {
+	glm::vec3 origin;
+	glm::vec3 direction;
+	glm::vec3 weight; ///< Product of the reflection and Fresnel factors along the path from the camera
+	int depth; ///< Number of reflections and refractions which may still follow
+	int pixel = 0; ///< Index of the primary ray it comes from, see trace_rays
+	float cone = 0; ///< Width of the footprint of the pixel at the origin of the ray
+};
 
-	if (!hit.hit) return {0,0,0};
+const int defaultRayBudget = 128; ///< Enough for the whole tree of rays of a refractive scene at the default depth
 
-	Material m = hit.object->getMaterial();
-	float refraction_index = m.refraction;
-	bool inside = glm::dot(hit.normal, -ray.direction) < 0;
+/** Settings of the tree of reflected and refracted rays traced for a pixel, see trace_ray. */
+struct TraceSettings {
+	int maxDepth = 5; ///< Number of reflections and refractions after the primary ray, at most 29
+	int rayBudget = defaultRayBudget; ///< Largest number of rays traced, the pending rays beyond it are dropped
+	/// Rays whose weight (its largest component) falls below are cut, or continued by Russian roulette; 0 to
+	/// trace every ray
+	float minWeight = 0;
+	/// Whether the rays below minWeight are continued with probability weight / minWeight, their weight divided
+	/// by this probability so that the image stays the same on average, instead of being cut
+	bool russianRoulette = true;
+	/// Width of the footprint of a pixel at unit distance from the camera. The footprint grows along the rays as a
+	/// cone of this spread, and selects the mip levels of the image textures; 0 samples their finest level
+	float pixelSpread = 0;
+	ShadowSettings shadows; ///< Shadow rays towards the area lights
+	LightSampling lightSampling; ///< Lights shaded at each hit, all of them by default
+};
+
+/** Uniform random number in [0, 1) from a small hash-based generator, whose state is advanced. */
+float random_float(uint32_t &state) {
+	state = state * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (float)(((word >> 22u) ^ word) >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ Whether a ray of the given weight is traced, that is unless its weight is below the threshold of the settings and
+ it does not survive the roulette, in which case the weight of a survivor is scaled up.
+ @param random state of the generator of the roulette
+ */
+bool survives(glm::vec3 &weight, const TraceSettings &settings, uint32_t &random) {
+	float w = max(weight.x, max(weight.y, weight.z));
+	if (w >= settings.minWeight) return true;
+	if (!settings.russianRoulette || w <= 0) return false;
+	float survival = w / settings.minWeight;
+	if (random_float(random) >= survival) return false;
+	weight /= survival;
+	return true;
+}
+
+/**
+ Continues the tree of rays at a hit: the normal is turned towards the ray, and the reflected or refracted rays of
+ the material are passed to push, the reflected one last.
+ @param m index of the material of the hit in materials
+ @return Weight of the Phong color of the hit in the pixel, zero for a refractive surface
+ */
+template<typename Push>
+glm::vec3 spawn_rays(const MaterialTable &materials, const PendingRay &current, const Ray &r, Hit &hit, uint16_t m, Push push) {
+	bool inside = glm::dot(hit.normal, -r.direction) < 0;
 	if (inside) hit.normal = -hit.normal;
-	
-	glm::vec3 phong = PhongModel(lights, ambient_light, objects, hit.intersection, hit.normal, hit.uv, glm::normalize(-ray.direction), m, bbox);
-	if (maxDepth < 0) return phong;
-	
-	glm::vec3 reflect(0);
-	glm::vec3 reflect_direction = glm::reflect(ray.direction, hit.normal);
-	if (m.reflection > 0) {
-		reflect = trace_ray(lights, ambient_light, objects, Ray(hit.intersection + reflect_direction * 0.001f, reflect_direction), maxDepth - 1, bbox) * m.reflection;
-		return reflect + phong * (1 - m.reflection);
-	}
-
-	glm::vec3 refract(0);
-	if (m.refraction > 0) {
-		float d1, d2;
-		if (inside) {
-			d1 = refraction_index;
-			d2 = 1.0f;
-		} else {
-			d1 = 1.0f;
-			d2 = refraction_index;
-		}
-		glm::vec3 refract_direction = glm::refract(ray.direction, hit.normal, d1 / d2);
-		float F = fresnel_factor(reflect_direction, refract_direction, hit.normal, d1, d2);
 
-		glm::vec3 fresnel_reflect = F * trace_ray(lights, ambient_light, objects, Ray(hit.intersection + reflect_direction * 0.001f, reflect_direction), maxDepth - 1, bbox);
-		glm::vec3 fresnel_refract = (1 - F) * trace_ray(lights, ambient_light, objects, Ray(hit.intersection + refract_direction * 0.001f, refract_direction), maxDepth - 1, bbox);
+	float reflection = materials.reflection[m], refraction = materials.refraction[m];
+	bool reflects = current.depth >= 0 && reflection > 0;
+	bool refracts = current.depth >= 0 && !reflects && refraction > 0;
+	if (!reflects && !refracts) return current.weight;
 
-		refract = fresnel_reflect + fresnel_refract;
-		return refract;
+	glm::vec3 reflect_direction = glm::reflect(r.direction, hit.normal);
+	glm::vec3 reflect_origin = hit.intersection + reflect_direction * 0.001f;
+	if (reflects) {
+		push(reflect_origin, reflect_direction, current.weight * reflection, current.depth - 1);
+		return current.weight * (1 - reflection);
 	}
+	// the color of a refractive surface only comes from the rays it spawns
+	float d1 = inside ? refraction : 1.0f;
+	float d2 = inside ? 1.0f : refraction;
+	glm::vec3 refract_direction = glm::refract(r.direction, hit.normal, d1 / d2);
+	float F = fresnel_factor(reflect_direction, refract_direction, hit.normal, d1, d2);
+	push(hit.intersection + refract_direction * 0.001f, refract_direction, current.weight * (1 - F), current.depth - 1);
+	push(reflect_origin, reflect_direction, current.weight * F, current.depth - 1);
+	return glm::vec3(0.0);
+}
+
+/**
+ Index in the material table of the material at a hit: the material of the triangle which is hit, or else that of
+ the object, which must have been registered in the table (see Object::registerMaterials).
+ */
+uint16_t material_index(const Hit &hit) {
+	uint16_t m = hit.materialId != MaterialTable::none ? hit.materialId : hit.object->materialId;
+	assert(m != MaterialTable::none && "the object was not registered in the material table");
+	return m;
+}
+
+/**
+ Width of the footprint of a pixel on the texture at a hit, see Texture::sample. It widens at grazing angles.
+ @param width width of the footprint of the pixel in space at the hit
+ */
+float texture_footprint(const Hit &hit, const Ray &ray, float width) {
+	float cosine = std::max(std::abs(glm::dot(hit.normal, ray.direction)), 0.1f);
+	return width * hit.uvDensity / cosine;
+}
+
+/**
+ Computes the color along a ray. The reflected and refracted rays are traced iteratively, depth first, from a
+ small fixed-size stack of pending rays with their weights instead of recursively, so that no memory is
+ allocated and the rays are shaded in a single loop. Rays whose weight is too small to matter are pruned
+ according to settings.
+ @param materials the material table of the scene, in which all the objects are registered
+ @param seed seed of the Russian roulette, which should differ between pixels
+ @param rayCount if not null, incremented by the number of rays traced
+ @return Color at the intersection point
+ */
+glm::vec3 trace_ray(const vector<Light *> &lights,
+					const glm::vec3 &ambient_light,
+					const vector<Object *> &objects,
+					const MaterialTable &materials,
+					const Ray &ray,
+					const BoundingBox &bbox,
+					const TraceSettings &settings,
+					uint32_t seed = 0,
+					int *rayCount = nullptr) {
+	// every traced ray pushes at most two rays of the next depth, so the stack holds at most one ray per depth
+	// besides the two most recent ones
+	const int capacity = 32;
+	PendingRay stack[capacity];
+	int size = 0;
+	stack[size++] = {ray.origin, ray.direction, glm::vec3(1.0), min(settings.maxDepth, capacity - 3)};
+	glm::vec3 color(0.0);
+	uint32_t random = seed;
+	float width = 0; // of the footprint of the pixel at the current hit, where the pushed rays start
+	auto push = [&](const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 weight, int depth) {
+		if (survives(weight, settings, random)) stack[size++] = {origin, direction, weight, depth, 0, width};
+	};
 
-	return phong;
+	int traced = 0;
+	for (; size > 0 && traced < settings.rayBudget; traced++) {
+		const PendingRay current = stack[--size];
+		Ray r(current.origin, current.direction);
+		Hit hit = closest_hit(objects, r, bbox);
+		if (!hit.hit) continue;
+
+		uint16_t m = material_index(hit);
+		width = current.cone + settings.pixelSpread * hit.distance;
+		glm::vec3 weight = spawn_rays(materials, current, r, hit, m, push);
+		if (weight == glm::vec3(0.0)) continue;
+		color += weight * PhongModel(lights, ambient_light, objects, hit.intersection, hit.normal, hit.uv, glm::normalize(-r.direction), materials, m, bbox,
+									 texture_footprint(hit, r, width), settings.shadows, settings.lightSampling);
+	}
+	if (rayCount) *rayCount += traced;
+	return color;
 }
 /**
  Functions that computes a color along the ray
@@ -162,10 +493,244 @@ glm::vec3 trace_ray(const vector<Light *> &lights,
 glm::vec3 trace_ray(const vector<Light *> &lights, 
 					const glm::vec3 &ambient_light, 
 					const vector<Object *> &objects,
+					const MaterialTable &materials,
 					const Ray &ray,
 					const BoundingBox &bbox) {
-	return trace_ray(lights, ambient_light, objects, ray, 5, bbox);
+	return trace_ray(lights, ambient_light, objects, materials, ray, bbox, TraceSettings());
+}
+
+/**
+ Computes the colors along several rays, like trace_ray for each of them, but shades the hits by batches (see
+ shade_batch) instead of one at a time. The trees of rays are traced one after the other from a shared stack, the
+ primary rays waiting at its bottom, and the hits to shade are gathered until the batch is full.
+ @param rays the rays, at most ShadingBatch::size of them
+ @param seed seed of the Russian roulette of the first ray, incremented for each of the following ones
+ @param colors receives the color along each ray
+ @param rayCount if not null, incremented by the number of rays traced
+ @param hits if not null, the closest hits of the rays, already found, see trace_tile
+ @param primaryLights if not null, the lights shading the hits of the rays themselves, those of the reflected and
+ refracted rays being shaded by all the lights
+ */
+void trace_rays(const vector<Light *> &lights,
+				const glm::vec3 &ambient_light,
+				const vector<Object *> &objects,
+				const MaterialTable &materials,
+				const Ray *rays,
+				int count,
+				const BoundingBox &bbox,
+				const TraceSettings &settings,
+				glm::vec3 *colors,
+				uint32_t seed = 0,
+				int *rayCount = nullptr,
+				const Hit *hits = nullptr,
+				const vector<Light *> *primaryLights = nullptr) {
+	const int tree = 32; // stack of a single tree, see trace_ray
+	const int primary = min(settings.maxDepth, tree - 3); // depth of the primary rays, whose children have less
+	PendingRay stack[tree + ShadingBatch::size];
+	int size = 0;
+	int traced[ShadingBatch::size];
+	uint32_t random[ShadingBatch::size];
+	for (int k = count - 1; k >= 0; k--) {
+		stack[size++] = {rays[k].origin, rays[k].direction, glm::vec3(1.0), primary, k};
+		colors[k] = glm::vec3(0.0);
+		traced[k] = 0;
+		random[k] = seed + k;
+	}
+
+	// the hits shaded by all the lights, and the primary hits shaded by primaryLights
+	ShadingBatch batches[2];
+	glm::vec3 weights[2][ShadingBatch::size]; // weight of each hit of the batch in its pixel
+	int pixels[2][ShadingBatch::size];
+	auto flush = [&](int b) {
+		ShadingBatch &batch = batches[b];
+		shade_batch(batch, b ? *primaryLights : lights, objects, bbox, settings.shadows, settings.lightSampling);
+		for (int i = 0; i < batch.count; i++) colors[pixels[b][i]] += weights[b][i] * batch.color(i, ambient_light);
+		batch.clear();
+	};
+
+	while (size > 0) {
+		const PendingRay current = stack[--size];
+		int k = current.pixel;
+		if (traced[k] >= settings.rayBudget) continue;
+		traced[k]++;
+		Ray r(current.origin, current.direction);
+		bool first = current.depth == primary;
+		Hit hit = hits && first ? hits[k] : closest_hit(objects, r, bbox);
+		if (!hit.hit) continue;
+
+		uint16_t m = material_index(hit);
+		float width = current.cone + settings.pixelSpread * hit.distance;
+		auto push = [&](const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 weight, int depth) {
+			if (survives(weight, settings, random[k])) stack[size++] = {origin, direction, weight, depth, k, width};
+		};
+		glm::vec3 weight = spawn_rays(materials, current, r, hit, m, push);
+		if (weight == glm::vec3(0.0)) continue;
+		int b = first && primaryLights ? 1 : 0;
+		ShadingBatch &batch = batches[b];
+		weights[b][batch.count] = weight;
+		pixels[b][batch.count] = k;
+		batch.add(hit.intersection, hit.normal, glm::normalize(-r.direction), materials, m, hit.uv, texture_footprint(hit, r, width));
+		if (batch.count == ShadingBatch::size) flush(b);
+	}
+	for (int b = 0; b < 2; b++) {
+		if (batches[b].count > 0) flush(b);
+	}
+	if (rayCount) for (int k = 0; k < count; k++) *rayCount += traced[k];
+}
+
+/**
+ Computes the colors along the primary rays of a tile of the image, like trace_rays for each group of
+ ShadingBatch::size rays of its rows, but only the lights which can reach the tile shade its primary hits. These
+ hits are found first, and the lights whose influence sphere (see set_influence_radii) misses the box bounding them
+ are culled, with their shadow rays. The hits of the reflected and refracted rays, which may lie anywhere, are
+ shaded by all the lights within their influence radius.
+ @param rays the primary rays of the tile, row by row
+ @param columns number of rays in a row
+ @param rows number of rows
+ @param colors receives the color along each ray
+ @param seed seed of the Russian roulette of the first ray, see trace_rays; the one of the ray i of the row j is
+ seed + j * stride + i
+ @param rayCount if not null, incremented by the number of rays traced
+ @param shaded if not null, receives the number of lights shading the primary hits
+ */
+void trace_tile(const vector<Light *> &lights,
+				const glm::vec3 &ambient_light,
+				const vector<Object *> &objects,
+				const MaterialTable &materials,
+				const Ray *rays,
+				int columns,
+				int rows,
+				const BoundingBox &bbox,
+				const TraceSettings &settings,
+				glm::vec3 *colors,
+				uint32_t seed,
+				uint32_t stride,
+				int *rayCount = nullptr,
+				int *shaded = nullptr) {
+	vector<Hit> hits(columns * rows);
+	glm::vec3 lo(INFINITY), hi(-INFINITY);
+	for (size_t k = 0; k < hits.size(); k++) {
+		hits[k] = closest_hit(objects, rays[k], bbox);
+		if (!hits[k].hit) continue;
+		lo = glm::min(lo, hits[k].intersection);
+		hi = glm::max(hi, hits[k].intersection);
+	}
+	vector<Light *> tileLights;
+	if (lo.x <= hi.x) {
+		for (Light *light : lights) {
+			if (influences(*light, lo, hi)) tileLights.push_back(light);
+		}
+	}
+	if (shaded) *shaded = (int)tileLights.size();
+	// the sampled lights are drawn from the whole tree, so that they are not culled per tile
+	const vector<Light *> *primaryLights = settings.lightSampling.tree ? nullptr : &tileLights;
+	for (int j = 0; j < rows; j++) {
+		for (int i = 0; i < columns; i += ShadingBatch::size) {
+			int n = min(ShadingBatch::size, columns - i), k = j * columns + i;
+			trace_rays(lights, ambient_light, objects, materials, rays + k, n, bbox, settings, colors + k,
+					   seed + j * stride + i, rayCount, hits.data() + k, primaryLights);
+		}
+	}
+}
+
+
+/** Direction drawn at random around the normal, with a density proportional to the cosine between them. */
+glm::vec3 cosine_direction(const glm::vec3 &normal, uint32_t &random) {
+	glm::vec3 u = glm::normalize(glm::cross(std::abs(normal.x) > 0.5f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), normal));
+	glm::vec3 v = glm::cross(normal, u);
+	// uniform point of the unit disk, lifted onto the hemisphere
+	float a = random_float(random), phi = 2 * (float)M_PI * random_float(random);
+	float r = std::sqrt(a);
+	return r * std::cos(phi) * u + r * std::sin(phi) * v + std::sqrt(1 - a) * normal;
+}
+
+/**
+ Features of the surface at a hit.
+ @param width width of the footprint of the pixel at the hit, which filters the textures, see texture_footprint
+ */
+Features surface_features(const MaterialTable &materials, const Hit &hit, const Ray &ray, float width) {
+	uint16_t m = material_index(hit);
+	return {materials.diffuseColor(m, hit.uv, texture_footprint(hit, ray, width)), hit.normal, hit.distance};
 }
 
+/**
+ Computes one sample of the color along a ray by path tracing. Instead of the whole tree of rays of trace_ray, a
+ single path is followed, which continues at each hit along one of the reflected and refracted rays of the material
+ or along a diffuse bounce, chosen at random in proportion to their weights; the path ends with the probability
+ that their total weight is below 1 (a Russian roulette), and otherwise the weight of the chosen ray is divided by
+ its probability, so that the average of the samples is the color with every ray traced. The diffuse bounces,
+ towards directions drawn in proportion to the cosine with the normal (cosine_direction), bring the light reflected
+ by the other surfaces, which replaces the ambient term of the Phong model; the lights are shaded at every hit as
+ by PhongModel.
+ @param random state of the generator of the path, which should differ between samples
+ @param rayCount if not null, incremented by the number of rays traced, without the shadow rays
+ @param features if not null, set to the features of the first hit of the path, or of the surface seen in the
+ mirrors which it hits first, with its distance along the path; it is left unchanged if there is no hit
+ @return Color sample at the intersection point
+ */
+glm::vec3 trace_path(const vector<Light *> &lights,
+					 const vector<Object *> &objects,
+					 const MaterialTable &materials,
+					 const Ray &ray,
+					 const BoundingBox &bbox,
+					 const TraceSettings &settings,
+					 uint32_t &random,
+					 int *rayCount = nullptr,
+					 Features *features = nullptr) {
+	PendingRay current = {ray.origin, ray.direction, glm::vec3(1.0), min(settings.maxDepth, 29)};
+	glm::vec3 color(0.0);
+	PendingRay next[3]; // the rays which may continue the path at a hit, the diffuse bounce last
+	int count = 0;
+	float width = 0; // of the footprint of the pixel at the current hit, where the next rays start
+	float distance = 0; // along the path to the current hit
+	bool seen = false; // whether the features have been taken at a surface which is not a mirror
+	auto push = [&](const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 weight, int depth) {
+		next[count++] = {origin, direction, weight, depth, 0, width};
+	};
+
+	int traced = 0;
+	while (traced < settings.rayBudget) {
+		Ray r(current.origin, current.direction);
+		traced++;
+		Hit hit = closest_hit(objects, r, bbox);
+		if (!hit.hit) break;
+
+		uint16_t m = material_index(hit);
+		width = current.cone + settings.pixelSpread * hit.distance;
+		distance += hit.distance;
+		if (features && !seen) {
+			*features = surface_features(materials, hit, r, width);
+			features->depth = distance;
+			seen = materials.refraction[m] > 0 || materials.reflection[m] < 0.5f;
+		}
+		count = 0;
+		glm::vec3 weight = spawn_rays(materials, current, r, hit, m, push);
+		if (weight != glm::vec3(0.0)) {
+			float footprint = texture_footprint(hit, r, width);
+			color += weight * PhongModel(lights, glm::vec3(0.0), objects, hit.intersection, hit.normal, hit.uv, glm::normalize(-r.direction), materials, m, bbox,
+										 footprint, settings.shadows, settings.lightSampling);
+			if (current.depth >= 0) {
+				glm::vec3 direction = cosine_direction(hit.normal, random);
+				push(hit.intersection + hit.normal * 0.001f, direction, weight * materials.diffuseColor(m, hit.uv, footprint), current.depth - 1);
+			}
+		}
+
+		float largest[3], total = 0;
+		for (int i = 0; i < count; i++) {
+			largest[i] = max(next[i].weight.x, max(next[i].weight.y, next[i].weight.z));
+			total += largest[i];
+		}
+		if (total <= 0) break;
+		float scale = max(total, 1.0f); // the path ends with probability 1 - total
+		float u = random_float(random) * scale;
+		int chosen = 0;
+		while (chosen < count && u >= largest[chosen]) u -= largest[chosen++];
+		if (chosen == count) break;
+		current = next[chosen];
+		current.weight *= scale / largest[chosen];
+	}
+	if (rayCount) *rayCount += traced;
+	return color;
+}
 
-#endif
\ No newline at end of file
+#endif
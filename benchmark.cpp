@@ -0,0 +1,1175 @@
+/**
+@file benchmark.cpp
+Benchmarks of the bounding box hierarchy on the models in models/.
+Run from the root of the repository, optionally passing the .obj files to use.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include "glm/glm.hpp"
+#include "glm/gtx/transform.hpp"
+
+#include "thread_pool.hpp"
+#include "CPU.hpp"
+#include "Triangle.hpp"
+#include "TrianglePacket.hpp"
+#include "Sphere.hpp"
+#include "Plane.hpp"
+#include "Light.hpp"
+#include "LightTree.hpp"
+#include "OBJ.hpp"
+#include "MeshCache.hpp"
+#include "PLY.hpp"
+#include "Ray.hpp"
+#include "Hit.hpp"
+#include "BoundingBox.hpp"
+#include "ClusteredMesh.hpp"
+#include "Scene.hpp"
+#include "Texture.hpp"
+#include "Procedural.hpp"
+#include "Accumulation.hpp"
+#include "Film.hpp"
+#include "Denoiser.hpp"
+
+using namespace std;
+
+const int width = 512; ///< width of the benchmark camera
+const int height = 384; ///< height of the benchmark camera
+const float fov = 90; ///< field of view of the benchmark camera
+const int repetitions = 3; ///< the fastest of these runs is reported
+
+/**
+ Computes a transformation placing the model in front of the camera, filling most of its view.
+ */
+glm::mat4 fitTransformation(const Model &model) {
+	glm::vec3 lo, hi;
+	model.bounds(lo, hi);
+	float extent = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+	float scale = 8.0f / extent;
+	return glm::translate(glm::vec3(0, 0, 10)) * glm::scale(glm::vec3(scale)) * glm::translate(-(lo + hi) / 2.0f);
+}
+
+/** Pinhole camera at the origin looking along z, whose image plane is at distance 1, like the one of main.cpp. */
+struct Camera {
+	float s; ///< Size of a pixel on the image plane
+	float X, Y; ///< Top left corner of the image on the image plane
+
+	/** Ray through the point (x, y) of the image, in pixels from its top left corner. */
+	[[nodiscard]] Ray operator()(float x, float y) const {
+		return Ray(glm::vec3(0), glm::normalize(glm::vec3(X + x*s, Y - y*s, 1)));
+	}
+
+	/** Ray through a random point of the pixel (i, j), like the paths of main.cpp, see random_float. */
+	[[nodiscard]] Ray jittered(int i, int j, uint32_t &random) const {
+		float x = i + random_float(random), y = j + random_float(random);
+		return (*this)(x, y);
+	}
+};
+
+/** Camera of the field of view of main.cpp for an image of the given size. */
+Camera makeCamera(int columns, int rows) {
+	float s = 2*tan(0.5*fov/180*M_PI)/columns;
+	return {s, -s * columns / 2, s * rows / 2};
+}
+
+/**
+ Root mean square of the differences of the channels of the pixels of two images of the same size, in 8-bit levels
+ of their values in [0,1].
+ */
+double rmse(const vector<glm::vec3> &image, const vector<glm::vec3> &reference) {
+	double squared = 0;
+	for (size_t i = 0; i < image.size(); i++) {
+		glm::vec3 d = 255.0f * (image[i] - reference[i]);
+		squared += glm::dot(d, d) / 3;
+	}
+	return sqrt(squared / std::max<size_t>(image.size(), 1));
+}
+
+/** Tone mapped colors of the pixels of a film, row by row. */
+vector<glm::vec3> filmImage(const Film &film) {
+	vector<glm::vec3> image;
+	for (int j = 0; j < film.height; j++) {
+		for (int i = 0; i < film.width; i++) image.push_back(toneMapping(film.pixel(i, j)));
+	}
+	return image;
+}
+
+/** Traces the tiles of samples of render_adaptive and render_supersampled through the scene, see trace_tile. */
+auto tileTracer(const TraceSettings &settings, const BoundingBox &bbox) {
+	return [&settings, &bbox](const Ray *rays, int columns, int rows, glm::vec3 *colors, uint32_t seed, uint32_t stride) {
+		trace_tile(lights, ambient_light, objects, materials, rays, columns, rows, bbox, settings, colors, seed, stride);
+	};
+}
+
+/**
+ Generates the primary rays of the camera, in the same way main.cpp does.
+ */
+vector<Ray> cameraRays() {
+	vector<Ray> rays;
+	Camera camera = makeCamera(width, height);
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) rays.push_back(camera(i + 0.5f, j + 0.5f));
+	}
+	return rays;
+}
+
+/**
+ Traces all the rays through the hierarchy on a single thread.
+ @return the time of the fastest repetition in milliseconds
+ */
+double traceAll(const BoundingBox &bbox, const vector<Ray> &rays, vector<Hit> &hits) {
+	double best = FLOAT_INFINITY;
+	hits.resize(rays.size());
+	for (int r = 0; r < repetitions; r++) {
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i++) hits[i] = bbox.trace_ray(rays[i]);
+		tm.stop();
+		best = std::min(best, (double)std::max<int_fast64_t>(tm.ms(), 1));
+	}
+	return best;
+}
+
+/**
+ Counts the rays whose hit differs from the reference by more than a small tolerance.
+ */
+int mismatches(const vector<Hit> &hits, const vector<Hit> &reference) {
+	int count = 0;
+	for (size_t i = 0; i < hits.size(); i++) {
+		if (hits[i].hit != reference[i].hit) count++;
+		else if (hits[i].hit && fabs(hits[i].distance - reference[i].distance) > 1e-3f * reference[i].distance) count++;
+	}
+	return count;
+}
+
+/**
+ Compares the triangle layouts of the hierarchy in terms of build time, memory and tracing speed.
+ */
+void benchmarkStorage(const string &path, const vector<Ray> &rays) {
+	Model model = OBJ::read(path);
+	if (!model.good || model.size() == 0) return;
+	model.setTransformation(fitTransformation(model));
+	cout << model << endl;
+	// memory of the same mesh expanded into Triangle objects, each with its own copy of the vertices
+	size_t expanded = model.size() * sizeof(Triangle);
+	cout << "  geometry " << model.memory() / 1024 << " KB (" << model.memory() / model.size() << " B/triangle)"
+		 << ", " << expanded / 1024 << " KB as Triangle objects" << endl;
+
+	const pair<TriangleStorage, const char *> storages[] = {
+		{TriangleStorage::VERTICES, "vertices"},
+		{TriangleStorage::TRANSFORM, "transform"},
+		{TriangleStorage::PACKET, "packet"},
+	};
+	vector<Hit> reference, hits;
+	for (auto &[storage, name] : storages) {
+		timer build;
+		build.start();
+		BoundingBox bbox(model, storage);
+		build.stop();
+		bool isReference = reference.empty();
+		double ms = traceAll(bbox, rays, isReference ? reference : hits);
+		int hitCount = 0;
+		for (auto &h : (isReference ? reference : hits)) hitCount += h.hit;
+		cout << "  " << setw(10) << left << name << right
+			 << " build " << setw(6) << build.ms() << " ms"
+			 << " | hierarchy " << setw(8) << bbox.memory() / 1024 << " KB"
+			 << " (" << bbox.memory() / bbox.count() << " B/triangle)"
+			 << " | " << setw(7) << fixed << setprecision(3) << rays.size() / ms / 1000.0 << " Mrays/s"
+			 << " | depth " << setw(2) << bbox.depth()
+			 << " | hits " << hitCount;
+		if (!isReference) cout << " | mismatches " << mismatches(hits, reference);
+		cout << endl;
+	}
+}
+
+/**
+ Compares the compressed geometry of the model with the float one, both traced with the vertex layout
+ which reads the geometry of the model during the traversal. The accuracy is measured on the hits of the
+ camera rays: distance between the hit points, relative to the size of the model, and angle between the normals.
+ */
+void benchmarkCompression(const string &path, const vector<Ray> &rays) {
+	Model model = OBJ::read(path);
+	if (!model.good || model.size() == 0) return;
+	model.setTransformation(fitTransformation(model));
+	Model compressed = model;
+	compressed.compress();
+	cout << compressed << endl;
+
+	glm::vec3 lo, hi;
+	model.bounds(lo, hi);
+	float extent = glm::length(hi - lo);
+	vector<Hit> reference, hits;
+	BoundingBox bbox(model, TriangleStorage::VERTICES);
+	double ms = traceAll(bbox, rays, reference);
+	BoundingBox compressedBox(compressed, TriangleStorage::VERTICES);
+	double compressedMs = traceAll(compressedBox, rays, hits);
+
+	// errors in the coordinate system of the model, where the hit points are compared; the largest ones come
+	// from rays grazing an edge which hit another triangle, so the 99th percentile is reported along the mean
+	vector<float> positions, angles;
+	glm::mat4 toModel = model.inverseTransformationMatrix;
+	for (size_t i = 0; i < rays.size(); i++) {
+		if (!hits[i].hit || !reference[i].hit) continue;
+		glm::vec3 a = toModel * glm::vec4(reference[i].intersection, 1.0);
+		glm::vec3 b = toModel * glm::vec4(hits[i].intersection, 1.0);
+		positions.push_back(glm::length(a - b) / extent);
+		angles.push_back(glm::degrees(acos(std::clamp(glm::dot(reference[i].normal, hits[i].normal), -1.0f, 1.0f))));
+	}
+	auto mean = [](const vector<float> &x) {
+		double sum = 0;
+		for (float f : x) sum += f;
+		return x.empty() ? 0.0 : sum / x.size();
+	};
+	auto percentile99 = [](vector<float> x) {
+		if (x.empty()) return 0.0f;
+		auto p = x.begin() + (x.size() - 1) * 99 / 100;
+		nth_element(x.begin(), p, x.end());
+		return *p;
+	};
+	cout << "  float      geometry " << setw(6) << model.memory() / 1024 << " KB"
+		 << " | " << setw(7) << fixed << setprecision(3) << rays.size() / ms / 1000.0 << " Mrays/s" << endl;
+	cout << "  compressed geometry " << setw(6) << compressed.memory() / 1024 << " KB"
+		 << " | " << setw(7) << rays.size() / compressedMs / 1000.0 << " Mrays/s"
+		 << " | mismatches " << mismatches(hits, reference) << endl;
+	cout << "  position error (fraction of the diagonal) " << scientific << setprecision(2)
+		 << mean(positions) << " mean, " << percentile99(positions) << " 99th percentile"
+		 << ", quantization bound " << compressed.quantization.maxError() / extent << endl;
+	cout << "  normal error " << fixed << setprecision(4)
+		 << mean(angles) << " deg mean, " << percentile99(angles) << " deg 99th percentile" << endl;
+}
+
+/**
+ Traces the model out of core, split into clusters of 512 triangles, with decreasing memory budgets: enough
+ for all the clusters, then half and a quarter of it. The rays are traced in scanline order, like main.cpp does.
+ */
+void benchmarkOutOfCore(const string &path, const vector<Ray> &rays) {
+	Model model = OBJ::read(path);
+	if (!model.good || model.size() == 0) return;
+	glm::mat4 transformation = fitTransformation(model);
+	model.setTransformation(transformation);
+	BoundingBox bbox(model);
+	vector<Hit> reference, hits(rays.size());
+	traceAll(bbox, rays, reference);
+
+	string clustersPath = (filesystem::temp_directory_path() / (filesystem::path(path).filename().string() + ".clusters")).string();
+	if (!ClusteredMesh::write(model, clustersPath, 512)) return;
+	size_t total = 0;
+	for (int fraction : {1, 2, 4}) {
+		ClusteredMesh mesh(clustersPath, fraction == 1 ? SIZE_MAX : total / fraction);
+		if (!mesh.good) return;
+		mesh.setTransformation(transformation);
+		if (fraction == 1) cout << model.name << ": " << mesh.clusters() << " clusters" << endl;
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i++) hits[i] = mesh.intersect(rays[i]);
+		tm.stop();
+		auto stats = mesh.statistics();
+		if (fraction == 1) total = stats.peakBytes;
+		cout << "  budget " << setw(8) << (fraction == 1 ? string("all") : "1/" + to_string(fraction))
+			 << " " << setw(7) << fixed << setprecision(3) << rays.size() / std::max<double>(tm.ms(), 1) / 1000.0 << " Mrays/s"
+			 << " | loads " << setw(7) << stats.loads << " | evictions " << setw(7) << stats.evictions
+			 << " | peak " << setw(6) << stats.peakBytes / 1024 << " KB"
+			 << " | mismatches " << mismatches(hits, reference) << endl;
+	}
+	filesystem::remove(clustersPath);
+}
+
+/**
+ Writes an OBJ file of a wavy grid of n by n vertices, to measure loading on a large file.
+ @param quads if true, the grid is made of quads with texture coordinates and without normals, which are
+ generated when it is loaded; otherwise of triangles with normals
+ */
+void writeGrid(const string &path, int n, bool quads = false) {
+	ofstream file(path);
+	file << "o Grid" << endl << setprecision(6);
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			float x = (float)i / n, y = (float)j / n;
+			file << "v " << x << " " << y << " " << 0.1f * sin(20 * x) * cos(20 * y) << "\n";
+		}
+	}
+	if (quads) {
+		for (int j = 0; j < n; j++) {
+			for (int i = 0; i < n; i++) file << "vt " << (float)i / n << " " << (float)j / n << "\n";
+		}
+		for (int j = 0; j + 1 < n; j++) {
+			for (int i = 0; i + 1 < n; i++) {
+				int a = j * n + i + 1, b = a + 1, c = a + n, d = c + 1;
+				file << "f " << a << "/" << a << " " << b << "/" << b << " " << d << "/" << d << " " << c << "/" << c << "\n";
+			}
+		}
+		return;
+	}
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			float x = (float)i / n, y = (float)j / n;
+			glm::vec3 normal = glm::normalize(glm::vec3(-2 * cos(20 * x) * cos(20 * y), 2 * sin(20 * x) * sin(20 * y), 1));
+			file << "vn " << normal.x << " " << normal.y << " " << normal.z << "\n";
+		}
+	}
+	for (int j = 0; j + 1 < n; j++) {
+		for (int i = 0; i + 1 < n; i++) {
+			int a = j * n + i + 1, b = a + 1, c = a + n, d = c + 1;
+			file << "f " << a << "//" << a << " " << b << "//" << b << " " << d << "//" << d << "\n";
+			file << "f " << a << "//" << a << " " << d << "//" << d << " " << c << "//" << c << "\n";
+		}
+	}
+}
+
+/**
+ Measures the loading speed of OBJ files, in MB of text per second: parsed serially, parsed with the threads of
+ the pool, and loaded from the binary cache (see MeshCache), which is written next to the files.
+ */
+void benchmarkLoading(const vector<string> &paths) {
+	thread_pool pool;
+	for (auto &path : paths) {
+		MeshCache::read(path); // writes the cache if needed
+		double best[3] = {FLOAT_INFINITY, FLOAT_INFINITY, FLOAT_INFINITY};
+		size_t triangles = 0;
+		bool identical = true;
+		for (int r = 0; r < repetitions; r++) {
+			timer tm[3];
+			tm[0].start();
+			Model a = OBJ::read(path);
+			tm[0].stop();
+			tm[1].start();
+			Model b = OBJ::read(path, &pool);
+			tm[1].stop();
+			tm[2].start();
+			Model c = MeshCache::read(path);
+			tm[2].stop();
+			triangles = a.size();
+			for (const Model *m : {&b, &c}) {
+				identical = identical && a.name == m->name && a.vertices == m->vertices && a.normals == m->normals
+					&& a.texcoords == m->texcoords && a.vertexIndices == m->vertexIndices && a.normalIndices == m->normalIndices
+					&& a.texcoordIndices == m->texcoordIndices;
+			}
+			for (int i = 0; i < 3; i++) best[i] = std::min(best[i], (double)std::max<int_fast64_t>(tm[i].ms(), 1));
+		}
+		double mb = filesystem::file_size(path) / 1e6;
+		cout << "  " << setw(24) << left << filesystem::path(path).filename().string() << right
+			 << setw(8) << fixed << setprecision(1) << mb << " MB " << setw(8) << triangles << " triangles";
+		const string names[] = {"serial", to_string(pool.get_thread_count()) + " threads", "cache"};
+		for (int i = 0; i < 3; i++) {
+			cout << " | " << names[i] << " " << setw(5) << (long)best[i] << " ms " << setw(7) << mb / best[i] * 1000 << " MB/s";
+		}
+		cout << (identical ? "" : " | DIFFERENT") << endl;
+	}
+}
+
+/**
+ Measures the loading speed of binary PLY files against the OBJ text of the same meshes, which are converted
+ with PLY::write in both byte orders. The meshes read back must have the same triangles.
+ */
+void benchmarkPLY(const vector<string> &paths) {
+	thread_pool pool;
+	for (auto &path : paths) {
+		Model obj = OBJ::read(path, &pool);
+		string ply[2];
+		for (int bigEndian = 0; bigEndian < 2; bigEndian++) {
+			ply[bigEndian] = (filesystem::temp_directory_path() / (filesystem::path(path).stem().string() + (bigEndian ? "_be.ply" : "_le.ply"))).string();
+			PLY::write(obj, ply[bigEndian], bigEndian);
+		}
+		double best[3] = {FLOAT_INFINITY, FLOAT_INFINITY, FLOAT_INFINITY};
+		bool identical = true;
+		for (int r = 0; r < repetitions; r++) {
+			timer tm[3];
+			tm[0].start();
+			Model a = OBJ::read(path, &pool);
+			tm[0].stop();
+			for (int bigEndian = 0; bigEndian < 2; bigEndian++) {
+				tm[1 + bigEndian].start();
+				Model b = PLY::read(ply[bigEndian], &pool);
+				tm[1 + bigEndian].stop();
+				identical = identical && b.good && a.size() == b.size();
+				for (size_t i = 0; i < a.size() && identical; i++) {
+					for (int k = 0; k < 3; k++) identical = identical && a.vertex(i, k) == b.vertex(i, k) && a.normal(i, k) == b.normal(i, k);
+				}
+			}
+			for (int i = 0; i < 3; i++) best[i] = std::min(best[i], (double)std::max<int_fast64_t>(tm[i].ms(), 1));
+		}
+		cout << "  " << setw(24) << left << filesystem::path(path).filename().string() << right << " OBJ " << fixed << setprecision(1)
+			 << setw(6) << filesystem::file_size(path) / 1e6 << " MB " << setw(5) << (long)best[0] << " ms | PLY "
+			 << setw(6) << filesystem::file_size(ply[0]) / 1e6 << " MB, little endian " << setw(5) << (long)best[1] << " ms, big endian "
+			 << setw(5) << (long)best[2] << " ms" << (identical ? "" : " | DIFFERENT") << endl;
+		for (auto &p : ply) filesystem::remove(p);
+	}
+}
+
+/**
+ Compares the variants of the box and triangle kernels, for every instruction set supported by the CPU.
+ */
+void benchmarkKernels(const string &path, const vector<Ray> &rays) {
+	Model model = OBJ::read(path);
+	if (!model.good || model.size() == 0) return;
+	model.setTransformation(fitTransformation(model));
+	BoundingBox bbox(model, TriangleStorage::PACKET);
+	cout << model << endl;
+
+	vector<Hit> reference, hits;
+	for (int i = 0; i <= (int)CPU::detect(); i++) {
+		CPU::ISA isa = CPU::ISA(i);
+		selectKernels(isa);
+		bool isReference = reference.empty();
+		double ms = traceAll(bbox, rays, isReference ? reference : hits);
+		cout << "  " << setw(10) << left << CPU::name(isa) << right
+			 << " " << setw(7) << fixed << setprecision(3) << rays.size() / ms / 1000.0 << " Mrays/s";
+		if (!isReference) cout << " | mismatches " << mismatches(hits, reference);
+		cout << endl;
+	}
+}
+
+/**
+ Compares the variants of the sphere and shading kernels on a synthetic scene of 64 spheres and 16 lights.
+ */
+void benchmarkSpheresAndLights(const vector<Ray> &rays) {
+	SphereSet spheres;
+	LightTerms terms;
+	for (int i = 0; i < 64; i++) {
+		spheres.add(new Sphere(0.3f, glm::vec3(i % 8 - 3.5f, i / 8 - 3.5f, 10.0f + (i % 3)), glm::vec3(1)));
+	}
+	for (int i = 0; i < LightTerms::size; i++) {
+		terms.px[i] = (float)(i % 4) * 3 - 4.5f;
+		terms.py[i] = 10;
+		terms.pz[i] = (float)(i / 4) * 3;
+	}
+	cout << "SphereSet (64 spheres) and LightTerms (16 lights)" << endl;
+	for (int i = 0; i <= (int)CPU::detect(); i++) {
+		CPU::ISA isa = CPU::ISA(i);
+		selectKernels(isa);
+		timer sphereTime, lightTime;
+		int hitCount = 0;
+		float checksum = 0;
+		sphereTime.start();
+		for (auto &ray : rays) hitCount += spheres.intersect(ray).hit;
+		sphereTime.stop();
+		lightTime.start();
+		for (auto &ray : rays) {
+			terms.compute(LightTerms::size, ray.direction * 10.0f, -ray.direction, -ray.direction);
+			checksum += terms.NdotL[0] + terms.VdotR[LightTerms::size - 1];
+		}
+		lightTime.stop();
+		cout << "  " << setw(10) << left << CPU::name(isa) << right
+			 << " spheres " << setw(7) << fixed << setprecision(3) << rays.size() / std::max<double>(sphereTime.ms(), 1) / 1000.0 << " Mrays/s"
+			 << " (hits " << hitCount << ")"
+			 << " | lights " << setw(7) << rays.size() / std::max<double>(lightTime.ms(), 1) / 1000.0 << " Mpoints/s"
+			 << " (checksum " << setprecision(1) << checksum << ")" << endl;
+	}
+}
+
+/**
+ Renders the scene of main.cpp without the model, whose glass sphere spawns a reflected and a refracted ray at
+ every bounce, with several pruning settings of the tree of rays (see TraceSettings). The number of rays and the
+ error of the tone mapped image, in 8-bit levels, are compared with the full tree.
+ */
+void benchmarkPruning(const vector<Ray> &rays) {
+	sceneDefinition();
+	for (auto object : objects) object->registerMaterials(materials);
+	BoundingBox empty;
+	auto render = [&rays, &empty](const TraceSettings &settings, vector<glm::vec3> &image, vector<int> &counts, double &ms) {
+		image.resize(rays.size());
+		counts.assign(rays.size(), 0);
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i++) {
+			image[i] = toneMapping(trace_ray(lights, ambient_light, objects, materials, rays[i], empty, settings, (uint32_t)i, &counts[i]));
+		}
+		tm.stop();
+		ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+	};
+	vector<glm::vec3> reference, image;
+	vector<int> counts;
+	double ms;
+	render(TraceSettings(), reference, counts, ms);
+	struct Variant {
+		string name;
+		float minWeight;
+		bool russianRoulette;
+	};
+	const Variant variants[] = {{"full tree", 0, false}, {"cut below 0.01", 0.01f, false}, {"cut below 0.05", 0.05f, false},
+								{"roulette below 0.05", 0.05f, true}, {"roulette below 0.1", 0.1f, true}, {"roulette below 0.2", 0.2f, true}};
+	for (auto &variant : variants) {
+		TraceSettings settings;
+		settings.minWeight = variant.minWeight;
+		settings.russianRoulette = variant.russianRoulette;
+		render(settings, image, counts, ms);
+		double total = 0;
+		int largest = 0, deep = 0, wrong = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			total += counts[i];
+			largest = std::max(largest, counts[i]);
+			deep += counts[i] > 30;
+			glm::vec3 d = 255.0f * glm::abs(image[i] - reference[i]);
+			wrong += std::max(d.x, std::max(d.y, d.z)) > 2;
+		}
+		cout << "  " << setw(20) << left << variant.name << right << fixed << setprecision(2)
+			 << setw(6) << total / rays.size() << " rays/pixel, at most " << setw(3) << largest << ", " << setw(5) << deep << " pixels over 30 | "
+			 << setw(5) << (long)ms << " ms | error RMSE " << setw(5) << rmse(image, reference) << " levels, "
+			 << setw(5) << 100.0 * wrong / rays.size() << "% pixels off by more than 2" << endl;
+	}
+}
+
+/**
+ Renders the scene of benchmarkPruning, which must have been defined, with the hits shaded one at a time by
+ PhongModel (trace_ray, scalar kernels) and by batches (trace_rays) with every variant of the shading kernel, first
+ with the lights of the scene then with 16 more. The batched kernels use approximations of pow, their error is
+ reported in 8-bit levels of the tone mapped image and relative to the color before tone mapping.
+ */
+void benchmarkShading(const vector<Ray> &rays) {
+	BoundingBox empty;
+	for (int extra : {0, 16}) {
+		for (int i = 0; i < extra; i++) {
+			lights.push_back(new Light(glm::vec3((float)(i % 4) * 4 - 6, 8, (float)(i / 4) * 4 + 2), glm::vec3(0.2f)));
+		}
+		vector<glm::vec3> reference(rays.size()), image(rays.size());
+		selectKernels(CPU::ISA::SCALAR);
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i++) {
+			reference[i] = trace_ray(lights, ambient_light, objects, materials, rays[i], empty, TraceSettings(), (uint32_t)i);
+		}
+		tm.stop();
+		cout << "  " << lights.size() << " lights" << endl;
+		cout << "  " << setw(10) << left << "per hit" << right << setw(6) << std::max<int_fast64_t>(tm.ms(), 1) << " ms" << endl;
+		for (int k = 0; k <= (int)CPU::detect(); k++) {
+			CPU::ISA isa = CPU::ISA(k);
+			selectKernels(isa);
+			tm.start();
+			for (size_t i = 0; i < rays.size(); i += ShadingBatch::size) {
+				int n = (int)std::min(rays.size() - i, (size_t)ShadingBatch::size);
+				trace_rays(lights, ambient_light, objects, materials, &rays[i], n, empty, TraceSettings(), &image[i], (uint32_t)i);
+			}
+			tm.stop();
+			float levels = 0, relative = 0;
+			for (size_t i = 0; i < rays.size(); i++) {
+				glm::vec3 d = 255.0f * glm::abs(toneMapping(image[i]) - toneMapping(reference[i]));
+				levels = std::max(levels, std::max(d.x, std::max(d.y, d.z)));
+				glm::vec3 e = glm::abs(image[i] - reference[i]) / glm::max(reference[i], glm::vec3(1e-3f));
+				relative = std::max(relative, std::max(e.x, std::max(e.y, e.z)));
+			}
+			cout << "  " << setw(10) << left << CPU::name(isa) << right << setw(6) << std::max<int_fast64_t>(tm.ms(), 1) << " ms"
+				 << " | largest error " << fixed << setprecision(2) << levels << " levels, " << scientific << setprecision(1)
+				 << relative << " relative" << defaultfloat << endl;
+		}
+	}
+}
+
+/**
+ Renders the scene of benchmarkPruning with its lights replaced by sphere lights (see Light::sample), with hard
+ shadows, with a fixed number of shadow rays everywhere, and with the same number in the penumbrae only (see
+ light_visibility). The error of the tone mapped image, in 8-bit levels, is measured against 128 rays everywhere,
+ and the shadow rays traced per light from the primary hits are counted.
+ */
+void benchmarkSoftShadows(const vector<Ray> &rays) {
+	BoundingBox empty;
+	vector<Light *> area;
+	for (int i = 0; i < 3; i++) area.push_back(Light::sphere(lights[i]->position, 0.5f, lights[i]->color));
+	auto render = [&](const ShadowSettings &shadows, vector<glm::vec3> &image, double &ms) {
+		TraceSettings settings;
+		settings.shadows = shadows;
+		image.resize(rays.size());
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i += ShadingBatch::size) {
+			int n = (int)std::min(rays.size() - i, (size_t)ShadingBatch::size);
+			trace_rays(area, ambient_light, objects, materials, &rays[i], n, empty, settings, &image[i], (uint32_t)i);
+		}
+		tm.stop();
+		ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+		for (auto &c : image) c = toneMapping(c);
+	};
+	vector<glm::vec3> reference, image;
+	double ms;
+	render({128, false}, reference, ms);
+	cout << "  " << setw(20) << left << "128 rays everywhere" << right << setw(6) << (long)ms << " ms" << endl;
+
+	vector<Hit> hits(rays.size());
+	for (size_t i = 0; i < rays.size(); i++) hits[i] = closest_hit(objects, rays[i], empty);
+	for (ShadowSettings shadows : {ShadowSettings{1, false}, ShadowSettings{4, false}, ShadowSettings{8, false},
+								   ShadowSettings{16, false}, ShadowSettings{16, true}, ShadowSettings{32, true},
+								   ShadowSettings{64, false}, ShadowSettings{64, true}}) {
+		render(shadows, image, ms);
+		long queries = 0, traced = 0, penumbra = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			if (!hits[i].hit) continue;
+			glm::vec3 normal = glm::dot(hits[i].normal, rays[i].direction) > 0 ? -hits[i].normal : hits[i].normal;
+			for (Light *light : area) {
+				glm::vec3 d = light->position - hits[i].intersection;
+				float r = glm::length(d);
+				if (glm::dot(normal, d) <= 0) continue; // the light does not reach the point
+				int count = 0, samples = shadows.rays();
+				light_visibility(*light, objects, empty, hits[i].intersection, d / r, r, shadows, &count);
+				queries++;
+				traced += count;
+				penumbra += count == samples;
+			}
+		}
+		string name = shadows.samples == 1 ? "hard shadows" : to_string(shadows.samples) + (shadows.adaptive ? " rays in penumbrae" : " rays everywhere");
+		cout << "  " << setw(20) << left << name << right << setw(6) << (long)ms << " ms | " << fixed << setprecision(2)
+			 << setw(5) << (double)traced / std::max(queries, 1L) << " shadow rays per light";
+		if (shadows.adaptive) cout << ", " << 100.0 * penumbra / std::max(queries, 1L) << "% of the points in penumbrae";
+		cout << " | error RMSE " << rmse(image, reference) << " levels" << defaultfloat << endl;
+	}
+	for (Light *light : area) delete light;
+}
+
+/**
+ Renders the scene of benchmarkPruning lit by growing numbers of small lights spread through the room instead of its
+ own lights, with all the lights shaded at every hit and with a few of them sampled from a LightTree. The noise of
+ the sampled images, the RMSE in 8-bit levels of the tone mapped image, is measured against the image shading all
+ the lights.
+ */
+void benchmarkManyLights(const vector<Ray> &rays) {
+	BoundingBox empty;
+	auto render = [&](const vector<Light *> &scene, const LightSampling &sampling, vector<glm::vec3> &image, double &ms) {
+		TraceSettings settings;
+		settings.lightSampling = sampling;
+		image.resize(rays.size());
+		timer tm;
+		tm.start();
+		for (size_t i = 0; i < rays.size(); i += ShadingBatch::size) {
+			int n = (int)std::min(rays.size() - i, (size_t)ShadingBatch::size);
+			trace_rays(scene, ambient_light, objects, materials, &rays[i], n, empty, settings, &image[i], (uint32_t)i);
+		}
+		tm.stop();
+		ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+		for (auto &c : image) c = toneMapping(c);
+	};
+	for (int count : {16, 64, 256, 1024}) {
+		vector<Light *> scene;
+		uint32_t random = 7;
+		for (int i = 0; i < count; i++) {
+			glm::vec3 position(random_float(random) * 28 - 14, random_float(random) * 28 - 2, random_float(random) * 28 + 1);
+			glm::vec3 color = glm::vec3(random_float(random), random_float(random), random_float(random)) * (4.0f / (float)count);
+			scene.push_back(new Light(position, color));
+		}
+		vector<glm::vec3> reference, image;
+		double ms;
+		render(scene, LightSampling(), reference, ms);
+		cout << "  " << setw(5) << count << " lights, all shaded   " << setw(6) << (long)ms << " ms" << endl;
+		timer tm;
+		tm.start();
+		LightTree tree(scene);
+		tm.stop();
+		for (int samples : {1, 4, 8, 16}) {
+			render(scene, {&tree, samples}, image, ms);
+			cout << "  " << setw(5) << count << " lights, " << setw(2) << samples << " sampled" << setw(8) << (long)ms
+				 << " ms | noise RMSE " << fixed << setprecision(2) << rmse(image, reference) << " levels" << defaultfloat << endl;
+		}
+		for (Light *light : scene) delete light;
+	}
+}
+
+/**
+ Renders a wide floor lit by many dim lights scattered above it, with every light shaded at every hit, with the
+ lights skipped beyond their influence radius (see set_influence_radii), and with the lights of each tile of 32x32
+ pixels culled first (see trace_tile). The error of the tone mapped image, in 8-bit levels, is measured against
+ the first rendering, and the share of the pairs of a light and a lit point which are culled is reported.
+ */
+void benchmarkLightCulling(const vector<Ray> &rays) {
+	BoundingBox empty;
+	Material gray;
+	gray.diffuse = glm::vec3(0.6f);
+	Plane floor(glm::vec3(0, -3, 0), glm::vec3(0, 1, 0), gray);
+	floor.registerMaterials(materials);
+	vector<Object *> scene = {&floor};
+	const int tile = 32;
+	for (int count : {256, 1024, 4096}) {
+		vector<Light *> scattered;
+		uint32_t random = 11;
+		float side = 16 * std::sqrt((float)count); // the same density of lights for every count
+		for (int i = 0; i < count; i++) {
+			glm::vec3 position(random_float(random) * side - side / 2, random_float(random) * 2 - 2.5f, random_float(random) * side);
+			scattered.push_back(new Light(position, glm::vec3(random_float(random), random_float(random), random_float(random)) * 0.002f));
+		}
+		auto render = [&](bool tiles, vector<glm::vec3> &image, double &ms, double &shaded) {
+			TraceSettings settings;
+			image.resize(rays.size());
+			long total = 0, tileCount = 0;
+			timer tm;
+			tm.start();
+			if (!tiles) {
+				for (size_t i = 0; i < rays.size(); i += ShadingBatch::size) {
+					int n = (int)std::min(rays.size() - i, (size_t)ShadingBatch::size);
+					trace_rays(scattered, ambient_light, scene, materials, &rays[i], n, empty, settings, &image[i], (uint32_t)i);
+				}
+			} else {
+				vector<Ray> group;
+				vector<glm::vec3> colors;
+				for (int y = 0; y < height; y += tile) {
+					for (int x = 0; x < width; x += tile) {
+						int columns = std::min(tile, width - x), rows = std::min(tile, height - y), lit = 0;
+						group.clear();
+						for (int j = y; j < y + rows; j++) group.insert(group.end(), &rays[j * width + x], &rays[j * width + x] + columns);
+						colors.resize(group.size());
+						trace_tile(scattered, ambient_light, scene, materials, group.data(), columns, rows, empty, settings,
+								   colors.data(), y * width + x, width, nullptr, &lit);
+						for (int k = 0; k < columns * rows; k++) image[(y + k / columns) * width + x + k % columns] = colors[k];
+						total += lit;
+						tileCount++;
+					}
+				}
+			}
+			tm.stop();
+			ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+			shaded = tiles ? (double)total / (double)tileCount : (double)count;
+			for (auto &c : image) c = toneMapping(c);
+		};
+		vector<glm::vec3> reference, image;
+		double ms, shaded;
+		render(false, reference, ms, shaded);
+		cout << "  " << setw(5) << count << " lights, all shaded      " << setw(7) << (long)ms << " ms" << endl;
+		set_influence_radii(scattered, materials);
+		// share of the pairs of a light and a point of the floor seen by a pixel which are beyond the influence radius,
+		// over every 16th pixel
+		long pairs = 0, culled = 0;
+		for (size_t i = 0; i < rays.size(); i += 16) {
+			Hit hit = floor.intersect(rays[i]);
+			if (!hit.hit) continue;
+			for (Light *light : scattered) culled += glm::distance(light->position, hit.intersection) > light->influence;
+			pairs += count;
+		}
+		for (bool tiles : {false, true}) {
+			render(tiles, image, ms, shaded);
+			double largest = 0;
+			for (size_t i = 0; i < rays.size(); i++) {
+				glm::vec3 d = 255.0f * (image[i] - reference[i]);
+				largest = std::max({largest, (double)std::abs(d.x), (double)std::abs(d.y), (double)std::abs(d.z)});
+			}
+			cout << "  " << setw(5) << count << " lights, " << (tiles ? "culled per tile " : "influence radius") << setw(8) << (long)ms
+				 << " ms | " << fixed << setprecision(3) << "error RMSE " << rmse(image, reference) << ", largest " << largest << " levels";
+			if (!tiles) cout << " | " << setprecision(1) << 100.0 * (double)culled / (double)std::max(pairs, 1L) << "% of the pairs culled";
+			if (tiles) cout << " | " << setprecision(1) << shaded << " lights per tile";
+			cout << defaultfloat << endl;
+		}
+		for (Light *light : scattered) delete light;
+	}
+}
+
+/**
+ Renders the scene of benchmarkPruning with the centers of the pixels only, with the grids of 4 and 16 samples in
+ every pixel, and with adaptive anti-aliasing for several contrast thresholds (see render_adaptive), all
+ reconstructed by the film. The error of the tone mapped image, in 8-bit levels, is measured against the grids of
+ 4, 16 and 64 samples in every pixel.
+ */
+void benchmarkAntialiasing() {
+	BoundingBox empty;
+	thread_pool pool(1); // the time of the samples, rather than of the threads
+	Camera camera = makeCamera(width, height);
+	TraceSettings settings;
+	settings.pixelSpread = camera.s;
+	auto trace = tileTracer(settings, empty);
+	auto render = [&](const AdaptiveSettings &antialiasing, vector<glm::vec3> &image, double &ms, AdaptiveStatistics &stats) {
+		Film film(width, height);
+		timer tm;
+		tm.start();
+		stats = render_adaptive(film, antialiasing, pool, camera, trace);
+		tm.stop();
+		ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+		image = filmImage(film);
+	};
+	vector<glm::vec3> reference, image;
+	double ms;
+	AdaptiveStatistics stats;
+	render({-1, 64}, reference, ms, stats); // every pixel refined by every grid
+	cout << "  " << setw(24) << left << "1 + 4 + 16 + 64 samples" << right << setw(7) << (long)ms << " ms" << endl;
+	for (AdaptiveSettings antialiasing : {AdaptiveSettings{-1, 1}, AdaptiveSettings{-1, 4}, AdaptiveSettings{-1, 16},
+										  AdaptiveSettings{16, 16}, AdaptiveSettings{8, 16}, AdaptiveSettings{4, 16}}) {
+		render(antialiasing, image, ms, stats);
+		string name = antialiasing.samples == 1 ? "centers" : antialiasing.contrast < 0
+					  ? "every pixel, up to " + to_string(antialiasing.samples)
+					  : "contrast " + to_string((int)antialiasing.contrast) + ", up to " + to_string(antialiasing.samples);
+		cout << "  " << setw(24) << left << name << right << setw(7) << (long)ms << " ms | " << fixed << setprecision(2) << setw(5)
+			 << (double)stats.samples / (width * height) << " samples per pixel, " << setprecision(1) << setw(5)
+			 << 100.0 * stats.refined / (width * height) << "% refined | error RMSE " << setprecision(2)
+			 << rmse(image, reference) << " levels" << defaultfloat << endl;
+	}
+}
+
+/**
+ Renders the scene of benchmarkPruning at half the resolution of the camera with 1, 4 and 16 samples in every pixel
+ (see render_supersampled), reconstructed by each filter of the film. The error of the tone mapped image, in 8-bit
+ levels, is measured against 64 samples per pixel with the same filter. The memory of the film and of the image is
+ compared with that of the image of as many pixels as samples, 3 ints per pixel, which used to be averaged later.
+ */
+void benchmarkSupersampling() {
+	BoundingBox empty;
+	thread_pool pool(1);
+	const int columns = width / 2, rows = height / 2;
+	Camera camera = makeCamera(columns, rows);
+	TraceSettings settings;
+	settings.pixelSpread = camera.s;
+	auto trace = tileTracer(settings, empty);
+	auto render = [&](Film::Filter filter, int samples, vector<glm::vec3> &image, double &ms) {
+		Film film(columns, rows, filter);
+		timer tm;
+		tm.start();
+		render_supersampled(film, samples, pool, camera, trace);
+		tm.stop();
+		ms = (double)std::max<int_fast64_t>(tm.ms(), 1);
+		image = filmImage(film);
+	};
+	size_t pixels = (size_t)columns * rows;
+	size_t frame = pixels * (sizeof(glm::vec3) + sizeof(float)) + pixels * 3; // film, and image of bytes
+	for (int samples : {1, 4, 16}) {
+		cout << "  " << setw(2) << samples << " samples per pixel: film and image " << frame / 1024 << " KB, instead of "
+			 << pixels * samples * 3 * sizeof(int) / 1024 << " KB for the image of all the samples" << endl;
+	}
+	const char *names[] = {"box", "tent", "mitchell"};
+	for (Film::Filter filter : {Film::Filter::BOX, Film::Filter::TENT, Film::Filter::MITCHELL}) {
+		vector<glm::vec3> reference, image;
+		double ms;
+		render(filter, 64, reference, ms);
+		for (int samples : {1, 4, 16}) {
+			render(filter, samples, image, ms);
+			cout << "  " << setw(8) << left << names[(int)filter] << right << setw(3) << samples << " samples" << setw(7) << (long)ms
+				 << " ms | error RMSE " << fixed << setprecision(2) << rmse(image, reference) << " levels" << defaultfloat << endl;
+		}
+	}
+}
+
+/**
+ Path traces the scene of benchmarkPruning progressively at a quarter of the resolution of the camera (see
+ render_progressive), until the noise of every block of pixels is below several thresholds or it has 256 samples
+ per pixel. Each threshold is rendered twice with independent paths, so that the noise actually left is measured
+ from the difference of the two images, without a reference: it is their RMSE divided by sqrt(2).
+ */
+void benchmarkProgressive() {
+	BoundingBox empty;
+	thread_pool pool;
+	const int columns = width / 4, rows = height / 4;
+	Camera camera = makeCamera(columns, rows);
+	TraceSettings settings;
+	settings.pixelSpread = camera.s;
+	for (float noise : {16.0f, 8.0f, 4.0f}) {
+		ProgressiveSettings progressive;
+		progressive.noise = noise;
+		progressive.maxSamples = 256;
+		vector<glm::vec3> images[2];
+		double ms = 0, samples = 0, saturated = 0;
+		for (uint32_t seed = 0; seed < 2; seed++) {
+			AccumulationBuffer buffer(columns, rows);
+			auto sample = [&](int i, int j, uint32_t pass) {
+				uint32_t random = ((uint32_t)(j * columns + i) * 0x9e3779b9u ^ pass * 0x85ebca6bu) + seed * 0x68e31da4u;
+				return trace_path(lights, objects, materials, camera.jittered(i, j, random), empty, settings, random);
+			};
+			timer tm;
+			tm.start();
+			render_progressive(buffer, progressive, pool, sample, [](uint32_t, long) {});
+			tm.stop();
+			ms += (double)tm.ms() / 2;
+			for (int k = 0; k < columns * rows; k++) {
+				images[seed].push_back(toneMapping(buffer.mean(k)));
+				samples += buffer.samples(k) / 2.0;
+				saturated += (buffer.samples(k) == progressive.maxSamples) / 2.0;
+			}
+		}
+		cout << "  noise below " << setw(2) << noise << " levels" << setw(8) << (long)ms << " ms | " << fixed << setprecision(1)
+			 << setw(6) << samples / (columns * rows) << " samples per pixel, " << setw(4) << 100 * saturated / (columns * rows)
+			 << "% at " << progressive.maxSamples << " | measured noise RMSE " << setprecision(2)
+			 << rmse(images[0], images[1]) / sqrt(2.0) << " levels" << defaultfloat << endl;
+	}
+}
+
+/**
+ Path traces the scene of benchmarkPruning at a quarter of the resolution of the camera with a fixed number of samples
+ per pixel, then filters the image with the denoiser, guided by the features of the first hits of the paths. The
+ error of the tone mapped image, in 8-bit levels, is measured with and without the denoiser against the mean of two
+ renderings of 256 samples per pixel, so that the time to a given error can be compared. The noise of the reference
+ itself, known from the difference of the two renderings, is removed from the error. The time of the filter is also
+ measured with the kernel of each instruction set.
+ */
+void benchmarkDenoising() {
+	BoundingBox empty;
+	thread_pool pool;
+	const int columns = width / 4, rows = height / 4, pixels = columns * rows;
+	Camera camera = makeCamera(columns, rows);
+	TraceSettings settings;
+	settings.pixelSpread = camera.s;
+	DenoiseSettings denoising;
+	denoising.pixelSpread = camera.s;
+	// renders with every pixel sampled the same number of times, gathering the features if denoiser is not null
+	auto render = [&](uint32_t samples, uint32_t seed, Denoiser *denoiser, vector<glm::vec3> &colors) {
+		ProgressiveSettings progressive;
+		progressive.noise = 0;
+		progressive.minSamples = progressive.maxSamples = samples;
+		AccumulationBuffer buffer(columns, rows);
+		auto sample = [&](int i, int j, uint32_t pass) {
+			uint32_t random = ((uint32_t)(j * columns + i) * 0x9e3779b9u ^ pass * 0x85ebca6bu) + seed * 0x68e31da4u;
+			Features features;
+			glm::vec3 color = trace_path(lights, objects, materials, camera.jittered(i, j, random), empty, settings, random,
+										 nullptr, denoiser ? &features : nullptr);
+			if (denoiser) denoiser->add(j * columns + i, features);
+			return color;
+		};
+		render_progressive(buffer, progressive, pool, sample, [](uint32_t, long) {});
+		colors.resize(pixels);
+		for (int k = 0; k < pixels; k++) colors[k] = buffer.mean(k);
+	};
+	// mean squared error of the tone mapped images
+	auto squared = [&](const vector<glm::vec3> &image, const vector<glm::vec3> &reference) {
+		vector<glm::vec3> a(pixels), b(pixels);
+		for (int k = 0; k < pixels; k++) {
+			a[k] = toneMapping(image[k]);
+			b[k] = toneMapping(reference[k]);
+		}
+		double e = rmse(a, b);
+		return e * e;
+	};
+	vector<glm::vec3> reference, second, image;
+	render(256, 1, nullptr, reference);
+	render(256, 2, nullptr, second);
+	// the two renderings differ by twice the variance of one, and their mean has half of it
+	double noise = squared(reference, second) / 4;
+	for (int k = 0; k < pixels; k++) reference[k] = (reference[k] + second[k]) / 2.0f;
+	auto error = [&](const vector<glm::vec3> &image) {
+		return sqrt(max(squared(image, reference) - noise, 0.0));
+	};
+	cout << "  reference of 512 samples per pixel, noise RMSE " << fixed << setprecision(2) << sqrt(noise) << " levels" << defaultfloat << endl;
+	for (bool denoise : {false, true}) {
+		for (uint32_t samples : {1u, 4u, 16u, 64u}) {
+			Denoiser denoiser(columns, rows);
+			timer tm;
+			tm.start();
+			render(samples, 0, denoise ? &denoiser : nullptr, image);
+			if (denoise) denoiser.filter(image, denoising, pool);
+			tm.stop();
+			cout << "  " << setw(2) << samples << " samples per pixel" << (denoise ? ", denoised" : "          ") << setw(7) << tm.ms()
+				 << " ms | error RMSE " << fixed << setprecision(2) << error(image) << " levels" << defaultfloat << endl;
+		}
+	}
+	Denoiser denoiser(columns, rows);
+	render(4, 0, &denoiser, image);
+	for (int k = 0; k <= (int)CPU::detect(); k++) {
+		CPU::ISA isa = CPU::ISA(k);
+		Denoiser::selectKernel(isa);
+		vector<glm::vec3> filtered;
+		double ms = INFINITY;
+		for (int repeat = 0; repeat < 5; repeat++) {
+			filtered = image;
+			timer tm;
+			tm.start();
+			denoiser.filter(filtered, denoising, pool);
+			tm.stop();
+			ms = min(ms, (double)tm.ms());
+		}
+		cout << "  filter with " << setw(6) << left << CPU::name(isa) << right << setw(5) << (long)ms << " ms, "
+			 << pool.get_thread_count() << " threads" << endl;
+	}
+	Denoiser::selectKernel(CPU::detect());
+}
+
+/**
+ Converts a synthetic 4096x4096 PPM image into a tiled texture, then samples it along the rows of a plane receding
+ from the camera, like the rays of a pixel row would, with bilinear filtering of the first level and with
+ trilinear filtering of the levels matching the footprint of the pixels. The lookups go through caches of
+ several budgets; the number of tiles paged in shows how much of the pyramid is touched.
+ */
+void benchmarkTextures() {
+	const uint32_t size = 4096;
+	string image = (filesystem::temp_directory_path() / "texture.ppm").string();
+	{
+		ofstream file(image, ios::binary);
+		file << "P6\n" << size << " " << size << "\n255\n";
+		vector<uint8_t> row(size * 3);
+		for (uint32_t y = 0; y < size; y++) {
+			for (uint32_t x = 0; x < size; x++) {
+				bool square = ((x / 8) + (y / 8)) % 2;
+				row[3 * x] = square ? 230 : 20;
+				row[3 * x + 1] = (uint8_t)(x * 255 / size);
+				row[3 * x + 2] = (uint8_t)(y * 255 / size);
+			}
+			file.write((const char *)row.data(), (streamsize)row.size());
+		}
+	}
+	timer tm;
+	tm.start();
+	Texture::write(image, Texture::path(image));
+	tm.stop();
+	cout << "  conversion of " << size << "x" << size << " texels " << tm.ms() << " ms, tiled file "
+		 << filesystem::file_size(Texture::path(image)) / (1 << 20) << " MB" << endl;
+
+	// a plane seen at a grazing angle: the footprint of a pixel, the spacing of the lookups, grows with the distance
+	const int rows = 384, columns = 512;
+	for (size_t budget : {size_t(1) << 20, size_t(16) << 20, size_t(256) << 20}) {
+		for (auto filter : {Texture::Filter::BILINEAR, Texture::Filter::TRILINEAR}) {
+			TextureCache cache(budget);
+			Texture texture(image, cache);
+			texture.filter = filter;
+			float checksum = 0;
+			tm.start();
+			for (int j = 0; j < rows; j++) {
+				float distance = 1.0f + 200.0f * j / rows, footprint = distance * 0.02f / columns;
+				for (int i = 0; i < columns; i++) {
+					checksum += texture.sample(glm::vec2((float)i * footprint, distance * 0.05f), footprint).x;
+				}
+			}
+			tm.stop();
+			auto stats = cache.statistics();
+			cout << "  " << setw(4) << (budget >> 20) << " MB cache, " << setw(9) << left
+				 << (filter == Texture::Filter::BILINEAR ? "bilinear" : "trilinear") << right << fixed << setprecision(2)
+				 << setw(7) << rows * columns / std::max<double>(tm.ms(), 1) / 1000.0 << " Mlookups/s | "
+				 << setw(6) << stats.loads << " tiles paged in, " << setw(6) << stats.evictions << " evicted, peak "
+				 << setw(6) << stats.peakBytes / 1024 << " KB (checksum " << setprecision(1) << checksum << ")" << endl;
+		}
+	}
+	filesystem::remove(image);
+	filesystem::remove(Texture::path(image));
+}
+
+/**
+ Evaluates procedural textures over a grid of texture coordinates: the rainbow texture through the function
+ pointer of Textures.h and through its procedural version, and a composition of stripes and noise in a checkerboard.
+ The procedural textures are evaluated one point at a time by the scalar path, and 8 points at a time by the
+ batched function of each instruction set, whose colors are compared with the scalar ones.
+ */
+void benchmarkProcedural() {
+	const int rows = 768, columns = 1024;
+	vector<float> u(rows * columns), v(rows * columns);
+	for (int j = 0; j < rows; j++) {
+		for (int i = 0; i < columns; i++) {
+			u[j * columns + i] = 1.5f * (float)i / columns;
+			v[j * columns + i] = (float)j / rows;
+		}
+	}
+	size_t count = u.size();
+	const int passes = 10; ///< over the grid per run, so that the fastest textures run long enough to be timed
+	auto best = [](const function<void()> &f) {
+		double ms = FLOAT_INFINITY;
+		for (int r = 0; r < repetitions; r++) {
+			timer tm;
+			tm.start();
+			for (int p = 0; p < passes; p++) f();
+			tm.stop();
+			ms = std::min(ms, (double)std::max<int_fast64_t>(tm.ms(), 1));
+		}
+		return ms;
+	};
+	auto report = [&](const string &name, double ms) {
+		cout << "    " << setw(10) << left << name << right << fixed << setprecision(1) << setw(8)
+			 << count * passes / ms / 1000.0 << " Mlookups/s" << defaultfloat;
+	};
+
+	glm::vec3 (* volatile function)(glm::vec2) = &rainbowTexture; // not inlined, like the texture of a material
+	const auto composite = Procedural::compile(Procedural::checker(
+			Procedural::stripes(glm::vec2(8, 16), glm::vec3(0.9f, 0.2f, 0.1f), glm::vec3(0.9f, 0.8f, 0.2f), glm::vec3(0.2f, 0.4f, 0.9f)),
+			Procedural::noise(glm::vec3(0.1f), glm::vec3(0.8f, 0.7f, 0.6f), 8.0f, 5),
+			glm::vec2(10, 10)));
+	vector<glm::vec3> reference(count);
+	vector<float> r(count), g(count), b(count);
+	for (auto texture : {Procedural::rainbow(), (const Procedural::Evaluator *)&composite}) {
+		cout << "  " << (texture == Procedural::rainbow() ? "rainbow" : "checkerboard of stripes and noise") << endl;
+		if (texture == Procedural::rainbow()) {
+			report("function", best([&]() {
+				for (size_t i = 0; i < count; i++) reference[i] = function(glm::vec2(u[i], v[i]));
+			}));
+			int different = 0;
+			for (size_t i = 0; i < count; i++) different += (*texture)(glm::vec2(u[i], v[i])) != reference[i];
+			cout << " | " << different << " colors differ from the procedural version" << endl;
+		}
+		report("per point", best([&]() {
+			for (size_t i = 0; i < count; i++) reference[i] = (*texture)(glm::vec2(u[i], v[i]));
+		}));
+		cout << endl;
+		for (int k = 0; k <= (int)CPU::detect(); k++) {
+			CPU::ISA isa = CPU::ISA(k);
+			Procedural::selectKernel(isa);
+			report(CPU::name(isa), best([&]() {
+				for (size_t i = 0; i < count; i += Procedural::lanes) texture->evaluate(&u[i], &v[i], &r[i], &g[i], &b[i]);
+			}));
+			float error = 0;
+			for (size_t i = 0; i < count; i++) {
+				glm::vec3 d = glm::abs(glm::vec3(r[i], g[i], b[i]) - reference[i]);
+				error = std::max(error, std::max(d.x, std::max(d.y, d.z)));
+			}
+			cout << " | largest error " << scientific << setprecision(1) << error << defaultfloat << endl;
+		}
+	}
+	Procedural::selectKernel(CPU::detect());
+}
+
+int main(int argc, const char * argv[]) {
+	vector<string> paths;
+	for (int i = 1; i < argc; i++) paths.emplace_back(argv[i]);
+	if (paths.empty()) {
+		for (auto &entry : filesystem::directory_iterator("models")) {
+			if (entry.path().extension() == ".obj") paths.push_back(entry.path().string());
+		}
+		sort(paths.begin(), paths.end());
+	}
+
+	string grid = (filesystem::temp_directory_path() / "grid.obj").string();
+	string quadGrid = (filesystem::temp_directory_path() / "quad_grid.obj").string();
+	writeGrid(grid, 1000);
+	writeGrid(quadGrid, 1000, true);
+	cout << "Loading" << endl;
+	vector<string> loaded = paths;
+	loaded.push_back(grid);
+	loaded.push_back(quadGrid);
+	benchmarkLoading(loaded);
+	cout << endl << "Binary PLY" << endl;
+	benchmarkPLY({paths.front(), grid});
+	for (auto &path : {grid, quadGrid}) {
+		filesystem::remove(path);
+		filesystem::remove(MeshCache::path(path));
+	}
+	cout << endl;
+
+	vector<Ray> rays = cameraRays();
+	cout << "Tracing " << rays.size() << " primary rays, fastest of " << repetitions << " runs" << endl;
+	cout << endl << "Triangle storage, " << CPU::name(CPU::detect()) << " kernels" << endl;
+	selectKernels(CPU::detect());
+	for (auto &path : paths) benchmarkStorage(path, rays);
+
+	cout << endl << "Compressed geometry, vertex storage" << endl;
+	for (auto &path : paths) benchmarkCompression(path, rays);
+
+	cout << endl << "Out-of-core clusters of 512 triangles" << endl;
+	for (auto &path : paths) benchmarkOutOfCore(path, rays);
+
+	cout << endl << "Box and triangle kernels, packet storage" << endl;
+	for (auto &path : paths) benchmarkKernels(path, rays);
+	cout << endl;
+	benchmarkSpheresAndLights(rays);
+
+	cout << endl << "Pruning of the reflection and refraction rays, " << CPU::name(CPU::detect()) << " kernels" << endl;
+	selectKernels(CPU::detect());
+	benchmarkPruning(rays);
+
+	cout << endl << "Soft shadows of sphere lights of radius 0.5" << endl;
+	benchmarkSoftShadows(rays);
+
+	cout << endl << "Many lights, sampled from a light tree" << endl;
+	benchmarkManyLights(rays);
+
+	cout << endl << "Light culling by influence radius, tiles of 32x32 pixels" << endl;
+	benchmarkLightCulling(rays);
+
+	cout << endl << "Batched Phong shading" << endl;
+	benchmarkShading(rays);
+
+	cout << endl << "Image textures" << endl;
+	benchmarkTextures();
+
+	cout << endl << "Procedural textures, " << Procedural::lanes << " points per batch" << endl;
+	benchmarkProcedural();
+
+	cout << endl << "Adaptive anti-aliasing, Mitchell filter, one thread" << endl;
+	benchmarkAntialiasing();
+
+	cout << endl << "Supersampling at " << width / 2 << "x" << height / 2 << ", one thread" << endl;
+	benchmarkSupersampling();
+
+	cout << endl << "Progressive path tracing at " << width / 4 << "x" << height / 4 << endl;
+	benchmarkProgressive();
+
+	cout << endl << "Denoising at " << width / 4 << "x" << height / 4 << endl;
+	benchmarkDenoising();
+	return 0;
+}
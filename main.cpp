@@ -7,15 +7,20 @@
 #include <cmath>
 #include <ctime>
 #include <vector>
+#include <filesystem>
+#include <atomic>
+#include <memory>
 #include "glm/glm.hpp"
 #include "glm/gtx/transform.hpp"
 
 #include "thread_pool.hpp"
+#include "CPU.hpp"
 #include "Utils.hpp"
 #include "Image.h"
 #include "Material.h"
 #include "Triangle.hpp"
 #include "OBJ.hpp"
+#include "MeshCache.hpp"
 #include "Ray.hpp"
 #include "Object.hpp"
 #include "Hit.hpp"
@@ -23,7 +28,12 @@
 #include "Plane.hpp"
 #include "Cone.hpp"
 #include "Light.hpp"
+#include "LightTree.hpp"
 #include "BoundingBox.hpp"
+#include "ClusteredMesh.hpp"
+#include "Accumulation.hpp"
+#include "Film.hpp"
+#include "Denoiser.hpp"
 
 #include "Scene.hpp"
 
@@ -33,6 +43,142 @@ using namespace std;
 
 
 int main(int argc, const char * argv[]) {
+    // command line: [--isa=scalar|sse4.2|avx2|avx512] [--compressed] [--out-of-core=MB] [--ray-budget=N] [--prune=W]
+    //               [--texture-cache=MB] [--area-lights=R] [--shadow-samples=N]
+    //               [--light-samples=N] [--no-light-culling] [--aa-contrast=L] [--aa-samples=N]
+    //               [--samples=N] [--filter=box|tent|mitchell]
+    //               [--path-tracing] [--noise=L] [--max-samples=N] [--progress=N] [--denoise] [output.ppm]
+    const char *output = "result.ppm";
+    CPU::ISA isa = CPU::detect();
+    bool compressed = false;
+    double budget = 0; // memory budget in MB of the clusters of the model, 0 to keep the whole model in memory
+    TraceSettings settings; // depth, ray budget and pruning of the tree of reflected and refracted rays
+    float lightRadius = 0; // radius of the sphere lights replacing the point lights of the scene, 0 to keep them
+    int lightSamples = 0; // number of lights sampled from a light tree per hit, 0 to shade all the lights
+    AdaptiveSettings antialiasing; // refinement of the edges of the image, see render_adaptive
+    int samples = 0; // number of samples of every pixel, see render_supersampled, 0 to refine the edges only
+    Film::Filter filter = Film::Filter::MITCHELL; // reconstruction of the image from the samples
+    bool pathTracing = false; // whether the image is path traced progressively instead of by trace_ray
+    ProgressiveSettings progressive; // when the path tracing stops, see render_progressive
+    uint32_t progress = 0; // number of passes between the intermediate images written while path tracing, 0 for none
+    bool cullLights = true; // whether the lights beyond their influence radius are culled, see set_influence_radii
+    bool denoise = false; // whether the path traced image is filtered by the denoiser, guided by the surfaces seen in the pixels
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        if (arg == "--compressed") {
+            compressed = true;
+        } else if (arg.rfind("--out-of-core=", 0) == 0) {
+            budget = atof(arg.c_str() + 14);
+            if (budget <= 0) {
+                cerr << "The memory budget must be a positive number of MB" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--ray-budget=", 0) == 0) {
+            settings.rayBudget = atoi(arg.c_str() + 13);
+            if (settings.rayBudget <= 0) {
+                cerr << "The ray budget must be a positive number of rays" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--prune=", 0) == 0) {
+            settings.minWeight = atof(arg.c_str() + 8);
+            if (settings.minWeight < 0 || settings.minWeight >= 1) {
+                cerr << "The pruning weight must be in [0, 1)" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--texture-cache=", 0) == 0) {
+            double cache = atof(arg.c_str() + 16);
+            if (cache <= 0) {
+                cerr << "The texture cache must be a positive number of MB" << endl;
+                return 1;
+            }
+            materials.textureCache.budget = size_t(cache * (1 << 20));
+        } else if (arg.rfind("--area-lights=", 0) == 0) {
+            lightRadius = (float)atof(arg.c_str() + 14);
+            if (lightRadius <= 0) {
+                cerr << "The radius of the area lights must be positive" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--shadow-samples=", 0) == 0) {
+            settings.shadows.samples = atoi(arg.c_str() + 17);
+            if (settings.shadows.samples <= 0 || settings.shadows.samples > ShadowSettings::maxSamples) {
+                cerr << "The number of shadow samples must be between 1 and " << ShadowSettings::maxSamples << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--light-samples=", 0) == 0) {
+            lightSamples = atoi(arg.c_str() + 16);
+            if (lightSamples <= 0 || lightSamples > LightTree::maxSamples) {
+                cerr << "The number of light samples must be in [1, " << LightTree::maxSamples << "]" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--aa-contrast=", 0) == 0) {
+            antialiasing.contrast = (float)atof(arg.c_str() + 14);
+            if (antialiasing.contrast <= 0) {
+                cerr << "The contrast threshold must be a positive number of 8-bit levels" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--aa-samples=", 0) == 0) {
+            antialiasing.samples = atoi(arg.c_str() + 13);
+            if (antialiasing.samples != 1 && antialiasing.samples != 4 && antialiasing.samples != 16 && antialiasing.samples != 64) {
+                cerr << "The samples of the finest grid must be 1, 4, 16 or 64" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--samples=", 0) == 0) {
+            samples = atoi(arg.c_str() + 10);
+            if (samples <= 0) {
+                cerr << "The number of samples per pixel must be positive" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--filter=", 0) == 0) {
+            if (!Film::parse(arg.substr(9), filter)) {
+                cerr << "Unknown filter " << arg.substr(9) << ", the filters are box, tent and mitchell" << endl;
+                return 1;
+            }
+        } else if (arg == "--path-tracing") {
+            pathTracing = true;
+        } else if (arg.rfind("--noise=", 0) == 0) {
+            progressive.noise = (float)atof(arg.c_str() + 8);
+            if (progressive.noise <= 0) {
+                cerr << "The noise threshold must be a positive number of 8-bit levels" << endl;
+                return 1;
+            }
+        } else if (arg.rfind("--max-samples=", 0) == 0) {
+            int samples = atoi(arg.c_str() + 14);
+            if (samples <= 0) {
+                cerr << "The number of samples per pixel must be positive" << endl;
+                return 1;
+            }
+            progressive.maxSamples = (uint32_t)samples;
+        } else if (arg.rfind("--progress=", 0) == 0) {
+            int passes = atoi(arg.c_str() + 11);
+            if (passes <= 0) {
+                cerr << "The number of passes between intermediate images must be positive" << endl;
+                return 1;
+            }
+            progress = (uint32_t)passes;
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else if (arg == "--no-light-culling") {
+            cullLights = false;
+        } else if (arg.rfind("--isa=", 0) == 0) {
+            if (!CPU::parse(arg.substr(6), isa) || !CPU::supported(isa)) {
+                cerr << "Instruction set " << arg.substr(6) << " is not supported, the best one for this CPU is " << CPU::name(CPU::detect()) << endl;
+                return 1;
+            }
+        } else {
+            output = argv[a];
+        }
+    }
+    if (compressed && budget > 0) {
+        cerr << "The clusters of the mesh out of core are not compressed, --compressed and --out-of-core cannot be combined" << endl;
+        return 1;
+    }
+    if (denoise && !pathTracing) {
+        cerr << "The denoiser filters the noise of the path tracing, --denoise needs --path-tracing" << endl;
+        return 1;
+    }
+    selectKernels(isa); // choose the kernels for the instruction set once and for all
+    cout << "Kernels: " << CPU::name(isa) << endl;
+
     // define the material for the model
     Material model_material;
 	model_material.ambient = glm::vec3(0.09f, 0.09f, 0.09f);
@@ -49,21 +195,66 @@ int main(int argc, const char * argv[]) {
 	glm::mat4 rotationMatrix = glm::rotate(glm::radians(55.0f) , glm::vec3(0,1,0));
 	glm::mat4 modelMatrix = translationMatrix * rotationMatrix * scalingMatrix;
 
-    // read the .obj file and create a Model
-	OBJ::Model model = OBJ::read("models/skull.obj");
-    model.material = model_material;
-    model.setTransformation(modelMatrix);
+    thread_pool pool;
 
-	cout << model << endl;
+    string modelPath = "models/skull.obj";
+    unique_ptr<OBJ::Model> model; // the whole mesh in memory, unless it is out of core
+    ClusteredMesh *clusters = nullptr;
+    if (budget > 0) {
+        // out of core, the model is split into clusters stored in a file next to it, which are paged in by the rays.
+        // The clusters are only built when the file is missing, older than the model or invalid, and the model is
+        // released before rendering so that only the resident clusters stay in memory.
+        string path = ClusteredMesh::path(modelPath);
+        if (filesystem::exists(path) && filesystem::last_write_time(path) >= filesystem::last_write_time(modelPath)) {
+            clusters = new ClusteredMesh(path, size_t(budget * (1 << 20)));
+            if (!clusters->good) {
+                delete clusters;
+                clusters = nullptr;
+            }
+        }
+        if (!clusters) {
+            OBJ::Model whole = MeshCache::read(modelPath, &pool);
+            if (!whole.good || !ClusteredMesh::write(whole, path, 256)) return 1;
+            clusters = new ClusteredMesh(path, size_t(budget * (1 << 20)));
+            if (!clusters->good) return 1;
+        }
+        clusters->setMaterial(model_material);
+        clusters->setTransformation(modelMatrix);
+        cout << *clusters << endl;
+    } else {
+        // read the .obj file in parallel and create a Model, or load it from its binary cache
+        model = make_unique<OBJ::Model>(MeshCache::read(modelPath, &pool));
+        model->setMaterial(model_material); // for the triangles without a material of their own
+        model->registerMaterials(materials);
+        model->setTransformation(modelMatrix);
+        if (compressed) model->compress();
+        cout << *model << endl;
+    }
 
-    // initialize the bounding box hierarchy for this Model.
-    BoundingBox bbox = BoundingBox(model);
+    // initialize the bounding box hierarchy for this Model. The compressed geometry is decoded during the
+    // traversal, which requires the layout reading the vertices from the model.
+    BoundingBox bbox = model ? BoundingBox(*model, compressed ? TriangleStorage::VERTICES : TriangleStorage::PACKET) : BoundingBox();
 
-    int width = 1024*4; //width of the image
-    int height = 768*4; // height of the image
+    int width = 1024; //width of the image
+    int height = 768; // height of the image
     float fov = 90; // field of view
 
 	sceneDefinition(); // Let's define a scene
+    if (lightRadius > 0) { // soft shadows, see light_visibility
+        for (Light *light : lights) {
+            light->shape = Light::Shape::SPHERE;
+            light->radius = lightRadius;
+        }
+    }
+    unique_ptr<LightTree> lightTree; // many lights are sampled rather than all shaded, see LightTree
+    if (lightSamples > 0) {
+        lightTree = make_unique<LightTree>(lights);
+        settings.lightSampling = {lightTree.get(), lightSamples};
+    }
+    if (clusters) objects.push_back(clusters);
+    for (auto object : objects) object->registerMaterials(materials); // shading reads the materials from the table
+    // the lights are skipped where they cannot change the image, unless disabled
+    if (cullLights) set_influence_radii(lights, materials);
 
 
 	Image image(width,height); // Create an image where we will store the result
@@ -71,54 +262,96 @@ int main(int argc, const char * argv[]) {
     float s = 2*tan(0.5*fov/180*M_PI)/width;
     float X = -s * width / 2;
     float Y = s * height / 2;
-
-    thread_pool pool;
+    settings.pixelSpread = s; // the image plane is at distance 1
 
     int threads = pool.get_thread_count();
     cout << "Threads: " << threads << endl;
 
     clock_t t = clock(); // variable for keeping the time of the rendering
 
-    auto task = [&image, &X, &Y, &s, &width, &height, &bbox](int y_min, int y_max){
-                    for(int j = y_min; j < min(y_max, height) ; j++) {
-                        for(int i = 0; i < width ; i++) {
-                            float dx = X + i*s + s/2;
-                            float dy = Y - j*s - s/2;
-                            float dz = 1;
-                            glm::vec3 origin(0, 0, 0);
-                            glm::vec3 direction(dx, dy, dz);
-                            direction = glm::normalize(direction);
-                            Ray ray(origin, direction);
-                            try {
-                                image.setPixel(i, j, toneMapping(trace_ray(lights, ambient_light, objects, ray, bbox)));
-                            } catch (...) {
-                                image.setPixel(i, j, glm::vec3(0,0,0));
-                                cout << "Error at pixel: " << i << " " << j << endl;
-                            }
-                        }
-                    }
-                };
-
-    // Submitting the rendering tasks to all the available threads
-     for (int a = 0; a < threads; a++) {
-         pool.push_task(task,
-                         int(a*(double(height)/threads)),
-                         int((a+1)*(double(height)/threads)));
-     }
-     cout << "Submitted tasks" << endl;
-     pool.wait_for_tasks();
-     cout << "Finished tasks" << endl;
+    atomic<long long> rays(0); // number of rays traced, primary and secondary
+    if (pathTracing) {
+        // each pass adds a path through a random point of every pixel which is still noisy
+        AccumulationBuffer buffer(width, height);
+        Denoiser denoiser(denoise ? width : 0, denoise ? height : 0); // features of the pixels, gathered along the paths
+        auto sample = [&](int i, int j, uint32_t pass) {
+            uint32_t random = (uint32_t)(j * width + i) * 0x9e3779b9u ^ pass * 0x85ebca6bu;
+            float dx = X + (i + random_float(random))*s;
+            float dy = Y - (j + random_float(random))*s;
+            Ray ray(glm::vec3(0, 0, 0), glm::normalize(glm::vec3(dx, dy, 1)));
+            int count = 0;
+            Features features;
+            glm::vec3 color = trace_path(lights, objects, materials, ray, bbox, settings, random, &count, denoise ? &features : nullptr);
+            if (denoise) denoiser.add(j * width + i, features);
+            rays += count;
+            return color;
+        };
+        auto frame = [&](uint32_t pass, long active) {
+            if (progress == 0 || pass % progress != 0) return;
+            cout << "Pass " << pass << ", " << active << " pixels still sampled" << endl;
+            buffer.write(image);
+            image.writeImage(output);
+        };
+        uint32_t passes = render_progressive(buffer, progressive, pool, sample, frame);
+        if (denoise) {
+            vector<glm::vec3> colors(width * height);
+            for (int k = 0; k < width * height; k++) colors[k] = buffer.mean(k);
+            DenoiseSettings denoising;
+            denoising.pixelSpread = s;
+            timer tm;
+            tm.start();
+            denoiser.filter(colors, denoising, pool);
+            tm.stop();
+            cout << "Denoised in " << tm.ms() << " ms" << endl;
+            for (int k = 0; k < width * height; k++) image.setPixel(k % width, k / width, toneMapping(colors[k]));
+        } else {
+            buffer.write(image);
+        }
+        long long samples = 0;
+        for (int k = 0; k < width * height; k++) samples += buffer.samples(k);
+        cout << "Path traced " << passes << " passes, " << (double)samples / (width * height) << " samples per pixel" << endl;
+    } else {
+        // one ray through the center of every pixel, and more where the image has edges, see render_adaptive, or
+        // the same number of rays in every pixel, filtered into the image as they are traced
+        Film film(width, height, filter);
+        auto camera = [&](float x, float y) {
+            return Ray(glm::vec3(0, 0, 0), glm::normalize(glm::vec3(X + x*s, Y - y*s, 1)));
+        };
+        auto trace = [&](const Ray *group, int columns, int rows, glm::vec3 *colors, uint32_t seed, uint32_t stride) {
+            int count = 0;
+            try {
+                trace_tile(lights, ambient_light, objects, materials, group, columns, rows, bbox, settings, colors, seed, stride, &count);
+            } catch (...) {
+                for(int k = 0; k < columns * rows; k++) colors[k] = glm::vec3(0,0,0);
+                cout << "Error at rays: " << seed << " (" << columns << "x" << rows << ")" << endl;
+            }
+            rays += count;
+        };
+        if (samples > 0) {
+            render_supersampled(film, samples, pool, camera, trace);
+        } else {
+            AdaptiveStatistics stats = render_adaptive(film, antialiasing, pool, camera, trace);
+            cout << "Refined " << stats.refined << " pixels, " << (double)stats.samples / (width * height) << " samples per pixel" << endl;
+        }
+        film.write(image);
+    }
 
     t = clock() - t;
     cout<<"It took " << ((float)t)/CLOCKS_PER_SEC<< " seconds to render the image."<< endl;
     cout<<"I could render at "<< (float)CLOCKS_PER_SEC/((float)t) << " frames per second."<<endl;
+    cout << "Traced " << rays << " rays, " << (double)rays / (width * height) << " per pixel." << endl;
+
+    if (clusters) {
+        auto stats = clusters->statistics();
+        cout << "Clusters paged in " << stats.loads << " times, evicted " << stats.evictions << " times, peak memory " << stats.peakBytes / 1024 << " KB" << endl;
+    }
+    auto textures = materials.textureCache.statistics();
+    if (textures.loads > 0) {
+        cout << "Texture tiles paged in " << textures.loads << " times, evicted " << textures.evictions << " times, peak memory " << textures.peakBytes / 1024 << " KB" << endl;
+    }
 
 	// Writing the final results of the rendering
-	if (argc == 2){
-		image.writeImage(argv[2]);
-	}else{
-		image.writeImage("result.ppm");
-	}
+	image.writeImage(output);
 
     return 0;
 }